@@ -0,0 +1,250 @@
+#define _POSIX_C_SOURCE 200809L /* posix_memalign, nanosleep */
+#define _DEFAULT_SOURCE /* htobe64 */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "capture.h"
+#include "print.h"
+
+/* Writer thread, see struct capture. */
+static void *capture_func(void *args0);
+/* Write all of iov and add the bytes written to out_written.
+ * Returns 0 on success, 1 on error (errno is set).
+ */
+static int capture_writev(int fd, struct iovec *iov, int iovcnt,
+    uint64_t *out_written);
+/* Copy len bytes of src to the ring at position pos, wrapping around. */
+static void ring_copy(struct capture_ring *ring, uint64_t pos,
+    const void *src, size_t len);
+
+int capture_open(struct capture *cap, const char *path, size_t shards,
+    size_t ring_size)
+{
+	size_t size = 4096;
+	int ret = 0;
+
+	memset(cap, 0, sizeof(*cap));
+	while (size < ring_size) size <<= 1;
+
+	cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cap->fd == -1) goto open_err;
+	if (write(cap->fd, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1)
+	    != sizeof(CAPTURE_MAGIC) - 1)
+		goto rings_err;
+	cap->written = sizeof(CAPTURE_MAGIC) - 1;
+
+	ret = posix_memalign((void **)&cap->rings, 64,
+	    shards * sizeof(*cap->rings));
+	if (ret != 0) {
+		cap->rings = NULL;
+		errno = ret;
+		goto rings_err;
+	}
+	memset(cap->rings, 0, shards * sizeof(*cap->rings));
+	for (; cap->rings_len < shards; ++cap->rings_len) {
+		struct capture_ring *ring = &cap->rings[cap->rings_len];
+
+		ring->buf = malloc(size);
+		if (ring->buf == NULL) goto thread_err;
+		ring->cap = size;
+	}
+
+	ret = pthread_create(&cap->thread, NULL, capture_func, cap);
+	if (ret != 0) {
+		errno = ret;
+		goto thread_err;
+	}
+
+	return 0;
+
+thread_err:
+	for (size_t n = 0; n < cap->rings_len; ++n) {
+		free(cap->rings[n].buf);
+	}
+	free(cap->rings);
+rings_err:
+	ret = errno;
+	close(cap->fd);
+	errno = ret;
+open_err:
+	memset(cap, 0, sizeof(*cap));
+	cap->fd = -1;
+	return 1;
+}
+
+void capture_rec_set(struct capture_rec *rec, const struct sockaddr *addr,
+    size_t len, uint64_t rx_ns)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->rx_ns = htobe64(rx_ns);
+	rec->len = htonl(len);
+	if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *addr6 = (const void *)addr;
+
+		rec->family = htons(6);
+		rec->port = addr6->sin6_port;
+		memcpy(rec->addr, &addr6->sin6_addr, sizeof(addr6->sin6_addr));
+	} else if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in *addr4 = (const void *)addr;
+
+		rec->family = htons(4);
+		rec->port = addr4->sin_port;
+		memcpy(rec->addr, &addr4->sin_addr, sizeof(addr4->sin_addr));
+	} else if (addr->sa_family == AF_UNIX) {
+		const struct sockaddr_un *addr_un = (const void *)addr;
+
+		memcpy(rec->addr, addr_un->sun_path, sizeof(rec->addr));
+	}
+}
+
+bool capture_add(struct capture_ring *ring, const struct sockaddr *addr,
+    const void *buf, size_t len, uint64_t rx_ns)
+{
+	struct capture_rec rec = {0};
+	const uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	const uint64_t head = ring->head;
+
+	if (head + sizeof(rec) + len - tail > ring->cap) return false;
+
+	capture_rec_set(&rec, addr, len, rx_ns);
+	ring_copy(ring, head, &rec, sizeof(rec));
+	ring_copy(ring, head + sizeof(rec), buf, len);
+	/* Publish the whole record at once. */
+	__atomic_store_n(&ring->head, head + sizeof(rec) + len,
+	    __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void capture_close(struct capture *cap)
+{
+	if (cap->fd == -1) return;
+
+	__atomic_store_n(&cap->stop, true, __ATOMIC_RELEASE);
+	pthread_join(cap->thread, NULL);
+	if (close(cap->fd) != 0)
+		perror("Failed to close capture: %s", strerror(errno));
+	if (cap->lost != 0)
+		pwarn("Capture lost %" PRIu64 " bytes to write errors",
+		    cap->lost);
+	for (size_t n = 0; n < cap->rings_len; ++n) {
+		free(cap->rings[n].buf);
+	}
+	free(cap->rings);
+	cap->rings = NULL;
+	cap->rings_len = 0;
+	cap->fd = -1;
+}
+
+static void *capture_func(void *args0)
+{
+	struct capture *cap = (struct capture *)args0;
+	struct iovec iov[2 * CAPTURE_RINGS_MAX];
+	uint64_t heads[CAPTURE_RINGS_MAX] = {0};
+	const struct timespec interval = {
+		CAPTURE_INTERVAL / 1000, (CAPTURE_INTERVAL % 1000) * 1000000
+	};
+	bool stop = false, failed = false;
+	uint64_t len_all = 0, written = 0;
+	int iovcnt = 0;
+
+	do {
+		/* Read stop first, the last pass then sees every record. */
+		stop = __atomic_load_n(&cap->stop, __ATOMIC_ACQUIRE);
+		iovcnt = 0;
+		len_all = 0;
+		for (size_t n = 0;
+		    n < cap->rings_len && n < CAPTURE_RINGS_MAX; ++n) {
+			struct capture_ring *ring = &cap->rings[n];
+			const size_t off = ring->tail & (ring->cap - 1);
+			size_t len = 0, first = 0;
+
+			heads[n] = __atomic_load_n(&ring->head,
+			    __ATOMIC_ACQUIRE);
+			len = heads[n] - ring->tail;
+			first = MIN(len, ring->cap - off);
+			if (first > 0) {
+				iov[iovcnt].iov_base = ring->buf + off;
+				iov[iovcnt++].iov_len = first;
+			}
+			if (len > first) {
+				iov[iovcnt].iov_base = ring->buf;
+				iov[iovcnt++].iov_len = len - first;
+			}
+			len_all += len;
+		}
+		/* Keep draining after errors, so shards don't fill up. A
+		 * partial record would garble the rest of the file, so nothing
+		 * is written after the first error.
+		 */
+		written = 0;
+		if (iovcnt > 0 && !failed && capture_writev(cap->fd, iov,
+		    iovcnt, &written) != 0) {
+			perror("Failed to write capture: %s", strerror(errno));
+			failed = true;
+		}
+		cap->written += written;
+		cap->lost += len_all - written;
+		for (size_t n = 0;
+		    n < cap->rings_len && n < CAPTURE_RINGS_MAX; ++n) {
+			__atomic_store_n(&cap->rings[n].tail, heads[n],
+			    __ATOMIC_RELEASE);
+		}
+		if (!stop) nanosleep(&interval, NULL);
+	} while (!stop);
+
+	return NULL;
+}
+
+static int capture_writev(int fd, struct iovec *iov, int iovcnt,
+    uint64_t *out_written)
+{
+	ssize_t written = 0;
+
+	while (iovcnt > 0) {
+		written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		*out_written += written;
+		/* Skip what was written, partial writes continue mid iov. */
+		for (; iovcnt > 0 && (size_t)written >= iov->iov_len;
+		    ++iov, --iovcnt)
+			written -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+static void ring_copy(struct capture_ring *ring, uint64_t pos,
+    const void *src, size_t len)
+{
+	const size_t off = pos & (ring->cap - 1);
+	const size_t first = MIN(len, ring->cap - off);
+
+	memcpy(ring->buf + off, src, first);
+	memcpy(ring->buf, (const char *)src + first, len - first);
+}
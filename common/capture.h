@@ -0,0 +1,74 @@
+#ifndef COMMON_CAPTURE_H
+#define COMMON_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "config.h"
+
+/* Capture log of received datagrams, to replay real traffic offline (see
+ * udpmsg replay). The file starts with CAPTURE_MAGIC, followed by a record
+ * header and the payload for every datagram. This is the same format as
+ * udpmsg's binary log.
+ */
+#define CAPTURE_MAGIC "UMSGLOG1"
+
+/* All fields are big endian, addr holds an IPv4 address in its first 4
+ * bytes, an IPv6 address or the start of an AF_UNIX path.
+ */
+struct capture_rec {
+	uint64_t rx_ns; /* CLOCK_REALTIME the datagram was received. */
+	uint32_t len; /* Bytes of payload following the header. */
+	uint16_t family; /* 4, 6 or 0 for AF_UNIX. */
+	uint16_t port;
+	uint8_t addr[16];
+};
+
+/* Byte ring of records, written by one shard and read by the writer
+ * thread. head and tail only grow, records may wrap around the end.
+ */
+struct capture_ring {
+	char *buf;
+	size_t cap; /* Power of two. */
+	uint64_t head; /* Written by the shard. */
+	char pad[64 - sizeof(uint64_t)];
+	uint64_t tail; /* Written by the writer thread. */
+} __attribute__((aligned(64)));
+
+/* Shards append records to their own ring and never block or make a
+ * syscall, records that don't fit are dropped. A background thread writes
+ * whatever is in all rings with one writev every CAPTURE_INTERVAL ms.
+ */
+struct capture {
+	int fd;
+	struct capture_ring *rings;
+	size_t rings_len;
+	pthread_t thread;
+	bool stop;
+	uint64_t written; /* Bytes, only read after capture_close. */
+	uint64_t lost; /* Bytes not written after a write error, same. */
+};
+
+/* Create (or truncate) the file at path and start the writer thread, with
+ * one ring of ring_size bytes (rounded up to a power of two) per shard.
+ * Returns 0 on success, 1 on error (errno is set).
+ */
+int capture_open(struct capture *_cap, const char *_path, size_t _shards,
+    size_t _ring_size);
+/* Fill rec for a datagram of len bytes from addr, received at rx_ns. */
+void capture_rec_set(struct capture_rec *_rec, const struct sockaddr *_addr,
+    size_t _len, uint64_t _rx_ns);
+/* Append a record of a datagram from addr to ring, called by the ring's
+ * shard only. Returns false if the ring was full and the record dropped.
+ */
+bool capture_add(struct capture_ring *_ring, const struct sockaddr *_addr,
+    const void *_buf, size_t _len, uint64_t _rx_ns);
+/* Stop the writer thread after it wrote everything, and close the file.
+ * Shards must not call capture_add any more.
+ */
+void capture_close(struct capture *_cap);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef COMMON_CONFIG_H
+#define COMMON_CONFIG_H
+
+/* Compile time options of common/, the code udpchat and udpecho share.
+ * udpchat's config.h includes this file.
+ */
+
+/* == Helper macros == */
+#define MAX(_a, _b) ((_a > _b) ? _a : _b)
+#define MIN(_a, _b) ((_a < _b) ? _a : _b)
+
+/* == Compile time options == */
+/* = Logging = */
+/* Controls wether the log* functions print anything. */
+#ifndef PRINT_DEBUG
+#define PRINT_DEBUG (1)
+#endif
+#ifndef PRINT_INFO
+#define PRINT_INFO (1)
+#endif
+#ifndef PRINT_WARN
+#define PRINT_WARN (1)
+#endif
+#ifndef PRINT_ERROR
+#define PRINT_ERROR (1)
+#endif
+#define PRINT_WRITE_MUTEX 1
+/* = net = */
+/* Socket tuning, 0 keeps the kernel default. Buffers are in bytes and use
+ * SO_*BUFFORCE when SOCK_BUFFORCE is 1 (needs CAP_NET_ADMIN), busy polling
+ * is in us.
+ */
+#ifndef SOCK_RCVBUF
+#define SOCK_RCVBUF (0)
+#endif
+#ifndef SOCK_SNDBUF
+#define SOCK_SNDBUF (0)
+#endif
+#ifndef SOCK_BUFFORCE
+#define SOCK_BUFFORCE (0)
+#endif
+#ifndef SOCK_BUSY_POLL
+#define SOCK_BUSY_POLL (0)
+#endif
+/* Sockets that drop datagrams (SO_RXQ_OVFL) get their SO_RCVBUF doubled
+ * every tick of rxdrop_tick up to RCVBUF_MAX bytes. Dropping for
+ * RXDROP_OVERLOAD ticks at the max is logged as overload.
+ */
+#ifndef RCVBUF_MAX
+#define RCVBUF_MAX (8 * 1024 * 1024)
+#endif
+#ifndef RXDROP_OVERLOAD
+#define RXDROP_OVERLOAD (5)
+#endif
+/* = capture = */
+/* Bytes buffered per ring of the capture log (-w), udpchat has one ring per
+ * shard and udpecho one. Records are dropped when the writer falls behind.
+ * The writer wakes up every CAPTURE_INTERVAL ms.
+ */
+#ifndef CAPTURE_RING_SIZE
+#define CAPTURE_RING_SIZE (4 * 1024 * 1024)
+#endif
+#ifndef CAPTURE_INTERVAL
+#define CAPTURE_INTERVAL (10)
+#endif
+/* Max rings of the capture log. */
+#ifndef CAPTURE_RINGS_MAX
+#define CAPTURE_RINGS_MAX (64)
+#endif
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef COMMON_HIST_H
+#define COMMON_HIST_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Log-linear histogram of durations in ns. Every power of two is split in
+ * 1 << HIST_SUB_BITS buckets (25% precision), the last bucket starts at
+ * about 7.5 s and takes everything above.
+ *
+ * A histogram has a single writer (hist_add), other threads may read it at
+ * any time with hist_merge.
+ */
+#define HIST_SUB_BITS (2)
+#define HIST_BUCKETS (128)
+
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t max;
+};
+
+static inline size_t hist_bucket(uint64_t ns)
+{
+	unsigned bit = 0;
+	size_t bucket = 0;
+
+	if (ns < (1U << HIST_SUB_BITS)) return ns;
+	bit = 63 - __builtin_clzll(ns);
+	bucket = (size_t)(bit - HIST_SUB_BITS + 1) << HIST_SUB_BITS
+	    | ((ns >> (bit - HIST_SUB_BITS)) & ((1U << HIST_SUB_BITS) - 1));
+
+	return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+/* Smallest value that lands in bucket. */
+static inline uint64_t hist_bucket_min(size_t bucket)
+{
+	const size_t sub = bucket & ((1U << HIST_SUB_BITS) - 1);
+	unsigned shift = 0;
+
+	if (bucket < (1U << HIST_SUB_BITS)) return bucket;
+	shift = (bucket >> HIST_SUB_BITS) - 1;
+
+	return (uint64_t)((1U << HIST_SUB_BITS) | sub) << shift;
+}
+
+static inline void hist_add(struct hist *h, uint64_t ns)
+{
+	__atomic_add_fetch(&h->count[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+	if (ns > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+		__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+/* Add the counts of src to dst, dst must not be written concurrently. */
+static inline void hist_merge(struct hist *dst, const struct hist *src)
+{
+	uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+
+	for (size_t n = 0; n < HIST_BUCKETS; ++n) {
+		dst->count[n] += __atomic_load_n(&src->count[n],
+		    __ATOMIC_RELAXED);
+	}
+	if (max > dst->max) dst->max = max;
+}
+
+static inline uint64_t hist_total(const struct hist *h)
+{
+	uint64_t total = 0;
+
+	for (size_t n = 0; n < HIST_BUCKETS; ++n) {
+		total += h->count[n];
+	}
+
+	return total;
+}
+
+/* Upper bound of the bucket holding the permille'th value (500 is the
+ * median), capped by the max. Returns 0 for an empty histogram.
+ */
+static inline uint64_t hist_quantile(const struct hist *h, unsigned permille)
+{
+	const uint64_t total = hist_total(h);
+	uint64_t rank = 0, seen = 0;
+
+	if (total == 0) return 0;
+	rank = (total * permille + 999) / 1000;
+	if (rank == 0) rank = 1;
+	for (size_t n = 0; n < HIST_BUCKETS - 1; ++n) {
+		seen += h->count[n];
+		if (seen >= rank) {
+			const uint64_t upper = hist_bucket_min(n + 1) - 1;
+			return upper < h->max ? upper : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+#endif /* COMMON_HIST_H */
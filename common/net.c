@@ -0,0 +1,675 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* ip_mreqn */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netdb.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "net.h"
+
+/* Helper macros. */
+#define MAX(_a, _b) ((_a > _b) ? _a : _b)
+#define MIN(_a, _b) ((_a < _b) ? _a : _b)
+
+/* Entries in the addr2str IPv6 cache, must be a power of 2. 0 disables
+ * it.
+ */
+#ifndef ADDR2STR_CACHE_LEN
+#define ADDR2STR_CACHE_LEN (16)
+#endif
+
+/* Static buffer to hold ip, can max hold ipv6. */
+#define _ip_buffer_len (MAX(INET_ADDRSTRLEN, INET6_ADDRSTRLEN))
+static __thread char _ip_buffer[_ip_buffer_len] = "";
+/* AF_UNIX paths don't fit in _ip_buffer. */
+static __thread char _unix_buffer[sizeof(((struct sockaddr_un *)0)->sun_path)
+    + 1] = "";
+
+#if ADDR2STR_CACHE_LEN > 0
+/* Direct mapped, the key has port 0 since only the address is shown. */
+struct addr2str_entry {
+	struct addr_key key;
+	char str[_ip_buffer_len];
+};
+static __thread struct addr2str_entry _addr2str_cache[ADDR2STR_CACHE_LEN];
+#endif
+
+/* Format into dst, which has room for INET_ADDRSTRLEN or INET6_ADDRSTRLEN.
+ * Return length without terminator.
+ */
+static size_t fmt_ip4(char *dst, const uint8_t *src);
+static size_t fmt_ip6(char *dst, const uint8_t *src);
+/* Append an AF_UNIX node for spec (without UNIX_PREFIX) at *tail.
+ * Returns 0 on success, or an EAI_* error.
+ */
+static int unix_addrinfo(const char *spec, struct addrinfo **tail);
+
+const char *addr2str(int af, const struct sockaddr *src)
+{
+	const struct sockaddr_in6 *addr6 = (void *)src;
+	const struct sockaddr_in  *addr4 = (void *)src;
+	const void *ip = NULL;
+	char *dst = _ip_buffer;
+
+	switch (af) {
+	case AF_INET:
+		ip = &addr4->sin_addr;
+		break;
+	case AF_INET6:
+		ip = &addr6->sin6_addr;
+		break;
+	case AF_UNIX: {
+		const struct sockaddr_un *addr_un = (void *)src;
+		const size_t len = sizeof(addr_un->sun_path) - 1;
+
+		if (addr_un->sun_path[0] != '\0') {
+			memcpy(_unix_buffer, addr_un->sun_path, len);
+			_unix_buffer[len] = '\0';
+		} else if (addr_un->sun_path[1] != '\0') {
+			_unix_buffer[0] = '@';
+			memcpy(&_unix_buffer[1], &addr_un->sun_path[1], len);
+			_unix_buffer[len + 1] = '\0';
+		} else {
+			strcpy(_unix_buffer, "unnamed");
+		}
+		return _unix_buffer;
+	}
+	default:
+		errno = EAFNOSUPPORT; /* Address family not supported. */
+		return NULL;
+	}
+
+#if ADDR2STR_CACHE_LEN > 0
+	/* IPv4 is formatted faster than it is looked up. */
+	if (af == AF_INET6) {
+		struct addr_key key = {0};
+		struct addr2str_entry *entry = NULL;
+
+		if (addr_key_set(&key, src) != 0) return NULL;
+		/* Mapped addresses are shown in IPv6 form. */
+		key.family = AF_INET6;
+		key.port = 0;
+		entry = &_addr2str_cache[addr_key_hash(&key)
+		    & (ADDR2STR_CACHE_LEN - 1)];
+		if (addr_key_eq(&entry->key, &key))
+			return entry->str;
+		entry->key = key;
+		dst = entry->str;
+	}
+#endif
+	if (af == AF_INET)
+		fmt_ip4(dst, ip);
+	else
+		fmt_ip6(dst, ip);
+
+	return dst;
+}
+
+const char *addr_ntop(int af, const void *src, char *dst, socklen_t size)
+{
+	char buffer[_ip_buffer_len] = "";
+	size_t len = 0;
+
+	switch (af) {
+	case AF_INET:
+		len = fmt_ip4(buffer, src);
+		break;
+	case AF_INET6:
+		len = fmt_ip6(buffer, src);
+		break;
+	default:
+		errno = EAFNOSUPPORT; /* Address family not supported. */
+		return NULL;
+	}
+	if (len >= size) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	return memcpy(dst, buffer, len + 1);
+}
+
+int addr_key_set(struct addr_key *key, const struct sockaddr *src)
+{
+	const struct sockaddr_in6 *addr6 = (const void *)src;
+	const struct sockaddr_in  *addr4 = (const void *)src;
+
+	memset(key, 0, sizeof(*key));
+	switch (src->sa_family) {
+	case AF_INET:
+		key->family = AF_INET;
+		key->port = addr4->sin_port;
+		key->addr[10] = 0xff;
+		key->addr[11] = 0xff;
+		memcpy(&key->addr[12], &addr4->sin_addr, 4);
+		return 0;
+	case AF_INET6:
+		key->family = IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)
+		    ? AF_INET : AF_INET6;
+		key->port = addr6->sin6_port;
+		memcpy(key->addr, &addr6->sin6_addr, sizeof(key->addr));
+		return 0;
+	case AF_UNIX: {
+		const struct sockaddr_un *addr_un = (const void *)src;
+		/* Two FNV-1a lanes with different bases, 128 bits. */
+		uint64_t lo = 0xcbf29ce484222325ULL, hi = 0x84222325cbf29ce4ULL;
+
+		for (size_t n = 0; n < sizeof(addr_un->sun_path); ++n) {
+			const uint8_t c = addr_un->sun_path[n];
+
+			lo = (lo ^ c) * 0x100000001b3ULL;
+			hi = (hi ^ c ^ (hi >> 29)) * 0x100000001b3ULL;
+		}
+		key->family = AF_UNIX;
+		memcpy(&key->addr[0], &lo, sizeof(lo));
+		memcpy(&key->addr[8], &hi, sizeof(hi));
+		return 0;
+	}
+	default:
+		errno = EAFNOSUPPORT; /* Address family not supported. */
+		return -1;
+	}
+}
+
+/* Go throught all IPs provided and create one large addrinfo list.
+ * If bind_ips is NULL, let the OS choose.
+ */
+int create_addrinfo(const char *port, const char **bind_ips,
+    size_t bind_ips_len, struct addrinfo **out)
+{
+	struct addrinfo *first = NULL, *current = NULL, hints = {0};
+	/* Next pointer of the last node, so appending is O(1). */
+	struct addrinfo **tail = &first;
+	unsigned long port_first = 0, port_last = 0;
+	char port_buffer[sizeof("65535")] = "";
+	char *end = NULL;
+	int status = 1, ret = 0;
+
+	hints.ai_family = AF_UNSPEC; /* Any IP version. */
+	hints.ai_socktype = SOCK_DGRAM; /* Must be datagram. */
+	/* Host must be an ip and if no host is provided let the os choose. */
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+	hints.ai_protocol = IPPROTO_UDP; /* Must be UDP. */
+
+	/* Port range, anything else (like service names) is passed as is. */
+	port_first = strtoul(port, &end, 10);
+	if (end != port && *end == '-') {
+		port_last = strtoul(end + 1, &end, 10);
+		if (*end != '\0' || port_last < port_first
+		    || port_last > 65535) {
+			return EAI_SERVICE;
+		}
+	} else {
+		port_last = port_first;
+		end = NULL;
+	}
+
+	for (size_t n = 0; n < bind_ips_len || (n == 0 && bind_ips_len == 0);
+	    ++n)
+	for (unsigned long p = port_first; p <= port_last; ++p) {
+		if (bind_ips_len > 0 && strncmp(bind_ips[n], UNIX_PREFIX,
+		    sizeof(UNIX_PREFIX) - 1) == 0) {
+			ret = unix_addrinfo(bind_ips[n] + sizeof(UNIX_PREFIX) - 1,
+			    tail);
+			if (ret != 0) {
+				if (first != NULL) freeaddrinfo(first);
+				status = ret;
+				goto getaddrinfo_err;
+			}
+			tail = &(*tail)->ai_next;
+			/* Once, not for every port. */
+			break;
+		}
+		if (end != NULL)
+			snprintf(port_buffer, sizeof(port_buffer), "%lu", p);
+		ret = getaddrinfo(bind_ips_len > 0 ? bind_ips[n] : NULL,
+		    end != NULL ? port_buffer : port, &hints, &current);
+		if (ret != 0) {
+			if (first != NULL) {
+				freeaddrinfo(first);
+			}
+			status = ret;
+			goto getaddrinfo_err;
+		}
+		*tail = current;
+		while (*tail != NULL) {
+			tail = &(*tail)->ai_next;
+		}
+	}
+
+	status = 0;
+	*out = first;
+
+getaddrinfo_err:
+	return status;
+}
+
+
+/* Set SO_RCVBUF or SO_SNDBUF (opt), with FORCE first if force is set. The
+ * kernel doubles the size and clamps it to [rw]mem_max, unless FORCE worked,
+ * so it's read back.
+ * Returns flag, with SOCK_OPT_BUFFORCE if FORCE worked, or 0 if the buffer
+ * is smaller than size.
+ */
+static unsigned int set_buf(int sfd, int opt, bool force, int size,
+    unsigned int flag)
+{
+	int got = 0;
+	socklen_t got_len = sizeof(got);
+
+#if defined(SO_RCVBUFFORCE) && defined(SO_SNDBUFFORCE)
+	if (force && setsockopt(sfd, SOL_SOCKET, opt == SO_RCVBUF
+	    ? SO_RCVBUFFORCE : SO_SNDBUFFORCE, &size, sizeof(size)) == 0)
+		flag |= SOCK_OPT_BUFFORCE;
+	else
+#endif
+		setsockopt(sfd, SOL_SOCKET, opt, &size, sizeof(size));
+	if (getsockopt(sfd, SOL_SOCKET, opt, &got, &got_len) != 0
+	    || got < size)
+		return 0;
+
+	return flag;
+}
+
+int create_socket(const struct addrinfo *addr, const struct sock_opts *opts,
+    unsigned int *out_applied)
+{
+	unsigned int want = opts->want, applied = 0;
+	int sfd = -1, type = addr->ai_socktype, on = 1;
+
+	if (addr->ai_family != AF_INET6) want &= ~SOCK_OPT_V6ONLY;
+	if (addr->ai_family == AF_UNIX) want &= ~UNIX_SKIP;
+	if (want & SOCK_OPT_NONBLOCK) type |= SOCK_NONBLOCK;
+	if (want & SOCK_OPT_CLOEXEC) type |= SOCK_CLOEXEC;
+	sfd = socket(addr->ai_family, type, addr->ai_protocol);
+	if (sfd == -1) return -1;
+	applied |= want & (SOCK_OPT_NONBLOCK | SOCK_OPT_CLOEXEC);
+
+	if ((want & SOCK_OPT_REUSEPORT) && setsockopt(sfd, SOL_SOCKET,
+	    SO_REUSEPORT, &on, sizeof(on)) == 0)
+		applied |= SOCK_OPT_REUSEPORT;
+	if ((want & SOCK_OPT_V6ONLY) && setsockopt(sfd, IPPROTO_IPV6,
+	    IPV6_V6ONLY, &on, sizeof(on)) == 0)
+		applied |= SOCK_OPT_V6ONLY;
+	if (want & SOCK_OPT_RCVBUF)
+		applied |= set_buf(sfd, SO_RCVBUF, want & SOCK_OPT_BUFFORCE,
+		    opts->rcvbuf, SOCK_OPT_RCVBUF);
+	if (want & SOCK_OPT_SNDBUF)
+		applied |= set_buf(sfd, SO_SNDBUF, want & SOCK_OPT_BUFFORCE,
+		    opts->sndbuf, SOCK_OPT_SNDBUF);
+#ifdef SO_BUSY_POLL
+	if ((want & SOCK_OPT_BUSY_POLL) && setsockopt(sfd, SOL_SOCKET,
+	    SO_BUSY_POLL, &opts->busy_poll, sizeof(opts->busy_poll)) == 0)
+		applied |= SOCK_OPT_BUSY_POLL;
+#endif
+#ifdef SO_INCOMING_CPU
+	if ((want & SOCK_OPT_INCOMING_CPU) && setsockopt(sfd, SOL_SOCKET,
+	    SO_INCOMING_CPU, &opts->incoming_cpu,
+	    sizeof(opts->incoming_cpu)) == 0)
+		applied |= SOCK_OPT_INCOMING_CPU;
+#endif
+	if (want & SOCK_OPT_PKTINFO) {
+		if (addr->ai_family == AF_INET6 ? setsockopt(sfd, IPPROTO_IPV6,
+		    IPV6_RECVPKTINFO, &on, sizeof(on)) == 0
+		    : setsockopt(sfd, IPPROTO_IP, IP_PKTINFO, &on,
+		    sizeof(on)) == 0)
+			applied |= SOCK_OPT_PKTINFO;
+	}
+#ifdef SO_TIMESTAMPNS
+	if ((want & SOCK_OPT_TIMESTAMP) && setsockopt(sfd, SOL_SOCKET,
+	    SO_TIMESTAMPNS, &on, sizeof(on)) == 0)
+		applied |= SOCK_OPT_TIMESTAMP;
+#endif
+#ifdef SO_RXQ_OVFL
+	if ((want & SOCK_OPT_RXQ_OVFL) && setsockopt(sfd, SOL_SOCKET,
+	    SO_RXQ_OVFL, &on, sizeof(on)) == 0)
+		applied |= SOCK_OPT_RXQ_OVFL;
+#endif
+	/* Any option that is needed but wasn't applied. */
+	if (opts->need & want & ~applied) {
+		errno = ENOPROTOOPT;
+		goto err;
+	}
+
+	if (addr->ai_family == AF_UNIX
+	    ? unix_bind(sfd, addr->ai_addr, addr->ai_addrlen) != 0
+	    : bind(sfd, addr->ai_addr, addr->ai_addrlen) != 0)
+		goto err;
+
+	if (out_applied != NULL) *out_applied = applied;
+	return sfd;
+err:
+	close(sfd);
+	return -1;
+}
+
+void sock_unlink(int sfd)
+{
+	struct sockaddr_un addr = {0};
+	socklen_t addr_len = sizeof(addr);
+
+	if (getsockname(sfd, (void *)&addr, &addr_len) != 0) return;
+	if (addr.sun_family != AF_UNIX || addr_len <= sizeof(sa_family_t)
+	    || addr.sun_path[0] == '\0')
+		return;
+	unlink(addr.sun_path);
+}
+
+int sock_rcvbuf(int sfd, int size, bool force)
+{
+	int got = 0;
+	socklen_t got_len = sizeof(got);
+
+	if (size > 0) set_buf(sfd, SO_RCVBUF, force, size, 0);
+	if (getsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &got, &got_len) != 0)
+		return -1;
+
+	return got;
+}
+
+void rx_cmsg_parse(struct msghdr *msg, struct rx_cmsg *out)
+{
+	struct timespec ts = {0};
+
+	memset(out, 0, sizeof(*out));
+	if (msg->msg_controllen == 0) return;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET) continue;
+#ifdef SO_TIMESTAMPNS
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			out->timestamp = (uint64_t)ts.tv_sec * 1000000000
+			    + ts.tv_nsec;
+		}
+#endif
+#ifdef SO_RXQ_OVFL
+		if (cmsg->cmsg_type == SO_RXQ_OVFL)
+			memcpy(&out->dropped, CMSG_DATA(cmsg),
+			    sizeof(out->dropped));
+#endif
+	}
+}
+
+const char *sock_opts_str(unsigned int flags, char *dst, size_t size)
+{
+	static const char *const names[] = {
+		"reuseport", "rcvbuf", "sndbuf", "bufforce", "busy-poll",
+		"v6only", "incoming-cpu", "pktinfo", "nonblock", "cloexec",
+		"timestamp", "rxq-ovfl"
+	};
+	size_t len = 0;
+
+	if (size == 0) return dst;
+	dst[0] = '\0';
+	for (size_t n = 0; n < sizeof(names) / sizeof(names[0])
+	    && len < size; ++n) {
+		if (!(flags & (1U << n))) continue;
+		len += snprintf(&dst[len], size - len, len == 0 ? "%s" : ",%s",
+		    names[n]);
+	}
+	if (len == 0) snprintf(dst, size, "none");
+
+	return dst;
+}
+
+int create_mcast_socket(const char *group, const char *port,
+    const char *iface, int ttl, struct sockaddr_storage *addr,
+    socklen_t *addr_len)
+{
+	struct addrinfo *info = NULL, hints = {0};
+	int sfd = -1, ret = 0, loop = 1, ifindex = 0;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	if (iface != NULL) {
+		ifindex = if_nametoindex(iface);
+		if (ifindex == 0) return -1;
+	}
+	ret = getaddrinfo(group, port, &hints, &info);
+	if (ret != 0) return -2;
+	if (info->ai_addrlen > sizeof(*addr)) {
+		errno = EINVAL;
+		goto socket_err;
+	}
+
+	sfd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+	if (sfd == -1) goto socket_err;
+	if (info->ai_family == AF_INET) {
+		unsigned char loop4 = loop, ttl4 = ttl;
+		ret = setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop4,
+		    sizeof(loop4));
+		ret += setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl4,
+		    sizeof(ttl4));
+		if (ifindex != 0) {
+			struct ip_mreqn mreq = {0};
+			mreq.imr_ifindex = ifindex;
+			ret += setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_IF,
+			    &mreq, sizeof(mreq));
+		}
+	} else {
+		ret = setsockopt(sfd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop,
+		    sizeof(loop));
+		ret += setsockopt(sfd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl,
+		    sizeof(ttl));
+		if (ifindex != 0) {
+			ret += setsockopt(sfd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+			    &ifindex, sizeof(ifindex));
+		}
+	}
+	if (ret != 0) goto setsockopt_err;
+
+	memcpy(addr, info->ai_addr, info->ai_addrlen);
+	*addr_len = info->ai_addrlen;
+	freeaddrinfo(info);
+	return sfd;
+
+setsockopt_err:
+	close(sfd);
+socket_err:
+	freeaddrinfo(info);
+	return -1;
+}
+
+static int unix_addrinfo(const char *spec, struct addrinfo **tail)
+{
+	/* One block like glibc's nodes, so freeaddrinfo frees it. */
+	struct {
+		struct addrinfo info;
+		struct sockaddr_un addr;
+	} *node = NULL;
+	socklen_t len = 0;
+
+	node = calloc(1, sizeof(*node));
+	if (node == NULL) return EAI_MEMORY;
+	len = unix_addr_set(&node->addr, spec);
+	if (len == 0) {
+		free(node);
+		return EAI_NONAME;
+	}
+	node->info.ai_family = AF_UNIX;
+	node->info.ai_socktype = SOCK_DGRAM;
+	node->info.ai_addr = (void *)&node->addr;
+	node->info.ai_addrlen = len;
+	*tail = &node->info;
+
+	return 0;
+}
+
+socklen_t unix_addr_set(struct sockaddr_un *addr, const char *spec)
+{
+	size_t len = strlen(spec);
+
+	if (len == 0 || len >= sizeof(addr->sun_path)) return 0;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, spec, len);
+	/* Abstract names start with a 0 byte and aren't terminated. */
+	if (spec[0] == '@') {
+		addr->sun_path[0] = '\0';
+	} else {
+		++len;
+	}
+
+	return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+int unix_bind(int sfd, const struct sockaddr *addr, socklen_t addr_len)
+{
+	const struct sockaddr_un *addr_un = (const void *)addr;
+	struct stat st = {0};
+	int probe = -1, type = 0;
+	socklen_t type_len = sizeof(type);
+
+	if (bind(sfd, addr, addr_len) == 0) return 0;
+	if (errno != EADDRINUSE || addr_un->sun_path[0] == '\0') return -1;
+
+	/* Only remove sockets nobody is bound to any more. The probe needs
+	 * the same type, or connect fails with EPROTOTYPE.
+	 */
+	if (stat(addr_un->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode)
+	    || getsockopt(sfd, SOL_SOCKET, SO_TYPE, &type, &type_len) != 0) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+	probe = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (probe == -1) return -1;
+	if (connect(probe, addr, addr_len) == 0 || errno != ECONNREFUSED) {
+		close(probe);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	close(probe);
+	if (unlink(addr_un->sun_path) != 0) return -1;
+
+	return bind(sfd, addr, addr_len);
+}
+
+static size_t fmt_ip4(char *dst, const uint8_t *src)
+{
+	size_t len = 0;
+
+	for (size_t n = 0; n < 4; ++n) {
+		unsigned int byte = src[n];
+		if (byte >= 100) dst[len++] = '0' + byte / 100;
+		if (byte >= 10) dst[len++] = '0' + byte / 10 % 10;
+		dst[len++] = '0' + byte % 10;
+		dst[len++] = '.';
+	}
+	dst[--len] = '\0';
+
+	return len;
+}
+
+static size_t fmt_ip6(char *dst, const uint8_t *src)
+{
+	static const char hex[] = "0123456789abcdef";
+	uint16_t words[8] = {0};
+	/* Longest run of zero words, only runs of 2 or more are shortened. */
+	int best = -1, best_len = 1, cur = -1, cur_len = 0;
+	size_t len = 0;
+
+	for (int n = 0; n < 8; ++n) {
+		words[n] = src[n * 2] << 8 | src[n * 2 + 1];
+		if (words[n] != 0) {
+			cur = -1;
+			continue;
+		}
+		if (cur == -1) {
+			cur = n;
+			cur_len = 0;
+		}
+		/* First run wins on a tie. */
+		if (++cur_len > best_len) {
+			best = cur;
+			best_len = cur_len;
+		}
+	}
+
+	for (int n = 0; n < 8; ++n) {
+		uint16_t word = words[n];
+		if (best != -1 && n >= best && n < best + best_len) {
+			if (n == best) dst[len++] = ':';
+			continue;
+		}
+		if (n != 0) dst[len++] = ':';
+		/* IPv4-mapped (::ffff:a.b.c.d) and -compatible (::a.b.c.d). */
+		if (n == 6 && best == 0
+		    && (best_len == 6 || (best_len == 5 && words[5] == 0xffff)))
+			return len + fmt_ip4(&dst[len], &src[12]);
+		if (word >= 0x1000) dst[len++] = hex[word >> 12];
+		if (word >= 0x100) dst[len++] = hex[word >> 8 & 0xf];
+		if (word >= 0x10) dst[len++] = hex[word >> 4 & 0xf];
+		dst[len++] = hex[word & 0xf];
+	}
+	if (best != -1 && best + best_len == 8) dst[len++] = ':';
+	dst[len] = '\0';
+
+	return len;
+}
+
+/* Copyright (C) 2013 - 2015, Max Lv <max.c.lv@gmail.com>
+ *
+ * This function is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+int sockaddr_cmp(const struct sockaddr_storage* addr1,
+    const struct sockaddr_storage* addr2, socklen_t len)
+{
+	const struct sockaddr_in* p1_in = (const struct sockaddr_in*)addr1;
+	const struct sockaddr_in* p2_in = (const struct sockaddr_in*)addr2;
+	const struct sockaddr_in6* p1_in6 = (const struct sockaddr_in6*)addr1;
+	const struct sockaddr_in6* p2_in6 = (const struct sockaddr_in6*)addr2;
+	if( p1_in->sin_family < p2_in->sin_family)
+		return -1;
+	if( p1_in->sin_family > p2_in->sin_family)
+		return 1;
+	/* compare ip4 */
+	if( p1_in->sin_family == AF_INET ) {
+		/* just order it, ntohs not required */
+		if(p1_in->sin_port < p2_in->sin_port)
+			return -1;
+		if(p1_in->sin_port > p2_in->sin_port)
+			return 1;
+		return memcmp(&p1_in->sin_addr, &p2_in->sin_addr,
+		    sizeof(p1_in->sin_addr));
+	} else if (p1_in6->sin6_family == AF_INET6) {
+		/* just order it, ntohs not required */
+		if(p1_in6->sin6_port < p2_in6->sin6_port)
+			return -1;
+		if(p1_in6->sin6_port > p2_in6->sin6_port)
+			return 1;
+		return memcmp(&p1_in6->sin6_addr, &p2_in6->sin6_addr,
+		    sizeof(p1_in6->sin6_addr));
+	} else {
+		/* eek unknown type, perform this comparison for sanity. */
+		return memcmp(addr1, addr2, len);
+	}
+}
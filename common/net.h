@@ -0,0 +1,203 @@
+#ifndef COMMON_NET_H
+#define COMMON_NET_H
+#include <sys/socket.h> /* sockaddr */
+#include <sys/un.h> /* sockaddr_un */
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h> /* timespec */
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Canonical address and port, packed into 20 bytes so it can be hashed and
+ * compared as three words. The address is always stored as IPv6, IPv4 (and
+ * IPv4-mapped IPv6) as ::ffff:a.b.c.d with family AF_INET, so both forms of
+ * the same client give the same key. AF_UNIX addresses don't fit, their key
+ * holds a 128 bit hash of the path (port 0), compare the full address when
+ * keys match.
+ */
+struct addr_key {
+	uint16_t family; /* AF_INET, AF_INET6 or AF_UNIX. */
+	uint16_t port; /* Network order. */
+	uint8_t addr[16];
+};
+
+/* Bind addresses starting with this are Unix datagram sockets, the rest is
+ * the path ("unix:/run/chat.sock"), or an abstract name after '@'
+ * ("unix:@chat").
+ */
+#define UNIX_PREFIX "unix:"
+
+/* Convert sockaddr into human readable string. The string is stored in static
+ * memory, and will be overwritten on the next call. This function is thread-
+ * safe. On error errno is set and NULL is returned. Recently formatted IPv6
+ * addresses are kept in a small per thread cache (ADDR2STR_CACHE_LEN).
+ *
+ * AF_UNIX addresses give the path, abstract names start with '@' and
+ * unnamed (unbound) sockets are "unnamed".
+ *
+ * Possible errors:
+ * EAFNOSUPPORT - Address family not supported!
+ */
+const char *addr2str(int _af, const struct sockaddr *_src);
+/* Same as inet_ntop, but doesn't go through the locale aware printf
+ * machinery. IPv6 is formatted as in RFC 5952 (IPv4-mapped addresses end in
+ * dotted quad), so the output is the same as glibc's.
+ *
+ * Possible errors:
+ * EAFNOSUPPORT - Address family not supported!
+ * ENOSPC - dst is too small.
+ */
+const char *addr_ntop(int _af, const void *_src, char *_dst,
+    socklen_t _size);
+/* Create addrinfo from supplied info. If bind_ips is NULL, the OS chooses
+ * which addresses to bind to. port may be a range "first-last", every
+ * address is then bound to every port in it. bind_ips starting with
+ * UNIX_PREFIX give one AF_UNIX node each, ports don't apply to them. On
+ * error getaddrinfo is returned (EAI_SERVICE for an invalid range,
+ * EAI_NONAME for a too long path), else 0. The list is freed with
+ * freeaddrinfo.
+ *
+ * NOTES:
+ * Please use gai_strerror to get human readable error.
+ */
+int create_addrinfo(const char *_port, const char **_bind_ips,
+    size_t _bind_ips_len, struct addrinfo **_addr);
+
+/* Options for create_socket, one bit each. */
+#define SOCK_OPT_REUSEPORT    (1U << 0) /* SO_REUSEPORT */
+#define SOCK_OPT_RCVBUF       (1U << 1) /* SO_RCVBUF, rcvbuf bytes. */
+#define SOCK_OPT_SNDBUF       (1U << 2) /* SO_SNDBUF, sndbuf bytes. */
+#define SOCK_OPT_BUFFORCE     (1U << 3) /* Try SO_*BUFFORCE first (root). */
+#define SOCK_OPT_BUSY_POLL    (1U << 4) /* SO_BUSY_POLL, busy_poll us. */
+#define SOCK_OPT_V6ONLY       (1U << 5) /* IPV6_V6ONLY, IPv6 only. */
+#define SOCK_OPT_INCOMING_CPU (1U << 6) /* SO_INCOMING_CPU, incoming_cpu. */
+#define SOCK_OPT_PKTINFO      (1U << 7) /* IP_PKTINFO / IPV6_RECVPKTINFO */
+#define SOCK_OPT_NONBLOCK     (1U << 8) /* SOCK_NONBLOCK */
+#define SOCK_OPT_CLOEXEC      (1U << 9) /* SOCK_CLOEXEC */
+#define SOCK_OPT_TIMESTAMP    (1U << 10) /* SO_TIMESTAMPNS, see rx_cmsg. */
+#define SOCK_OPT_RXQ_OVFL     (1U << 11) /* SO_RXQ_OVFL, see rx_cmsg. */
+
+struct sock_opts {
+	unsigned int want; /* SOCK_OPT_* to try. */
+	unsigned int need; /* SOCK_OPT_* that must work, part of want. */
+	int rcvbuf, sndbuf;
+	int busy_poll;
+	int incoming_cpu;
+};
+
+/* Options create_socket skips on AF_UNIX sockets. */
+#define UNIX_SKIP (SOCK_OPT_REUSEPORT | SOCK_OPT_BUSY_POLL \
+    | SOCK_OPT_INCOMING_CPU | SOCK_OPT_PKTINFO)
+
+/* Create socket for addr with opts and bind it. Options that don't apply to
+ * the family (V6ONLY on IPv4, UNIX_SKIP on AF_UNIX) are skipped. Options
+ * the kernel refused are left out of applied, buffers only count when the
+ * kernel gave at least the requested size. A stale AF_UNIX socket file
+ * (nobody bound to it) is removed before binding.
+ * Returns fd, or -1 on error (errno is set). It is an error when an option
+ * in need didn't take effect.
+ */
+int create_socket(const struct addrinfo *_addr, const struct sock_opts *_opts,
+    unsigned int *_applied);
+/* Fill addr from spec, a UNIX_PREFIX address without the prefix.
+ * Returns the length of addr, or 0 if spec is empty or too long.
+ */
+socklen_t unix_addr_set(struct sockaddr_un *_addr, const char *_spec);
+/* Bind sfd (of any AF_UNIX type) to addr, a stale socket file (nobody bound
+ * to it) at its path is removed first.
+ * Returns 0 on success, -1 on error (errno is set).
+ */
+int unix_bind(int _sfd, const struct sockaddr *_addr, socklen_t _addr_len);
+/* Remove the file of sfd if it is an AF_UNIX socket bound to a path, call
+ * before closing the last fd of the socket.
+ */
+void sock_unlink(int _sfd);
+/* Write comma separated names of SOCK_OPT_* in flags to dst, "none" when
+ * flags is empty. Returns dst.
+ */
+const char *sock_opts_str(unsigned int _flags, char *_dst, size_t _size);
+/* Set SO_RCVBUF of sfd to size (SO_RCVBUFFORCE first with force), size 0
+ * only reads it. Returns the size the kernel uses (twice the requested
+ * size, capped by net.core.rmem_max without force), or -1 on error.
+ */
+int sock_rcvbuf(int _sfd, int _size, bool _force);
+
+/* Control messages of a datagram read with recvmsg, see rx_cmsg_parse. */
+struct rx_cmsg {
+	/* Kernel receive time (CLOCK_REALTIME, ns) with SOCK_OPT_TIMESTAMP,
+	 * 0 if none.
+	 */
+	uint64_t timestamp;
+	/* Datagrams the socket dropped since it was created, with
+	 * SOCK_OPT_RXQ_OVFL. The kernel leaves it out while it's 0.
+	 */
+	uint32_t dropped;
+};
+/* Room for the control messages rx_cmsg_parse looks for. */
+#define RX_CMSG_LEN (CMSG_SPACE(sizeof(struct timespec)) \
+    + CMSG_SPACE(sizeof(uint32_t)))
+void rx_cmsg_parse(struct msghdr *_msg, struct rx_cmsg *_out);
+
+/* Create a socket for sending to multicast group:port. Loopback is enabled,
+ * so members on this host receive the messages too, and ttl limits how many
+ * routers the messages pass. If iface (interface name) is not NULL, messages
+ * are sent on that interface instead of the one picked by the routing table.
+ * The group address is stored in addr.
+ * Returns fd, -1 on error (errno is set) or -2 on getaddrinfo error.
+ */
+int create_mcast_socket(const char *_group, const char *_port,
+    const char *_iface, int _ttl, struct sockaddr_storage *_addr,
+    socklen_t *_addr_len);
+
+/* Fill key from an AF_INET, AF_INET6 or AF_UNIX sockaddr. All of sun_path
+ * is hashed, so it has to be zero after the name.
+ * Returns 0 on success, -1 on error (errno is set).
+ *
+ * Possible errors:
+ * EAFNOSUPPORT - Address family not supported!
+ */
+int addr_key_set(struct addr_key *_key, const struct sockaddr *_src);
+
+/* 64 bit hash of key, all 20 bytes are mixed in. */
+static inline uint64_t addr_key_hash(const struct addr_key *key)
+{
+	uint64_t lo = 0, hi = 0, hash = 0;
+	uint32_t head = 0;
+
+	memcpy(&head, key, sizeof(head));
+	memcpy(&lo, &key->addr[0], sizeof(lo));
+	memcpy(&hi, &key->addr[8], sizeof(hi));
+	/* Two rounds of multiply and fold, as in murmur3's finalizer. */
+	hash = (lo ^ ((uint64_t)head << 32)) * 0x9e3779b97f4a7c15ULL;
+	hash = (hash ^ (hash >> 32) ^ hi) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 29)) * 0x94d049bb133111ebULL;
+
+	return hash ^ (hash >> 32);
+}
+
+/* True if both keys are equal, without branches. */
+static inline bool addr_key_eq(const struct addr_key *key1,
+    const struct addr_key *key2)
+{
+	uint64_t lo1 = 0, lo2 = 0, hi1 = 0, hi2 = 0;
+	uint32_t head1 = 0, head2 = 0;
+
+	memcpy(&head1, key1, sizeof(head1));
+	memcpy(&head2, key2, sizeof(head2));
+	memcpy(&lo1, &key1->addr[0], sizeof(lo1));
+	memcpy(&lo2, &key2->addr[0], sizeof(lo2));
+	memcpy(&hi1, &key1->addr[8], sizeof(hi1));
+	memcpy(&hi2, &key2->addr[8], sizeof(hi2));
+
+	return ((lo1 ^ lo2) | (hi1 ^ hi2) | (head1 ^ head2)) == 0;
+}
+
+/* Compare two sockaddrs. Will also compare port.
+ * Returns 0 if addr1 == addr2. -1 if addr1 is smaller, +1 if larger.
+ */
+int sockaddr_cmp(const struct sockaddr_storage* _addr1,
+    const struct sockaddr_storage* _addr2, socklen_t _len);
+
+#endif /* COMMON_NET_H */
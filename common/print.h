@@ -1,5 +1,5 @@
-#ifndef UTIL_PRINT_H
-#define UTIL_PRINT_H
+#ifndef COMMON_PRINT_H
+#define COMMON_PRINT_H
 
 #include <stdio.h>
 
@@ -0,0 +1,61 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "rxdrop.h"
+#include "net.h"
+#include "print.h"
+
+void rxdrop_init(struct rxdrop *rd, int fd, uint64_t now)
+{
+	int got = 0;
+
+	memset(rd, 0, sizeof(*rd));
+	rd->fd = fd;
+	rd->last_tick = now;
+	if (fd == -1) return;
+	/* The kernel reports twice the requested size. */
+	got = sock_rcvbuf(fd, 0, false);
+	rd->rcvbuf = got > 0 ? got / 2 : 0;
+	rd->at_max = rd->rcvbuf >= RCVBUF_MAX;
+}
+
+uint64_t rxdrop_tick(struct rxdrop *rd, uint64_t now)
+{
+	const uint64_t window = rd->window;
+	const uint64_t elapsed = now > rd->last_tick ? now - rd->last_tick : 1;
+	int got = 0, want = 0;
+
+	rd->last_tick = now;
+	rd->window = 0;
+	if (rd->fd == -1) return 0;
+	__atomic_store_n(&rd->dropped, rd->dropped + window, __ATOMIC_RELAXED);
+	__atomic_store_n(&rd->rate, window * 1000 / elapsed, __ATOMIC_RELAXED);
+	if (window == 0) {
+		rd->overload = 0;
+		return 0;
+	}
+
+	if (!rd->at_max) {
+		want = rd->rcvbuf > 0 && rd->rcvbuf <= RCVBUF_MAX / 2
+		    ? rd->rcvbuf * 2 : RCVBUF_MAX;
+		got = sock_rcvbuf(rd->fd, want, SOCK_BUFFORCE);
+		/* Capped by net.core.rmem_max (without SOCK_BUFFORCE). */
+		if (got > 0) rd->rcvbuf = MIN(got / 2, want);
+		rd->at_max = rd->rcvbuf < want || rd->rcvbuf >= RCVBUF_MAX;
+		pinfo("%d: dropped %" PRIu64 " datagrams (%" PRIu64 "/s), "
+		    "rcvbuf %d", rd->fd, window, rd->rate, rd->rcvbuf);
+		return window;
+	}
+
+	if (++rd->overload % RXDROP_OVERLOAD == 0) {
+		pwarn("%d: overloaded, dropping %" PRIu64 " datagrams/s for "
+		    "%u ticks at rcvbuf %d", rd->fd, rd->rate, rd->overload,
+		    rd->rcvbuf);
+	}
+
+	return window;
+}
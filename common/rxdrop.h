@@ -0,0 +1,50 @@
+#ifndef COMMON_RXDROP_H
+#define COMMON_RXDROP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+/* Receive drops of one socket of one shard, counted from SO_RXQ_OVFL, and
+ * the controller of its receive buffer. While a socket drops datagrams its
+ * SO_RCVBUF is doubled every tick up to RCVBUF_MAX. If it keeps dropping
+ * at the max for RXDROP_OVERLOAD ticks the shard is overloaded, and that
+ * is logged.
+ *
+ * Only the shard's thread writes, stats_print reads dropped and rate.
+ */
+struct rxdrop {
+	int fd;
+	uint32_t last; /* Last SO_RXQ_OVFL counter. */
+	uint64_t window; /* Drops since the last tick. */
+	uint64_t dropped; /* Drops since start. */
+	uint64_t rate; /* Drops per second in the last tick window. */
+	uint64_t last_tick; /* ms */
+	int rcvbuf; /* Requested SO_RCVBUF. */
+	bool at_max; /* rcvbuf can't grow any more. */
+	unsigned overload; /* Ticks with drops while at_max. */
+};
+
+/* Start counting for fd, now is the current time in ms. With fd -1 the
+ * entry counts nothing, for a socket that another entry counts already.
+ */
+void rxdrop_init(struct rxdrop *_rd, int _fd, uint64_t _now);
+/* Count drops from the SO_RXQ_OVFL counter of a received datagram, 0 when
+ * the datagram had none.
+ */
+static inline void rxdrop_update(struct rxdrop *_rd, uint32_t _counter)
+{
+	/* Unsigned difference handles the counter wrapping. */
+	if (_counter != 0 && _counter != _rd->last) {
+		_rd->window += (uint32_t)(_counter - _rd->last);
+		_rd->last = _counter;
+	}
+}
+/* Publish the drop rate and grow the receive buffer, called every
+ * HOUSEKEEP_INTERVAL. Returns drops since the previous tick.
+ */
+uint64_t rxdrop_tick(struct rxdrop *_rd, uint64_t _now);
+
+#endif
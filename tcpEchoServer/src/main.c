@@ -1,9 +1,16 @@
+#define _GNU_SOURCE // For MSG_ZEROCOPY and getopt()
 #include <stdio.h>
 #include <strings.h> // For bzero()
 #include <stdlib.h> // For exit()
+#include <string.h> // For memmove()
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h> // For waiting on the error queue
+#include <pthread.h> // For a thread per client
 
 #include <sys/socket.h> // For socket functions
 #include <netinet/in.h> // For protocol
+#include <linux/errqueue.h> // For zerocopy completions
 
 #include <unistd.h> // For closing fd
 
@@ -11,10 +18,80 @@
 
 #define MAXBACKLOG 10
 
+#define LEN 255
+// Framed messages (-f) start with their length as a 32-bit big endian
+// integer, the default max length can be changed with -m.
+#define FRAME_HDR 4
+#define FRAME_MAX (1024 * 1024)
+// Messages smaller than this are copied even with -z, pinning pages and
+// reading the completion costs more than copying them.
+#define ZEROCOPY_MIN (16 * 1024)
+
+// Size of every echoed message (-l).
+static size_t msglen = LEN;
+// Send messages of at least ZEROCOPY_MIN bytes with MSG_ZEROCOPY (-z).
+static int zerocopy = 0;
+
+// A client connection, served by its own thread.
+struct client {
+	int fd;
+	int verbose;
+	// SO_ZEROCOPY is enabled on fd, off when -z is off or it failed.
+	int zerocopy;
+	// The kernel numbers the MSG_ZEROCOPY sends of a socket from 0, for
+	// as long as it is open. zc_next is the number of the next send, all
+	// sends before zc_done are completed.
+	uint32_t zc_next;
+	uint32_t zc_done;
+};
+// Echo length prefixed frames until the client closes (-f), frames longer
+// than framemax (-m) close the connection.
+static int framed = 0;
+static size_t framemax = FRAME_MAX;
+
 void socket_v4(int verbose);
-void client_handle(int clientfd, int verbose);
+// Serve one client and close it, started for every accepted connection so
+// a client that keeps its connection open (-f) doesn't block the others.
+void *client_thread(void *arg);
+void client_handle(struct client *client, int verbose);
+// Echo every complete frame as soon as it was read, so clients can send
+// any number of frames before reading the replies.
+void framed_handle(struct client *client, int verbose);
+// Echo len bytes of buffer, with MSG_ZEROCOPY if enabled for the client
+// and len is large enough. Returns 0 on success and -1 on error.
+int echo_send(struct client *client, const char *buffer, size_t len, int verbose);
+// Write all of buffer, returns 0 on success and -1 on error.
+int write_all(int clientfd, const char *buffer, size_t len);
+// Send all of buffer with MSG_ZEROCOPY and wait until the kernel is done
+// with it, so buffer can be reused. Returns 0 on success and -1 on error.
+int send_zerocopy(struct client *client, const char *buffer, size_t len, int verbose);
+// Read completions until the client's sends before number end are done.
+// Sets *copied if the kernel had to copy anyway.
+int zerocopy_wait(struct client *client, uint32_t end, int *copied);
 
-int main(){
+int main(int argc, char *argv[]){
+	int opt;
+	while((opt = getopt(argc, argv, "l:zfm:")) != -1){
+		if(opt == 'l'){
+			msglen = strtoul(optarg, NULL, 10);
+		}
+		else if(opt == 'z'){
+			zerocopy = 1;
+		}
+		else if(opt == 'f'){
+			framed = 1;
+		}
+		else if(opt == 'm'){
+			framemax = strtoul(optarg, NULL, 10);
+		}
+		else{
+			msglen = 0;
+		}
+		if(msglen == 0 || framemax == 0 || framemax > UINT32_MAX){
+			fprintf(stderr, "Usage: %s [-l len | -f [-m max]] [-z]\n", argv[0]);
+			return 1;
+		}
+	}
 	socket_v4(1);
 	return 0;
 }
@@ -31,7 +108,7 @@ void socket_v4(int verbose){
 		LOG("socket() finished\n");
 	}
 	struct sockaddr_in addr;
-	
+
 	bzero((char *) &addr, sizeof(addr));
 	int portno = 8999;
 
@@ -55,25 +132,45 @@ void socket_v4(int verbose){
 		LOG("listen() finished\n");
 	}
 
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 	while(1){
 		int clientfd = accept(sockfd, NULL, NULL);
 		if(clientfd < 0){
 			perror("accept() failed");
 			//* Do not exit
+			continue;
 		}
 		else if(verbose){
 			LOG("accept() finished\n");
 		}
 
-		client_handle(clientfd, verbose);
-
-		if(close(clientfd) < 0){
-			perror("Failed to close connection to client");
+		struct client *client = calloc(1, sizeof(*client));
+		if(client == NULL){
+			perror("Failed to allocate client");
+			close(clientfd);
+			continue;
 		}
-		else if(verbose){
-			LOG("Failed to close connection to client\n");
+		client->fd = clientfd;
+		client->verbose = verbose;
+		// Only this connection copies if it fails.
+		int one = 1;
+		client->zerocopy = zerocopy;
+		if(client->zerocopy && setsockopt(client->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0){
+			perror("SO_ZEROCOPY failed, copying");
+			client->zerocopy = 0;
+		}
+		pthread_t thread;
+		int err = pthread_create(&thread, &attr, client_thread, client);
+		if(err != 0){
+			errno = err;
+			perror("Failed to start client thread");
+			close(client->fd);
+			free(client);
 		}
 	}
+	pthread_attr_destroy(&attr);
 
 	if(close(sockfd) < 0){
 		perror("close() failed");
@@ -84,24 +181,179 @@ void socket_v4(int verbose){
 	}
 }
 
-#define LEN 255
+void *client_thread(void *arg){
+	struct client *client = arg;
+	if(framed)
+		framed_handle(client, client->verbose);
+	else
+		client_handle(client, client->verbose);
+
+	if(close(client->fd) < 0){
+		perror("Failed to close connection to client");
+	}
+	else if(client->verbose){
+		LOG("Connection to client closed\n");
+	}
+	free(client);
+	return NULL;
+}
+
+void client_handle(struct client *client, int verbose){
 
-void client_handle(int clientfd, int verbose){
-	
 
-	char buffer[LEN];
-	int bytesRemaining = LEN;
-	while(bytesRemaining > 0){
-		int bread = read(clientfd, &buffer, bytesRemaining);
-		if(bread < -1){
-			perror("Failed to read");
+	char *buffer = malloc(msglen);
+	if(buffer == NULL){
+		perror("Failed to allocate buffer");
+		return;
+	}
+	size_t bytesRead = 0;
+	while(bytesRead < msglen){
+		ssize_t bread = read(client->fd, buffer + bytesRead, msglen - bytesRead);
+		if(bread <= 0){
+			if(bread < 0)
+				perror("Failed to read");
+			free(buffer);
 			return;
 		}
-		bytesRemaining = bytesRemaining-bread;
+		bytesRead += bread;
 	}
 
-	if(write(clientfd, buffer, LEN) < 0){
+	if(echo_send(client, buffer, msglen, verbose) < 0){
 		perror("Failed to write");
+	}
+	free(buffer);
+}
+
+void framed_handle(struct client *client, int verbose){
+	// Room for the longest frame, frames are echoed straight from here.
+	size_t cap = framemax + FRAME_HDR;
+	char *buffer = malloc(cap);
+	if(buffer == NULL){
+		perror("Failed to allocate buffer");
 		return;
 	}
-}
\ No newline at end of file
+	size_t len = 0;
+	while(1){
+		ssize_t bread = read(client->fd, buffer + len, cap - len);
+		if(bread <= 0){
+			if(bread < 0 && errno == EINTR)
+				continue;
+			if(bread < 0)
+				perror("Failed to read");
+			break;
+		}
+		len += bread;
+
+		// A reply is the same frame, so all complete frames at the
+		// start go back with one write.
+		size_t done = 0;
+		int toolong = 0;
+		while(len - done >= FRAME_HDR){
+			uint32_t flen;
+			memcpy(&flen, buffer + done, sizeof(flen));
+			flen = ntohl(flen);
+			if(flen > framemax){
+				if(verbose)
+					LOG("Frame of %u bytes is too long\n", flen);
+				toolong = 1;
+				break;
+			}
+			if(len - done - FRAME_HDR < flen)
+				break;
+			done += FRAME_HDR + flen;
+		}
+		if(done > 0 && echo_send(client, buffer, done, verbose) < 0){
+			perror("Failed to write");
+			break;
+		}
+		// Close after echoing the frames before it.
+		if(toolong)
+			break;
+		// Only the start of the next frame is moved.
+		memmove(buffer, buffer + done, len - done);
+		len -= done;
+	}
+	free(buffer);
+}
+
+int echo_send(struct client *client, const char *buffer, size_t len, int verbose){
+	if(client->zerocopy && len >= ZEROCOPY_MIN)
+		return send_zerocopy(client, buffer, len, verbose);
+	return write_all(client->fd, buffer, len);
+}
+
+int write_all(int clientfd, const char *buffer, size_t len){
+	while(len > 0){
+		ssize_t written = write(clientfd, buffer, len);
+		if(written < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buffer += written;
+		len -= written;
+	}
+	return 0;
+}
+
+int send_zerocopy(struct client *client, const char *buffer, size_t len, int verbose){
+	int copied = 0, ret = 0;
+	size_t sent = 0;
+	while(sent < len){
+		ssize_t bsent = send(client->fd, buffer + sent, len - sent, MSG_ZEROCOPY);
+		if(bsent < 0){
+			if(errno == EINTR)
+				continue;
+			// Out of memory for pinned pages, copy the rest.
+			if(errno == ENOBUFS)
+				break;
+			ret = -1;
+			break;
+		}
+		sent += bsent;
+		// Every successful send gets the next number of the socket.
+		++client->zc_next;
+	}
+	// The pages stay pinned until the completions arrive, even on error.
+	// Earlier calls waited for theirs, so this covers exactly our sends.
+	if(zerocopy_wait(client, client->zc_next, &copied) < 0)
+		ret = -1;
+	if(ret == 0 && sent < len)
+		ret = write_all(client->fd, buffer + sent, len - sent);
+	if(copied && verbose){
+		LOG("Zerocopy fell back to copying (loopback or no NIC support)\n");
+	}
+	return ret;
+}
+
+int zerocopy_wait(struct client *client, uint32_t end, int *copied){
+	// Numbers wrap at 32 bits, compare their distance.
+	while((int32_t)(end - client->zc_done) > 0){
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+		struct msghdr msg = {0};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(client->fd, &msg, MSG_ERRQUEUE) < 0){
+			if(errno == EAGAIN || errno == EINTR){
+				// The error queue makes the socket report POLLERR.
+				struct pollfd pfd = {client->fd, 0, 0};
+				if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+					return -1;
+				continue;
+			}
+			return -1;
+		}
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg == NULL)
+			continue;
+		struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+		if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+			continue;
+		// Notifications cover the range of sends ee_info to ee_data.
+		if((int32_t)(serr->ee_data + 1 - client->zc_done) > 0)
+			client->zc_done = serr->ee_data + 1;
+		if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+			*copied = 1;
+	}
+	return 0;
+}
@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200809L /* POSIX-2008 */
+#define _DEFAULT_SOURCE /* random */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common/net.h"
+
+/* Compares addr_ntop and addr2str with inet_ntop. First every formatter
+ * has to give inet_ntop's output for CHECK_COUNT random addresses, then
+ * each is called CALLS times over ADDR_COUNT addresses and the mean time
+ * per call is printed.
+ *
+ * IPv6 addresses get random runs of zero words and a share of IPv4-mapped
+ * and -compatible forms, so the :: and dotted quad paths are covered.
+ */
+#define CHECK_COUNT (2 * 1000 * 1000)
+#define CALLS (10 * 1000 * 1000)
+/* Distinct addresses, more than the addr2str cache (ADDR2STR_CACHE_LEN). */
+#define ADDR_COUNT (64)
+/* Addresses of the hot case, they all stay in the cache. */
+#define HOT_COUNT (4)
+
+enum fmt { FMT_INET_NTOP, FMT_ADDR_NTOP, FMT_ADDR2STR };
+
+/* Fill addr with a random IPv6 address, see above. */
+static void random_in6(struct in6_addr *addr);
+/* Format addr (a sockaddr_in or sockaddr_in6) with fmt.
+ * Returns the string, or NULL on error.
+ */
+static const char *format(enum fmt fmt, const struct sockaddr *addr,
+    char *dst, socklen_t size);
+/* Return count of addresses whose formatted strings differ from
+ * inet_ntop's.
+ */
+static size_t check(int af);
+/* Call fmt CALLS times over the first count addresses of addrs, return
+ * mean ns per call.
+ */
+static double bench(enum fmt fmt, const struct sockaddr_storage *addrs,
+    size_t count);
+static uint64_t clock_ns(void);
+
+/* Keeps the compiler from dropping the calls. */
+static volatile char sink;
+
+int main(void)
+{
+	static struct sockaddr_storage addrs4[ADDR_COUNT], addrs6[ADDR_COUNT];
+	size_t errors = 0;
+
+	srandom(1);
+	errors += check(AF_INET);
+	errors += check(AF_INET6);
+	if (errors > 0) {
+		fprintf(stderr, "%zu addresses differ from inet_ntop\n",
+		    errors);
+		return 1;
+	}
+	printf("%d addresses match inet_ntop\n", 2 * CHECK_COUNT);
+
+	for (size_t n = 0; n < ADDR_COUNT; ++n) {
+		struct sockaddr_in *addr4 = (struct sockaddr_in *)&addrs4[n];
+		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addrs6[n];
+
+		addr4->sin_family = AF_INET;
+		addr4->sin_addr.s_addr = random();
+		addr6->sin6_family = AF_INET6;
+		random_in6(&addr6->sin6_addr);
+	}
+
+	printf("%d calls over %d addresses, ns per call:\n", CALLS,
+	    ADDR_COUNT);
+	printf("  inet_ntop v4             %6.1f\n",
+	    bench(FMT_INET_NTOP, addrs4, ADDR_COUNT));
+	printf("  addr_ntop v4             %6.1f\n",
+	    bench(FMT_ADDR_NTOP, addrs4, ADDR_COUNT));
+	printf("  addr2str v4              %6.1f\n",
+	    bench(FMT_ADDR2STR, addrs4, ADDR_COUNT));
+	printf("  inet_ntop v6             %6.1f\n",
+	    bench(FMT_INET_NTOP, addrs6, ADDR_COUNT));
+	printf("  addr_ntop v6             %6.1f\n",
+	    bench(FMT_ADDR_NTOP, addrs6, ADDR_COUNT));
+	printf("  addr2str v6, %d hot       %6.1f\n", HOT_COUNT,
+	    bench(FMT_ADDR2STR, addrs6, HOT_COUNT));
+	printf("  addr2str v6, %d addrs    %6.1f\n", ADDR_COUNT,
+	    bench(FMT_ADDR2STR, addrs6, ADDR_COUNT));
+
+	return 0;
+}
+
+static void random_in6(struct in6_addr *addr)
+{
+	const long kind = random() % 8;
+	const long zeros = random() % 9, first = random() % 8;
+
+	for (size_t n = 0; n < sizeof(addr->s6_addr); ++n) {
+		addr->s6_addr[n] = random();
+	}
+	if (kind == 0 || kind == 1) {
+		/* ::ffff:a.b.c.d and ::a.b.c.d */
+		memset(addr->s6_addr, 0, 12);
+		if (kind == 0) addr->s6_addr[10] = addr->s6_addr[11] = 0xff;
+		return;
+	}
+	for (long n = first; n < first + zeros && n < 8; ++n) {
+		addr->s6_addr[n * 2] = addr->s6_addr[n * 2 + 1] = 0;
+	}
+	/* A second, shorter run, ties go to the first one. */
+	if (kind == 2) {
+		const long second = random() % 8;
+
+		addr->s6_addr[second * 2] = addr->s6_addr[second * 2 + 1] = 0;
+	}
+}
+
+static const char *format(enum fmt fmt, const struct sockaddr *addr,
+    char *dst, socklen_t size)
+{
+	const void *ip = addr->sa_family == AF_INET
+	    ? (const void *)&((const struct sockaddr_in *)addr)->sin_addr
+	    : (const void *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+
+	switch (fmt) {
+	case FMT_INET_NTOP:
+		return inet_ntop(addr->sa_family, ip, dst, size);
+	case FMT_ADDR_NTOP:
+		return addr_ntop(addr->sa_family, ip, dst, size);
+	case FMT_ADDR2STR:
+		return addr2str(addr->sa_family, addr);
+	}
+
+	return NULL;
+}
+
+static size_t check(int af)
+{
+	struct sockaddr_storage addr = {0};
+	struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+	struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+	char want[INET6_ADDRSTRLEN] = "", got[INET6_ADDRSTRLEN] = "";
+	const char *str = NULL;
+	size_t errors = 0;
+
+	addr.ss_family = af;
+	for (size_t n = 0; n < CHECK_COUNT; ++n) {
+		if (af == AF_INET)
+			addr4->sin_addr.s_addr = random();
+		else
+			random_in6(&addr6->sin6_addr);
+		format(FMT_INET_NTOP, (struct sockaddr *)&addr, want,
+		    sizeof(want));
+		for (enum fmt fmt = FMT_ADDR_NTOP; fmt <= FMT_ADDR2STR;
+		    ++fmt) {
+			str = format(fmt, (struct sockaddr *)&addr, got,
+			    sizeof(got));
+			if (str != NULL && strcmp(str, want) == 0) continue;
+			if (errors++ < 10)
+				fprintf(stderr, "%s: got %s\n", want,
+				    str != NULL ? str : "NULL");
+		}
+	}
+
+	return errors;
+}
+
+static double bench(enum fmt fmt, const struct sockaddr_storage *addrs,
+    size_t count)
+{
+	char dst[INET6_ADDRSTRLEN] = "";
+	const char *str = NULL;
+	uint64_t start = 0;
+
+	start = clock_ns();
+	for (size_t n = 0; n < CALLS; ++n) {
+		str = format(fmt, (const struct sockaddr *)&addrs[n % count],
+		    dst, sizeof(dst));
+		sink = str[0];
+	}
+
+	return (double)(clock_ns() - start) / CALLS;
+}
+
+static uint64_t clock_ns(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -1,43 +1,145 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-/* == Helper macros == */
-#define MAX(_a, _b) ((_a > _b) ? _a : _b)
-#define MIN(_a, _b) ((_a < _b) ? _a : _b)
+/* Options of the code shared with udpecho. */
+#include "common/config.h"
 
 /* == Compile time options == */
-/* = Logging = */
-/* Controls wether the log* functions print anything. */
-#ifndef PRINT_DEBUG
-#define PRINT_DEBUG (1)
+/* = net = */
+/* Max epoll events handled per wakeup of a shard. */
+#ifndef EPOLL_EVENTS
+#define EPOLL_EVENTS (64)
 #endif
-#ifndef PRINT_INFO
-#define PRINT_INFO (1)
+/* Default count of receive shards (threads), can be changed with -s. Every
+ * shard binds its own socket to each address with SO_REUSEPORT.
+ */
+#ifndef SHARD_COUNT
+#define SHARD_COUNT (1)
 #endif
-#ifndef PRINT_WARN
-#define PRINT_WARN (1)
+/* Max count of receive shards. */
+#ifndef SHARD_MAX
+#define SHARD_MAX (64)
 #endif
-#ifndef PRINT_ERROR
-#define PRINT_ERROR (1)
+#if SHARD_MAX > CAPTURE_RINGS_MAX
+#error "the capture log needs a ring per shard, raise CAPTURE_RINGS_MAX"
 #endif
-#define PRINT_WRITE_MUTEX 1
-/* = net = */
-/* Max count of interfaces to listen on. Normally only two are used. */
-#ifndef MAX_BIND_COUNT
-#define MAX_BIND_COUNT (10)
+/* Interval of the housekeeping timer, which kicks timeed out users (in ms). */
+#ifndef HOUSEKEEP_INTERVAL
+#define HOUSEKEEP_INTERVAL (1000)
+#endif
+/* Print stats every STATS_INTERVAL ms, 0 only prints on SIGUSR1. */
+#ifndef STATS_INTERVAL
+#define STATS_INTERVAL (0)
 #endif
 /* Max size of message that can be received. */
 #ifndef MAX_MSG_SIZE
 #define MAX_MSG_SIZE (2048)
 #endif
-/* Timeout before removeing user from active users (in seconds). */
+/* Timeout before removeing user from active users (in ms). */
 #ifndef ACTUSER_TIMEOUT
-#define ACTUSER_TIMEOUT (70)
+#define ACTUSER_TIMEOUT (70 * 1000)
+#endif
+/* Max count of active users, the user slab is allocated once at start. */
+#ifndef ACTUSER_MAX
+#define ACTUSER_MAX (1024)
+#endif
+/* = rate limits = */
+/* Per user token bucket. A user gets one message every MSG_RATE_INTERVAL
+ * (in us), and can send MSG_RATE_BURST messages in a row.
+ */
+#ifndef MSG_RATE_INTERVAL
+#define MSG_RATE_INTERVAL (1000 * 1000)
+#endif
+#ifndef MSG_RATE_BURST
+#define MSG_RATE_BURST (5)
+#endif
+/* Global token bucket on fan-out, every datagram sent costs one token.
+ * FANOUT_RATE_BURST must be larger than ACTUSER_MAX.
+ */
+#ifndef FANOUT_RATE_INTERVAL
+#define FANOUT_RATE_INTERVAL (10) /* 100k datagrams/s */
+#endif
+#ifndef FANOUT_RATE_BURST
+#define FANOUT_RATE_BURST (10 * 1000)
+#endif
+_Static_assert(FANOUT_RATE_BURST > ACTUSER_MAX,
+    "FANOUT_RATE_BURST must be larger than ACTUSER_MAX");
+/* = multicast = */
+/* Default port of multicast group (-M). */
+#ifndef MCAST_PORT
+#define MCAST_PORT "9200"
+#endif
+/* Multicast TTL (hop limit), 1 keeps it on the local network. */
+#ifndef MCAST_TTL
+#define MCAST_TTL (1)
+#endif
+/* = rooms = */
+/* Max count of rooms, including the lobby. */
+#ifndef ROOM_MAX
+#define ROOM_MAX (64)
+#endif
+/* Max length of room name (including '\0'). */
+#ifndef ROOM_NAME_LEN
+#define ROOM_NAME_LEN (16)
+#endif
+/* = history = */
+/* Count of formatted lines kept for all rooms. */
+#ifndef HISTORY_LEN
+#define HISTORY_LEN (256)
+#endif
+/* Count of lines replayed to new users. */
+#ifndef HISTORY_REPLAY
+#define HISTORY_REPLAY (20)
+#endif
+/* = sendq = */
+/* Datagrams queued per socket and shard when the send buffer is full, the
+ * oldest is dropped when the queue is full.
+ */
+#ifndef SENDQ_LEN
+#define SENDQ_LEN (256)
+#endif
+/* = shm = */
+/* Max count of shared memory clients (-S). */
+#ifndef SHM_PEERS_MAX
+#define SHM_PEERS_MAX (64)
+#endif
+/* Messages in a client's ring to the server, and in its ring of messages
+ * from the server. Clients that fall more than SHM_RECV_SLOTS behind lose
+ * messages. Must be powers of two.
+ */
+#ifndef SHM_RING_SLOTS
+#define SHM_RING_SLOTS (256)
+#endif
+#ifndef SHM_RECV_SLOTS
+#define SHM_RECV_SLOTS (1024)
+#endif
+/* Max length of a message in either ring, at least MSG_TOTAL_LEN. */
+#ifndef SHM_MSG_LEN
+#define SHM_MSG_LEN (256)
+#endif
+/* Messages a shard takes from one client per wakeup. */
+#ifndef SHM_BATCH
+#define SHM_BATCH (64)
+#endif
+/* Clients spin for new messages before they sleep on their eventfd. The
+ * spin doubles when it found a message and halves when it didn't, between
+ * SHM_SPIN_MIN and SHM_SPIN_MAX (in us).
+ */
+#ifndef SHM_SPIN_MIN
+#define SHM_SPIN_MIN (1)
+#endif
+#ifndef SHM_SPIN_MAX
+#define SHM_SPIN_MAX (100)
 #endif
 /* = user messages = */
+/* Commands, messages starting with theese are not sent to the room. */
+#define MSG_CMD_JOIN "/join "
+#define MSG_CMD_MSG "/msg "
+#define MSG_CMD_MCAST "/mcast "
+
 /* Digits in an id (including '\0'). */
 #ifndef MSG_ID_LEN
-#define MSG_ID_LEN (4) /* "123" + '\0' */
+#define MSG_ID_LEN (9) /* "1a2b3c4d" + '\0' */
 #endif
 /* Formatter string length. */
 #ifndef MSG_F_LEN
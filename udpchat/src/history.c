@@ -0,0 +1,91 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+#include "history.h"
+
+int history_init(struct history *hist, size_t cap)
+{
+	int ret = 0;
+
+	memset(hist, 0, sizeof(*hist));
+	hist->ring = calloc(cap, sizeof(*hist->ring));
+	if (hist->ring == NULL) return 1;
+	hist->cap = cap;
+	ret = pthread_mutex_init(&hist->lock, NULL);
+	if (ret != 0) {
+		free(hist->ring);
+		errno = ret;
+		return 1;
+	}
+
+	return 0;
+}
+
+void history_append(struct history *hist, uint16_t room, const char *line,
+    size_t len)
+{
+	struct history_entry *entry = NULL;
+
+	if (room >= ROOM_MAX) return;
+	if (len > MSG_TOTAL_LEN) len = MSG_TOTAL_LEN;
+
+	pthread_mutex_lock(&hist->lock);
+	++hist->seq;
+	entry = &hist->ring[hist->seq % hist->cap];
+	entry->prev = hist->room_last[room];
+	entry->room = room;
+	entry->len = len;
+	memcpy(entry->line, line, len);
+	hist->room_last[room] = hist->seq;
+	pthread_mutex_unlock(&hist->lock);
+}
+
+int history_replay(struct history *hist, uint16_t room, size_t count,
+    struct sendq *q, const struct sockaddr *addr, socklen_t addr_len)
+{
+	char lines[HISTORY_REPLAY][MSG_TOTAL_LEN];
+	uint16_t lens[HISTORY_REPLAY];
+	size_t len = 0;
+	uint64_t seq = 0;
+	int sent = 0;
+
+	if (room >= ROOM_MAX) return 0;
+	if (count > HISTORY_REPLAY) count = HISTORY_REPLAY;
+
+	/* Copy newest lines out, so we don't send while holding the lock. */
+	pthread_mutex_lock(&hist->lock);
+	seq = hist->room_last[room];
+	while (len < count && seq != 0 && seq + hist->cap > hist->seq) {
+		const struct history_entry *entry =
+		    &hist->ring[seq % hist->cap];
+		memcpy(lines[len], entry->line, entry->len);
+		lens[len] = entry->len;
+		++len;
+		seq = entry->prev;
+	}
+	pthread_mutex_unlock(&hist->lock);
+
+	/* Oldest first. */
+	while (len > 0) {
+		--len;
+		if (sendq_send(q, lines[len], lens[len], addr, addr_len) != 0)
+			return -1;
+		++sent;
+	}
+
+	return sent;
+}
+
+void history_free(struct history *hist)
+{
+	free(hist->ring);
+	pthread_mutex_destroy(&hist->lock);
+	memset(hist, 0, sizeof(*hist));
+}
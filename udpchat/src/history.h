@@ -0,0 +1,49 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "sendq.h"
+
+/* One formatted line, as it was sent to the room. */
+struct history_entry {
+	uint64_t prev; /* Sequence of previous entry in same room, 0 if none. */
+	uint16_t room;
+	uint16_t len;
+	char line[MSG_TOTAL_LEN];
+};
+
+/* Fixed size ring of formatted lines, shared by all shards. Every room has
+ * a cursor to its newest entry, and entries link back to the previous entry
+ * of the same room, so replaying a room never walks other rooms' lines.
+ * Sequence numbers start at 1, entry seq lives at ring[seq % cap].
+ */
+struct history {
+	struct history_entry *ring;
+	size_t cap;
+	uint64_t seq; /* Sequence of newest entry. */
+	uint64_t room_last[ROOM_MAX];
+	pthread_mutex_t lock;
+};
+
+/* Allocate ring with cap entries, nothing is allocated after this.
+ * Returns 0 on success, 1 on error (errno is set).
+ */
+int history_init(struct history *_hist, size_t _cap);
+/* Append formatted line to room, line is truncated to MSG_TOTAL_LEN. */
+void history_append(struct history *_hist, uint16_t _room, const char *_line,
+    size_t _len);
+/* Send the last (max) count lines of room to addr through q, oldest first.
+ * Lines that don't fit in the send buffer are queued behind what q already
+ * holds, like any other send.
+ * Returns count of lines sent or queued, or -1 on error (errno is set).
+ */
+int history_replay(struct history *_hist, uint16_t _room, size_t _count,
+    struct sendq *_q, const struct sockaddr *_addr, socklen_t _addr_len);
+void history_free(struct history *_hist);
+
+#endif
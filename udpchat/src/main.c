@@ -1,15 +1,22 @@
 #define _POSIX_C_SOURCE 200809L /* POSIX-2008 */
+#define _DEFAULT_SOURCE /* SO_REUSEPORT */
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include <stddef.h>
 #include <stdbool.h>
-#include <poll.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/resource.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -17,81 +24,209 @@
 
 #include "config.h"
 
-#include "util/print.h"
-#include "util/net.h"
+#include "common/print.h"
+#include "common/net.h"
+#include "util/clock.h"
+#include "util/ratelimit.h"
 #include "users.h"
 #include "msg_formatter.h"
+#include "stats.h"
+#include "history.h"
+#include "sendq.h"
+#include "common/rxdrop.h"
+#include "common/capture.h"
+#include "shm.h"
+#include "steer.h"
 
 /* == Globals == */
 static char *progname = "";
+/* Global fan-out token bucket, shared by all shards. */
+static uint64_t fanout_tat = 0;
+/* Recent room messages, replayed to new users. */
+static struct history history = {0};
+/* Multicast group for lobby messages, mcast_fd is -1 when disabled. */
+static int mcast_fd = -1;
+static struct sockaddr_storage mcast_addr = {0};
+static socklen_t mcast_addr_len = 0;
+/* Record kernel receive timestamps in the stats (-t). */
+static bool rx_timestamps = false;
+/* Capture log of received datagrams (-w), fd is -1 when disabled. */
+static struct capture capture = {.fd = -1};
+/* Send queues and drop counters of the current shard, indexed by bound
+ * address.
+ */
+static __thread struct sendq *_sendqs = NULL;
+static __thread struct rxdrop *_rxdrops = NULL;
+/* Capture ring of the current shard, NULL when not capturing. */
+static __thread struct capture_ring *_capture = NULL;
+/* Shared memory clients (-S), listen_fd is -1 when disabled. */
+static struct shm_server shm = {.listen_fd = -1};
+
+/* epoll_event.data.u32 of the stop eventfd, timer and shm listen socket,
+ * sockets use their index in sfd_arr. Shared memory clients use their
+ * index in shm.peers with EV_SHM, and EV_SHM_CONN for their connection.
+ */
+#define EV_STOP (UINT32_MAX)
+#define EV_TIMER (UINT32_MAX - 1)
+#define EV_SHM_LISTEN (UINT32_MAX - 2)
+#define EV_SHM (1U << 31)
+#define EV_SHM_CONN (1U << 30)
 
 /* == Static functions == */
+/* Raise the open file limit to the hard limit if need fds don't fit. */
+static void raise_nofile(size_t need);
+/* master_func is started once per shard. Every shard has its own socket for
+ * each bound address (SO_REUSEPORT), but they all share the user table.
+ */
 static void *master_func(void *args);
+/* Handle up to SHM_BATCH messages of shared memory client idx, owned by
+ * the current shard. Returns 0 on success, 1 on error.
+ */
+static int shm_handle(size_t idx, struct user_table *active_users);
 struct master_func_args {
 	int *sfd_arr;
-	size_t sfd_arr_len;
-	volatile bool *run;
+	size_t sfd_arr_len; /* Same for every shard. */
+	int stop_fd; /* eventfd, readable when the shards should stop. */
+	struct user_table *active_users;
+	size_t shard;
+	size_t shard_count;
 };
-/* On message handle.
+/* On message handle, receives one datagram without blocking. sock is the
+ * index of sfd in sfd_arr.
  *
  * Returns:
  * 0 - success
  * 1 - error
+ * 2 - nothing to receive
 */
-static int msg_handle(int sfd, struct user_table *active_users);
-/* sendall_func is called by user_table_every to send message to other users. */
-static void sendall_func(const struct user *user, void *args0);
+static int msg_handle(int sfd, uint16_t sock,
+    struct user_table *active_users);
+/* Handle a received datagram from user, called by msg_handle.
+ * Returns 0 on success, 1 on error.
+ */
+static int msg_process(int sfd, struct user_table *active_users,
+    struct user *user, char *buffer, size_t buffer_len);
+/* Handle chat commands ("/join room", "/msg id text").
+ *
+ * Returns:
+ * 0 - not a command
+ * 1 - command handled
+ */
+static int cmd_handle(struct user_table *active_users, uint32_t slot,
+    char *buffer, size_t buffer_len);
+/* sendall_func is called by user_table_every_room to send message to other
+ * users, and directly for direct messages. Sends never block, datagrams that
+ * don't fit in the socket buffer are queued in the shard's sendq.
+ */
+static void sendall_func(const struct user_table *table, uint32_t slot,
+    void *args0);
 struct sendall_func_args {
-	struct user *sender;
-	char *buffer;
+	/* Already formatted by msg_formatter. */
+	const char *buffer;
 	size_t buffer_len;
 };
-/* timeout_func is called by user_table_update and will be called with timeed-
- * out users.
+/* Send a server notice (sender 0) to slot, text must end with newline. */
+static void notice_send(const struct user_table *table, uint32_t slot,
+    const char *text);
+/* Replay the last HISTORY_REPLAY lines of room to slot through its sendq,
+ * paced by the fan-out bucket. Shared memory clients only see what is sent
+ * after they connected, so they get nothing.
+ */
+static void history_send(const struct user_table *table, uint32_t slot,
+    uint16_t room);
+/* timeout_func is called by user_table_flush on the housekeeping tick with
+ * timeed-out users.
  */
-static void timeout_func(const struct user *user, void *arg0);
+static void timeout_func(const struct user_table *table, uint32_t slot,
+    void *arg0);
 struct timeout_func_args {
 	/* empty */
 };
 
 int main(int argc, char *argv[])
 {
-	(void)argc; (void)argv;
 	/* Use ret to check for ret errors, status is exit status. */
-	int ret = 0, status = 0;
-	char *bind_ips[MAX_BIND_COUNT] = {0}, *port = "";
+	int ret = 0, status = 0, opt = 0, sig = 0, stop_fd = -1;
+	char *mcast_group = NULL, *mcast_port = MCAST_PORT;
+	char *mcast_iface = NULL, *capture_path = NULL, *shm_path = NULL;
+	char **bind_ips = NULL, *port = "";
 	size_t bind_ips_len = 0;
-	/* The master thread will handle all IO while main thread will sleep.*/
-	pthread_t master_thread = 0;
+	/* The master threads will handle all IO while main thread will sleep.*/
+	pthread_t master_threads[SHARD_MAX] = {0};
+	size_t master_threads_len = 0;
+	size_t shard_count = SHARD_COUNT;
 	/* Info about sockets that we will bind to. */
 	struct addrinfo *addr = NULL;
-	/* Array of bound sockets. */
-	int sfd_arr[MAX_BIND_COUNT] = {0};
-	size_t sfd_arr_len = 0;
+	struct sock_opts sock_opts = {0};
+	unsigned int applied = 0;
+	char applied_str[128] = "";
+	/* Steer datagrams to shards by source address (-a). */
+	bool steer = false;
+	/* Array of bound sockets, one row of addr_len per shard. Every row has
+	 * a socket for the same addresses in the same order, so a user's
+	 * socket index is valid in every shard.
+	 */
+	int *sfd_arr = NULL;
+	size_t sfd_arr_len = 0, addr_len = 0;
 	/* Args to master_func. */
-	struct master_func_args master_args = {0};
-	bool master_args_run = true;
+	struct master_func_args master_args[SHARD_MAX] = {{0}};
+	/* Active users, shared between all shards. */
+	struct user_table active_users = {0};
 	/* Catch sigTERM and shutdown gracefully. */
 	sigset_t catchset = {0};
 
 	/* Set program name. */
 	progname = argv[0];
+	/* Parse options. */
+	while ((opt = getopt(argc, argv, "s:m:M:i:tw:S:a")) != -1) {
+		switch (opt) {
+		case 's':
+			shard_count = strtoul(optarg, NULL, 10);
+			if (shard_count < 1 || shard_count > SHARD_MAX) {
+				perror("Shard count must be between 1 and %d",
+				    SHARD_MAX);
+				goto args_err;
+			}
+			break;
+		case 'm':
+			mcast_group = optarg;
+			break;
+		case 'M':
+			mcast_port = optarg;
+			break;
+		case 'i':
+			mcast_iface = optarg;
+			break;
+		case 't':
+			rx_timestamps = true;
+			break;
+		case 'w':
+			capture_path = optarg;
+			break;
+		case 'S':
+			shm_path = optarg;
+			break;
+		case 'a':
+			steer = true;
+			break;
+		default:
+			perror("Usage: %s [-t] [-a] [-w capture] [-S shm] [-s shards] "
+			    "[-m group [-M port] [-i iface]] port [addresses...]",
+			    progname);
+			goto args_err;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 	/* Parse args. argc variables:
 	 * 0: progname
 	 * 1: port
 	 * 2+: addresses to bind to
 	 */
-	if (argc == 2) {
-		port = argv[1];
-	} else if (argc > 2) {
+	if (argc >= 2) {
 		port = argv[1];
-		for (int n = 2; n < argc; ++n) {
-			if (bind_ips_len >= MAX_BIND_COUNT - 1) {
-				perror("Too many interfaces provided");
-				goto args_err;
-			}
-			bind_ips[bind_ips_len++] = argv[n];
-		}
+		bind_ips = &argv[2];
+		bind_ips_len = argc - 2;
 	} else {
 		perror("Not enough arguments");
 		goto args_err;
@@ -105,14 +240,16 @@ int main(int argc, char *argv[])
 	}
 	ret = sigaddset(&catchset, SIGTERM);
 	ret += sigaddset(&catchset, SIGINT);
+	/* SIGUSR1 prints stats. */
+	ret += sigaddset(&catchset, SIGUSR1);
 	if (ret != 0) {
-		perror("Failed to add SIGTERM or SIGINT to catchset: %s",
+		perror("Failed to add SIGTERM, SIGINT or SIGUSR1 to catchset: %s",
 		    strerror(errno));
 		goto catchset_err;
 	}
 	ret = sigprocmask(SIG_BLOCK, &catchset, NULL);
 	if (ret != 0) {
-		perror("Failed to set block policy on SIGTERM or SIGINT: %s",
+		perror("Failed to set block policy on catchset: %s",
 		    strerror(errno));
 		goto catchset_err;
 	}
@@ -126,94 +263,258 @@ int main(int argc, char *argv[])
 		goto addrinfo_err;
 	}
 
-	/* Bind each node in addrinfo into sfd_arr. */
+	/* Let every shard bind the same address, the kernel spreads
+	 * datagrams between them by hashing the source.
+	 */
+	sock_opts.want = SOCK_OPT_NONBLOCK | SOCK_OPT_CLOEXEC;
+	if (shard_count > 1)
+		sock_opts.want |= SOCK_OPT_REUSEPORT;
+#ifdef __linux__
+	/* Disable dual stack on Linux. */
+	sock_opts.want |= SOCK_OPT_V6ONLY;
+#endif
+	sock_opts.need = sock_opts.want;
+	/* Tuning is best effort. */
+	if (SOCK_RCVBUF > 0) {
+		sock_opts.want |= SOCK_OPT_RCVBUF;
+		sock_opts.rcvbuf = SOCK_RCVBUF;
+	}
+	if (SOCK_SNDBUF > 0) {
+		sock_opts.want |= SOCK_OPT_SNDBUF;
+		sock_opts.sndbuf = SOCK_SNDBUF;
+	}
+	if (SOCK_BUFFORCE)
+		sock_opts.want |= SOCK_OPT_BUFFORCE;
+	if (SOCK_BUSY_POLL > 0) {
+		sock_opts.want |= SOCK_OPT_BUSY_POLL;
+		sock_opts.busy_poll = SOCK_BUSY_POLL;
+	}
+	if (rx_timestamps)
+		sock_opts.want |= SOCK_OPT_TIMESTAMP;
+	sock_opts.want |= SOCK_OPT_RXQ_OVFL;
+
+	/* One socket per node and shard at most, users store the index of
+	 * the node in 16 bits (USER_SOCK_SHM isn't a node).
+	 */
 	for (struct addrinfo *ca = addr; ca != NULL; ca = ca->ai_next) {
-		int sfd = socket(ca->ai_family, ca->ai_socktype,
-		    ca->ai_protocol);
-		if (sfd == -1) {
-			pwarn("socket: skipping '%s': %s",
-			    addr2str(ca->ai_family, ca->ai_addr),
-			    strerror(errno));
+		++addr_len;
+	}
+	addr_len = MIN(addr_len, USER_SOCK_SHM);
+	sfd_arr = calloc(shard_count * addr_len, sizeof(*sfd_arr));
+	if (sfd_arr == NULL) {
+		perror("Failed to allocate sockets: %s", strerror(errno));
+		goto socket_err;
+	}
+	raise_nofile(shard_count * addr_len);
+
+	/* Bind each node in addrinfo into sfd_arr, once for each shard. */
+	for (struct addrinfo *ca = addr; ca != NULL; ca = ca->ai_next) {
+		size_t shard = 0;
+		struct addr_key key = {0};
+		char port_str[sizeof(":65535")] = "";
+		int group[SHARD_MAX] = {0};
+		enum steer_kind steered = STEER_NONE;
+
+		if (sfd_arr_len >= addr_len) {
+			pwarn("Reached socket limit (%zu) drop %s",
+			    sfd_arr_len, addr2str(ca->ai_family, ca->ai_addr));
 			continue;
 		}
-		pdebug("socket: Created '%s'",
-		    addr2str(ca->ai_family, ca->ai_addr));
+		for (shard = 0; shard < shard_count; ++shard) {
+			int sfd = -1;
 
-#ifdef __linux__
-		/* Disable dual stack on Linux. */
-		if (ca->ai_family == AF_INET6) {
-			int use_v6only = true;
-			ret = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY,
-			    &use_v6only, sizeof(use_v6only));
-			if (ret != 0) {
-				pwarn("Failed to disable dualstack (linux) '%s': %s",
+			/* AF_UNIX has no SO_REUSEPORT, shards share one
+			 * socket and whoever reads first gets the datagram.
+			 */
+			if (shard > 0 && ca->ai_family == AF_UNIX)
+				sfd = fcntl(sfd_arr[sfd_arr_len],
+				    F_DUPFD_CLOEXEC, 0);
+			else
+				sfd = create_socket(ca, &sock_opts, &applied);
+			if (sfd == -1) {
+				pwarn("Failed to bind '%s': %s",
 				    addr2str(ca->ai_family, ca->ai_addr),
 				    strerror(errno));
-				close(sfd);
-				continue;
+				break;
 			}
+			pdebug("Bound '%s' to %i",
+			    addr2str(ca->ai_family, ca->ai_addr), sfd);
+			sfd_arr[shard * addr_len + sfd_arr_len] = sfd;
 		}
-#endif
-		/* Bind socket. */
-		ret = bind(sfd, ca->ai_addr, ca->ai_addrlen);
-		if (ret != 0) {
-			pwarn("Failed to bind '%s': %s",
-			    addr2str(ca->ai_family, ca->ai_addr),
-			    strerror(errno));
-			close(sfd);
+		/* Skip address unless every shard got a socket. */
+		if (shard < shard_count) {
+			if (shard > 0) sock_unlink(sfd_arr[sfd_arr_len]);
+			while (shard-- > 0)
+				close(sfd_arr[shard * addr_len + sfd_arr_len]);
 			continue;
 		}
-		pdebug("Bound '%s' to %i", addr2str(ca->ai_family, ca->ai_addr),
-		    sfd);
-		pinfo("Bound %s:%s", addr2str(ca->ai_family, ca->ai_addr), port);
-
-		/* Add socket to array of bound sockets. */
-		if (sfd_arr_len >= MAX_BIND_COUNT) {
-			pwarn("Reached socket limit (%zu) drop %s", sfd_arr_len,
-			    addr2str(ca->ai_family, ca->ai_addr));
-			close(sfd);
-			break;
+		addr_key_set(&key, ca->ai_addr);
+		if (key.family != AF_UNIX)
+			snprintf(port_str, sizeof(port_str), ":%u",
+			    ntohs(key.port));
+		/* The group exists now, the kernel hashes until then. */
+		if (steer && shard_count > 1 && ca->ai_family != AF_UNIX) {
+			for (shard = 0; shard < shard_count; ++shard) {
+				group[shard] =
+				    sfd_arr[shard * addr_len + sfd_arr_len];
+			}
+			steered = steer_attach(group, shard_count,
+			    ca->ai_family);
+			if (steered == STEER_NONE) {
+				pwarn("Failed to steer %s%s: %s",
+				    addr2str(ca->ai_family, ca->ai_addr),
+				    port_str, strerror(errno));
+			}
+		}
+		pinfo("Bound %s%s (%zu shards%s%s, %s)",
+		    addr2str(ca->ai_family, ca->ai_addr), port_str,
+		    shard_count, steered != STEER_NONE ? ", steered by " : "",
+		    steered != STEER_NONE ? steer_str(steered) : "",
+		    sock_opts_str(applied, applied_str, sizeof(applied_str)));
+		/* FORCE may fall back, and V6ONLY is only for IPv6. */
+		applied |= SOCK_OPT_BUFFORCE;
+		if (ca->ai_family != AF_INET6) applied |= SOCK_OPT_V6ONLY;
+		if (ca->ai_family == AF_UNIX) applied |= UNIX_SKIP;
+		if (sock_opts.want & ~applied) {
+			pwarn("Options not applied on %s: %s",
+			    addr2str(ca->ai_family, ca->ai_addr),
+			    sock_opts_str(sock_opts.want & ~applied,
+			    applied_str, sizeof(applied_str)));
 		}
-		sfd_arr[sfd_arr_len++] = sfd;
+		++sfd_arr_len;
 	}
 	if (sfd_arr_len == 0) {
-		perror("No sockets creating, aborting");
+		perror("No sockets created, aborting");
+		goto socket_err;
+	}
+
+	/* Setup message history. */
+	ret = history_init(&history, HISTORY_LEN);
+	if (ret != 0) {
+		perror("Failed to create history: %s", strerror(errno));
 		goto socket_err;
 	}
 
-	/* Start master thread. */
-	master_args.sfd_arr = sfd_arr;
-	master_args.sfd_arr_len = sfd_arr_len;
-	master_args.run = &master_args_run; /* I think this makes it volatile. */
-	ret = pthread_create(&master_thread, NULL, master_func, &master_args);
+	/* Setup multicast group. */
+	if (mcast_group != NULL) {
+		mcast_fd = create_mcast_socket(mcast_group, mcast_port,
+		    mcast_iface, MCAST_TTL, &mcast_addr, &mcast_addr_len);
+		if (mcast_fd == -2) {
+			perror("Invalid multicast group '%s' port '%s'",
+			    mcast_group, mcast_port);
+			goto mcast_err;
+		} else if (mcast_fd == -1) {
+			perror("Failed to create multicast socket: %s",
+			    strerror(errno));
+			goto mcast_err;
+		}
+		pinfo("Multicast lobby to %s port %s", mcast_group,
+		    mcast_port);
+	}
+
+	/* Setup capture log, one ring per shard. */
+	if (capture_path != NULL) {
+		ret = capture_open(&capture, capture_path, shard_count,
+		    CAPTURE_RING_SIZE);
+		if (ret != 0) {
+			perror("Failed to open capture '%s': %s", capture_path,
+			    strerror(errno));
+			goto capture_err;
+		}
+		pinfo("Capturing received datagrams to %s", capture_path);
+	}
+
+	/* Setup shared memory clients, every shard accepts them. */
+	if (shm_path != NULL) {
+		ret = shm_listen(&shm, shm_path);
+		if (ret != 0) {
+			perror("Failed to listen for shm clients on '%s': %s",
+			    shm_path, strerror(errno));
+			goto shm_err;
+		}
+		pinfo("Shared memory clients on %s", shm_path);
+	}
+
+	/* Setup stop eventfd. */
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd == -1) {
+		perror("Failed to create stop eventfd: %s", strerror(errno));
+		goto eventfd_err;
+	}
+
+	/* Setup active users table, every shard is a reader. */
+	ret = user_table_init(&active_users, ACTUSER_TIMEOUT, ACTUSER_MAX,
+	    shard_count);
 	if (ret != 0) {
-		perror("Failed to create master thread: %s", strerror(ret));
-		goto pthread_err;
+		perror("Failed to create active users: %s", strerror(errno));
+		goto user_table_err;
+	}
+
+	/* Start master threads. */
+	for (size_t shard = 0; shard < shard_count; ++shard) {
+		master_args[shard].sfd_arr = &sfd_arr[shard * addr_len];
+		master_args[shard].sfd_arr_len = sfd_arr_len;
+		master_args[shard].stop_fd = stop_fd;
+		master_args[shard].shard_count = shard_count;
+		master_args[shard].active_users = &active_users;
+		master_args[shard].shard = shard;
+		ret = pthread_create(&master_threads[master_threads_len], NULL,
+		    master_func, &master_args[shard]);
+		if (ret != 0) {
+			perror("Failed to create master thread: %s",
+			    strerror(ret));
+			goto pthread_err;
+		}
+		++master_threads_len;
 	}
 
 	/* Wait until main thread catches SIGINT or SIGTERM, and shutdown.
-	 * Using ret two times might be UB.
+	 * SIGUSR1 only prints stats.
 	 */
-	ret = sigwait(&catchset, &ret);
+	while ((ret = sigwait(&catchset, &sig)) == 0 && sig == SIGUSR1) {
+		stats_print(shard_count);
+	}
 	if (ret != 0) {
-		pwarn("sigwait: %s", strerror(errno));
+		pwarn("sigwait: %s", strerror(ret));
 	} else {
 		pinfo("sigwait: closing program nicely");
 	}
+	stats_print(shard_count);
 
-	/* Set run to false, and shutdown all sockets. Shutting down the
-	 * sockets will send an event to poll which will shut down the thread.
-	 */
-	*master_args.run = false;
-	for (size_t n = 0; n < sfd_arr_len; ++n) {
-		shutdown(sfd_arr[n], SHUT_RDWR);
-	}
-	pthread_join(master_thread, NULL);
 pthread_err:
-	for (size_t n = 0; n < sfd_arr_len; ++n) {
-		close(sfd_arr[n]);
+	/* Wake up all shards with the stop eventfd. */
+	ret = eventfd_write(stop_fd, 1);
+	if (ret != 0) {
+		perror("Failed to stop shards: %s", strerror(errno));
+	}
+	for (size_t n = 0; n < master_threads_len; ++n) {
+		pthread_join(master_threads[n], NULL);
 	}
+	user_table_free(&active_users);
+user_table_err:
+	close(stop_fd);
+eventfd_err:
+	shm_close(&shm);
+shm_err:
+	if (capture.fd != -1) {
+		capture_close(&capture);
+		pinfo("Captured %" PRIu64 " bytes to %s", capture.written,
+		    capture_path);
+	}
+capture_err:
+	if (mcast_fd != -1) close(mcast_fd);
+mcast_err:
+	history_free(&history);
 socket_err:
+	for (size_t n = 0; n < sfd_arr_len; ++n) {
+		sock_unlink(sfd_arr[n]);
+	}
+	for (size_t shard = 0; shard < shard_count; ++shard) {
+		for (size_t n = 0; n < sfd_arr_len; ++n) {
+			close(sfd_arr[shard * addr_len + n]);
+		}
+	}
+	free(sfd_arr);
 	freeaddrinfo(addr);
 addrinfo_err:
 catchset_err:
@@ -221,101 +522,335 @@ args_err:
 	return status;
 }
 
+static void raise_nofile(size_t need)
+{
+	struct rlimit limit = {0};
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+	/* Keep some room for stdio, epoll and timers. */
+	if (limit.rlim_cur != RLIM_INFINITY
+	    && limit.rlim_cur < need + 16 + 4 * SHARD_MAX) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+			pwarn("Failed to raise open file limit: %s",
+			    strerror(errno));
+		}
+	}
+}
+
 static void *master_func(void *args0)
 {
 	struct master_func_args *args = (struct master_func_args *)args0;
-	/* Poll array to poll(3). */
-	struct pollfd poll_arr[MAX_BIND_COUNT] = {0};
-	size_t poll_arr_len = 0;
+	/* Events returned by epoll_wait. */
+	struct epoll_event events[EPOLL_EVENTS] = {{0}};
+	struct epoll_event event = {0};
+	/* One send queue per socket, see sendall_func. */
+	struct sendq *sendqs = NULL;
+	size_t sendqs_len = 0;
+	/* Kernel drops and receive buffer of every socket. */
+	struct rxdrop *rxdrops = NULL;
+	int domain = 0; /* Address family of a socket. */
+	socklen_t domain_len = 0;
+	int epfd = -1, tfd = -1;
+	struct itimerspec interval = {{0}, {0}};
+	uint64_t expirations = 0, next_stats = 0;
+	/* Shared memory clients accepted by this shard, events of peers that
+	 * were closed earlier in the same batch are skipped.
+	 */
+	bool shm_owned[SHM_PEERS_MAX] = {0};
+	int shm_idx = 0;
+	bool run = true;
 	/* General return from various functions. */
-	int ret = 0;
-	/* Active user ring buffer. */
-	struct user_table active_users = {0};
+	int ret = 0, nfds = 0;
+	/* Active users, shared with the other shards. */
+	struct user_table *active_users = args->active_users;
 
-	/* Setup active users queue. */
-	ret = user_table_init(&active_users, ACTUSER_TIMEOUT);
+	stats_attach(args->shard);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror("epoll_create1: %s", strerror(errno));
+		goto epoll_err;
+	}
+	/* Housekeeping timer, kicks idle users and prints stats. */
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd == -1) {
+		perror("timerfd_create: %s", strerror(errno));
+		goto timer_err;
+	}
+	interval.it_interval.tv_sec = HOUSEKEEP_INTERVAL / 1000;
+	interval.it_interval.tv_nsec = (HOUSEKEEP_INTERVAL % 1000) * 1000000;
+	interval.it_value = interval.it_interval;
+	ret = timerfd_settime(tfd, 0, &interval, NULL);
 	if (ret != 0) {
-		perror("Failed to create active users: %s", strerror(errno));
-		goto user_queue_err;
+		perror("timerfd_settime: %s", strerror(errno));
+		goto epoll_add_err;
 	}
 
-	/* Fill poll array. */
-	for (size_t n = 0; n < args->sfd_arr_len && n < MAX_BIND_COUNT; ++n) {
-		poll_arr[n].fd = args->sfd_arr[n];
-		/* POLLERR & POLLHUP are not required, but added for compat. */
-		poll_arr[n].events = POLLIN | POLLPRI | POLLERR | POLLHUP;
-		/* Rest of element is 0. */
-		++poll_arr_len;
+	/* Add sockets, the shared stop eventfd and the timer. */
+	sendqs = calloc(args->sfd_arr_len, sizeof(*sendqs));
+	rxdrops = calloc(args->sfd_arr_len, sizeof(*rxdrops));
+	if (sendqs == NULL || rxdrops == NULL) {
+		perror("Failed to allocate send queues: %s", strerror(errno));
+		goto epoll_add_err;
 	}
-	for (size_t n = poll_arr_len; n < MAX_BIND_COUNT; ++n) {
-		poll_arr[n].fd = -1; /* poll **will** ignore values under 0. */
-		/* Rest of element is 0. */
+	for (size_t n = 0; n < args->sfd_arr_len; ++n) {
+		ret = sendq_init(&sendqs[n], args->sfd_arr[n], epfd, n,
+		    SENDQ_LEN);
+		if (ret != 0) {
+			perror("%d: sendq_init: %s", args->sfd_arr[n],
+			    strerror(errno));
+			goto epoll_add_err;
+		}
+		++sendqs_len;
+		/* Shards share AF_UNIX sockets and the drop counter is the
+		 * socket's, so only shard 0 counts it and grows SO_RCVBUF.
+		 */
+		domain_len = sizeof(domain);
+		if (args->shard > 0 && getsockopt(args->sfd_arr[n], SOL_SOCKET,
+		    SO_DOMAIN, &domain, &domain_len) == 0 && domain == AF_UNIX)
+			rxdrop_init(&rxdrops[n], -1, cclock_tick());
+		else
+			rxdrop_init(&rxdrops[n], args->sfd_arr[n],
+			    cclock_tick());
+		event.events = EPOLLIN;
+		event.data.u32 = n;
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, args->sfd_arr[n], &event);
+		if (ret != 0) {
+			perror("%d: epoll_ctl: %s", args->sfd_arr[n],
+			    strerror(errno));
+			goto epoll_add_err;
+		}
+	}
+	_sendqs = sendqs;
+	_rxdrops = rxdrops;
+	if (capture.fd != -1) _capture = &capture.rings[args->shard];
+	stats_attach_rxdrop(args->shard, rxdrops, args->sfd_arr_len);
+	event.events = EPOLLIN;
+	event.data.u32 = EV_STOP;
+	ret = epoll_ctl(epfd, EPOLL_CTL_ADD, args->stop_fd, &event);
+	event.data.u32 = EV_TIMER;
+	ret += epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &event);
+	/* Only one shard wakes up for a new client. */
+	if (shm.listen_fd != -1) {
+		event.events = EPOLLIN | EPOLLEXCLUSIVE;
+		event.data.u32 = EV_SHM_LISTEN;
+		ret += epoll_ctl(epfd, EPOLL_CTL_ADD, shm.listen_fd, &event);
+	}
+	if (ret != 0) {
+		perror("epoll_ctl: %s", strerror(errno));
+		goto epoll_add_err;
 	}
 
-	while (*args->run == true) {
-		/* Block until event arrives. */
-		ret = poll(poll_arr, poll_arr_len, -1);
-		if (ret == -1) {
+	user_table_online(active_users, args->shard);
+	while (run) {
+		/* Block until event arrives, don't hold back writers. */
+		user_table_offline(active_users, args->shard);
+		nfds = epoll_wait(epfd, events,
+		    sizeof(events) / sizeof(events[0]), -1);
+		user_table_online(active_users, args->shard);
+		/* Only clock read of this iteration. */
+		cclock_tick();
+		if (nfds == -1) {
 			if (errno == EINTR) {
-				pwarn("poll: Caught interrupt, continueing");
+				pwarn("epoll_wait: Caught interrupt, continueing");
 				continue;
 			} else {
-				perror("poll: %s", strerror(errno));
+				perror("epoll_wait: %s", strerror(errno));
 				goto poll_err;
 			}
-		} else if (ret == 0) {
-			pwarn("poll: Returned 0 even though timeout is inf");
-			continue;
 		}
 
 		/* Check for file descriptors with events. */
-		for (size_t n = 0; n < poll_arr_len; ++n) {
-			int sfd = poll_arr[n].fd;
-			/* Check for POLLIN,POLLPRI,POLLERR and POLLHUP.
-			 * The current impl does not support multiple events!
-			 */
-			switch (poll_arr[n].revents) {
-			case POLLIN: /* FALLTHROUGH*/
-			case POLLPRI:
-				ret = msg_handle(sfd, &active_users);
-				if (ret != 0) {
-					perror("msg_handle error");
-					goto poll_err;
-				}
+		for (int n = 0; n < nfds; ++n) {
+			uint32_t ev = events[n].data.u32;
+			int fd = -1;
+
+			if (ev == EV_STOP) {
+				/* Never read, so every shard sees it. */
+				run = false;
 				break;
-			case POLLERR:
-				perror("%d: POLLERR", sfd);
+			} else if (ev == EV_TIMER) {
+				if (read(tfd, &expirations, sizeof(expirations))
+				    != sizeof(expirations))
+					continue;
+				user_table_flush(active_users, timeout_func,
+				    NULL);
+				for (size_t i = 0; i < args->sfd_arr_len; ++i) {
+					stats_add(rx_dropped, rxdrop_tick(
+					    &rxdrops[i], cclock_ms()));
+				}
+				if (STATS_INTERVAL > 0 && args->shard == 0
+				    && cclock_ms() >= next_stats) {
+					stats_print(args->shard_count);
+					next_stats = cclock_ms() + STATS_INTERVAL;
+				}
+				continue;
+			} else if (ev == EV_SHM_LISTEN) {
+				while ((shm_idx = shm_accept(&shm, args->shard))
+				    >= 0) {
+					struct shm_peer *peer =
+					    &shm.peers[shm_idx];
+
+					event.events = EPOLLIN;
+					event.data.u32 = EV_SHM | shm_idx;
+					ret = epoll_ctl(epfd, EPOLL_CTL_ADD,
+					    peer->fds[SHM_FD_IN], &event);
+					event.events = EPOLLIN | EPOLLRDHUP;
+					event.data.u32 |= EV_SHM_CONN;
+					ret += epoll_ctl(epfd, EPOLL_CTL_ADD,
+					    peer->conn, &event);
+					if (ret != 0) {
+						pwarn("%d: shm epoll_ctl: %s",
+						    peer->conn,
+						    strerror(errno));
+						epoll_ctl(epfd, EPOLL_CTL_DEL,
+						    peer->fds[SHM_FD_IN], NULL);
+						shm_peer_close(&shm, shm_idx);
+						continue;
+					}
+					shm_owned[shm_idx] = true;
+					pdebug("%d: shm client %d", peer->conn,
+					    shm_idx);
+				}
+				if (shm_idx == -1)
+					pwarn("shm_accept: %s",
+					    strerror(errno));
+				continue;
+			} else if (ev & EV_SHM) {
+				shm_idx = ev & ~(EV_SHM | EV_SHM_CONN);
+				if (!shm_owned[shm_idx]) continue;
+				/* The client never writes to the connection,
+				 * any event means it is gone.
+				 */
+				if (!(ev & EV_SHM_CONN)) {
+					if (shm_handle(shm_idx, active_users)
+					    != 0) {
+						perror("shm_handle error");
+						goto poll_err;
+					}
+					user_table_quiescent(active_users,
+					    args->shard);
+					continue;
+				}
+				/* The client shares the eventfd, close
+				 * doesn't remove it from epoll.
+				 */
+				epoll_ctl(epfd, EPOLL_CTL_DEL,
+				    shm.peers[shm_idx].fds[SHM_FD_IN], NULL);
+				epoll_ctl(epfd, EPOLL_CTL_DEL,
+				    shm.peers[shm_idx].conn, NULL);
+				pdebug("%d: shm client %d left",
+				    shm.peers[shm_idx].conn, shm_idx);
+				shm_peer_close(&shm, shm_idx);
+				shm_owned[shm_idx] = false;
+				continue;
+			}
+			fd = sendqs[ev].fd;
+			if (events[n].events & EPOLLERR) {
+				perror("%d: EPOLLERR", fd);
 				goto poll_err;
-			case POLLHUP:
-				if (*args->run != false) {
-					perror("%d: POLLHUP", sfd);
+			}
+			/* Room in the send buffer again. */
+			if (events[n].events & EPOLLOUT) {
+				ret = sendq_flush(&sendqs[ev]);
+				if (ret != 0) {
+					perror("%d: sendq_flush: %s", fd,
+					    strerror(errno));
+					goto poll_err;
 				}
+			}
+			if (!(events[n].events & EPOLLIN))
+				continue;
+			/* Drain socket, so one wakeup handles a whole
+			 * burst of datagrams.
+			 */
+			while ((ret = msg_handle(fd, ev, active_users)) == 0);
+			if (ret == 1) {
+				perror("msg_handle error");
 				goto poll_err;
 			}
+			user_table_quiescent(active_users, args->shard);
 		}
 	}
 
 poll_err:
-	user_table_free(&active_users);
-user_queue_err:
+	user_table_offline(active_users, args->shard);
+	_sendqs = NULL;
+	_capture = NULL;
+epoll_add_err:
+	_rxdrops = NULL;
+	stats_attach_rxdrop(args->shard, NULL, 0);
+	for (size_t n = 0; n < sendqs_len; ++n) {
+		sendq_free(&sendqs[n]);
+	}
+	free(sendqs);
+	free(rxdrops);
+	close(tfd);
+timer_err:
+	close(epfd);
+epoll_err:
 	return NULL;
 }
 
-static int msg_handle(int sfd, struct user_table *active_users)
+static int shm_handle(size_t idx, struct user_table *active_users)
 {
+	struct shm_peer *peer = &shm.peers[idx];
+	char buffer[SHM_MSG_LEN] = {0};
+	ssize_t len = 0;
+	struct user user = {0};
 	int ret = 0;
-	struct sendall_func_args sendall_args = {0};
+
+	for (size_t n = 0; n < SHM_BATCH; ++n) {
+		len = shm_recv(peer, buffer);
+		if (len == -1) {
+			/* Empty, epoll fires again if more arrived. */
+			shm_sleep(peer);
+			break;
+		} else if (len == 0) {
+			continue;
+		}
+		stats_inc(msg_recv);
+		if (_capture != NULL && !capture_add(_capture,
+		    (void *)&peer->addr, buffer, len, cclock_real_ns()))
+			stats_inc(capture_dropped);
+		memset(&user, 0, sizeof(user));
+		memcpy(&user.addr, &peer->addr, peer->addr_len);
+		user.addr_len = peer->addr_len;
+		user.addr_family = AF_UNIX;
+		user.sock = USER_SOCK_SHM;
+		user.last_msg = cclock_ms();
+		ret = msg_process(peer->conn, active_users, &user, buffer,
+		    len);
+		if (ret != 0) break;
+	}
+
+	return ret;
+}
+
+static int msg_handle(int sfd, uint16_t sock,
+    struct user_table *active_users)
+{
+	ssize_t ret = 0;
 	/* Receive buffer. */
 	char buffer[MAX_MSG_SIZE] = {0};
 	size_t buffer_len = 0;
-	struct sockaddr_storage peeraddr = {0};
-	socklen_t peeraddr_len = sizeof(peeraddr);
+	struct iovec iov = {buffer, sizeof(buffer)};
+	char control[RX_CMSG_LEN];
+	struct msghdr msg = {0};
+	struct rx_cmsg cmsg = {0};
+	uint64_t rx_ns = 0, now_ns = 0;
 	/* Created user from ip. */
 	struct user user = {0};
 
-	/* Read UDP packet. */
-	ret = recvfrom(sfd, buffer, sizeof(buffer), 0,
-	    (struct sockaddr *)&peeraddr, &peeraddr_len);
+	/* Read UDP packet, with the drop counter and kernel timestamp. */
+	msg.msg_name = &user.addr;
+	msg.msg_namelen = sizeof(user.addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ret = recvmsg(sfd, &msg, MSG_DONTWAIT);
 	/* When ret is 0 either the datagram is 0
 	 * in size, or socket is closed. We will treat
 	 * it as a "0-datagram".
@@ -327,6 +862,11 @@ static int msg_handle(int sfd, struct user_table *active_users)
 	} else if (ret == -1) {
 		/* Ignore theese errors. */
 		switch (errno) {
+		case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+		case EWOULDBLOCK:
+#endif
+			return 2;
 		case EIO:
 		case ECONNRESET:
 		case EINTR:
@@ -340,97 +880,313 @@ static int msg_handle(int sfd, struct user_table *active_users)
 		}
 	} else {
 		buffer_len = ret;
+		stats_inc(msg_recv);
 	}
-	/* Create user and add to table (will allocate on heap). */
-	user.addr = peeraddr;
-	user.addr_len = peeraddr_len;
-	if (peeraddr_len == sizeof(struct sockaddr_in))
-		user.addr_family = AF_INET;
-	else if (peeraddr_len == sizeof(struct sockaddr_in6))
-		user.addr_family = AF_INET6;
-	else {
+	rx_cmsg_parse(&msg, &cmsg);
+	rxdrop_update(&_rxdrops[sock], cmsg.dropped);
+	if ((rx_ns = cmsg.timestamp) != 0) {
+		now_ns = cclock_real_ns();
+		/* Real time may step back, count that as no delay. */
+		stats_hist(rx_queue, now_ns > rx_ns ? now_ns - rx_ns : 0);
+	}
+	if (_capture != NULL && !capture_add(_capture, (void *)&user.addr,
+	    buffer, buffer_len, rx_ns != 0 ? rx_ns : cclock_real_ns()))
+		stats_inc(capture_dropped);
+	/* Create user and add to table (will take a slab slot). */
+	user.addr_len = msg.msg_namelen;
+	user.addr_family = user.addr.ss_family;
+	if (user.addr_len <= sizeof(sa_family_t)) {
+		/* Unbound AF_UNIX clients can't be answered. */
+		pdebug("%d: recvfrom (unnamed): drop", sfd);
+		return 0;
+	} else if (user.addr_family != AF_INET
+	    && user.addr_family != AF_INET6
+	    && user.addr_family != AF_UNIX) {
 		perror("%d: recvfrom (?): Unknown family (%d socklen)", sfd,
-		    peeraddr_len);
+		    user.addr_len);
 		return 1;
+	} else if (user.addr_family == AF_UNIX
+	    && shm_addr_is((void *)&user.addr, user.addr_len)) {
+		/* Only shared memory clients have these names. */
+		pdebug("%d: recvfrom (%s): shm name, drop", sfd,
+		    addr2str(user.addr_family, (void *)&user.addr));
+		return 0;
 	}
-	user.id = user_calculate_id(&user);
-	user.recv_fd = sfd;
-	user.last_msg = time(NULL);
-	user.last_msg_xs = (user.last_msg / 2) * 2; /* Round. */
+	user.sock = sock;
+	user.last_msg = cclock_ms();
 	/* Print debug infomation. */
 	pdebug("%d: recvfrom (%s): %zd bytes", sfd,
 	    addr2str(user.addr_family, (void *)&user.addr),
 	    buffer_len);
 
-	ret = user_table_update(active_users, &user, timeout_func, NULL);
+	ret = msg_process(sfd, active_users, &user, buffer, buffer_len);
+	if (rx_ns != 0) {
+		now_ns = cclock_real_ns();
+		stats_hist(rx_send, now_ns > rx_ns ? now_ns - rx_ns : 0);
+	}
+
+	return ret;
+}
+
+static int msg_process(int sfd, struct user_table *active_users,
+    struct user *user, char *buffer, size_t buffer_len)
+{
+	int ret = 0;
+	struct sendall_func_args sendall_args = {0};
+	uint16_t room = 0;
+	bool is_new = false, skip_mcast = false;
+	uint32_t slot = USER_SLOT_NONE;
+
+	ret = user_table_update(active_users, user, &slot);
 	if (ret == 1) {
+		stats_inc(shed_user);
 		pdebug("%d: spam-detected (%s)", sfd,
-		    addr2str(user.addr_family, (void *)&user.addr));
+		    addr2str(user->addr_family, (void *)&user->addr));
+		return 0;
+	} else if (ret == 2) {
+		/* Slots of timed out users are freed by the housekeeping
+		 * tick.
+		 */
+		pwarn("%d: user table full, drop (%s)", sfd,
+		    addr2str(user->addr_family, (void *)&user->addr));
 		return 0;
-	} else if (ret > 1) {
-		perror("Failed to update active user table: %s",
+	}
+	is_new = ret == 3;
+	/* Publish new users, timed out users are kicked by the housekeeping
+	 * tick.
+	 */
+	ret = user_table_publish(active_users);
+	if (ret != 0) {
+		perror("Failed to publish active user table: %s",
 		    strerror(errno));
 		return 1;
 	}
+	/* Show new users what was said in the lobby before they came. */
+	if (is_new) history_send(active_users, slot, 0);
+
+	if (cmd_handle(active_users, slot, buffer, buffer_len) == 1)
+		return 0;
+
+	/* Every recipient costs one token. */
+	room = __atomic_load_n(&active_users->slab.room[slot],
+	    __ATOMIC_RELAXED);
+	if (!tbucket_take(&fanout_tat, cclock_ms() * 1000,
+	    FANOUT_RATE_INTERVAL, FANOUT_RATE_BURST,
+	    user_table_room_len(active_users, room))) {
+		stats_inc(shed_fanout);
+		pdebug("%d: fan-out limit, drop (%s)", sfd,
+		    addr2str(user->addr_family, (void *)&user->addr));
+		return 0;
+	}
 
-	sendall_args.sender = &user;
-	sendall_args.buffer = buffer;
+	/* Format once for the whole room, and keep it for new users. */
 	sendall_args.buffer_len = buffer_len;
-	user_table_every(active_users, sendall_func, &sendall_args);
+	sendall_args.buffer = msg_formatter(active_users->slab.id[slot], 0,
+	    buffer, &sendall_args.buffer_len);
+	history_append(&history, room, sendall_args.buffer,
+	    sendall_args.buffer_len);
+	/* Lobby members in the multicast group share one datagram. */
+	if (room == 0 && mcast_fd != -1) {
+		if (sendto(mcast_fd, sendall_args.buffer,
+		    sendall_args.buffer_len, MSG_DONTWAIT, (void *)&mcast_addr,
+		    mcast_addr_len) < 0) {
+			pwarn("%d: multicast sendto: %s, using unicast",
+			    mcast_fd, strerror(errno));
+		} else {
+			skip_mcast = true;
+		}
+	}
+	user_table_every_room(active_users, room, skip_mcast, sendall_func,
+	    &sendall_args);
 
 	return 0;
 }
 
-static void sendall_func(const struct user *user, void *args0)
+static int cmd_handle(struct user_table *active_users, uint32_t slot,
+    char *buffer, size_t buffer_len)
 {
-	struct sendall_func_args *args = args0;
-	ssize_t bytes = 0;
-	size_t buffer_len = args->buffer_len;
-	const char *send_buffer = NULL;
+	struct sendall_func_args sendall_args = {0};
+	char notice[MSG_BODY_LEN] = {0};
+	const size_t join_len = sizeof(MSG_CMD_JOIN) - 1;
+	const size_t msg_len = sizeof(MSG_CMD_MSG) - 1;
+	const size_t mcast_len = sizeof(MSG_CMD_MCAST) - 1;
+	size_t len = 0;
+	unsigned long id = 0;
+	uint32_t to = 0;
+	char *end = NULL, last = 0;
+	int ret = 0;
+	bool on = false;
 
-	if (user->id == args->sender->id) {
-		send_buffer = msg_formatter(args->sender->id, user->id,
-		    args->buffer, &buffer_len);
-	} else {
-		send_buffer = msg_formatter(args->sender->id, user->id, args->buffer,
-		    &buffer_len);
+	if (buffer_len > join_len
+	    && memcmp(buffer, MSG_CMD_JOIN, join_len) == 0) {
+		/* Room name ends at whitespace. */
+		while (join_len + len < buffer_len
+		    && buffer[join_len + len] != ' '
+		    && buffer[join_len + len] != '\n')
+			++len;
+		ret = user_table_join(active_users, slot, &buffer[join_len],
+		    len);
+		if (ret == -1) {
+			notice_send(active_users, slot, errno == ENOSPC
+			    ? "No free rooms.\n" : "Invalid room name.\n");
+			return 1;
+		}
+		user_table_publish(active_users);
+		snprintf(notice, sizeof(notice), "Joined %.*s.\n", (int)len,
+		    &buffer[join_len]);
+		notice_send(active_users, slot, notice);
+		history_send(active_users, slot, ret);
+		return 1;
+	} else if (buffer_len > mcast_len
+	    && memcmp(buffer, MSG_CMD_MCAST, mcast_len) == 0) {
+		/* Client joined (or left) the group itself, we only stop (or
+		 * start) sending unicast to it.
+		 */
+		if (mcast_fd == -1) {
+			notice_send(active_users, slot,
+			    "Multicast is disabled.\n");
+			return 1;
+		}
+		on = buffer_len - mcast_len >= 2
+		    && memcmp(&buffer[mcast_len], "on", 2) == 0;
+		user_table_set_mcast(active_users, slot, on);
+		user_table_publish(active_users);
+		snprintf(notice, sizeof(notice), "Multicast %s.\n",
+		    on ? "on" : "off");
+		notice_send(active_users, slot, notice);
+		return 1;
+	} else if (buffer_len > msg_len
+	    && memcmp(buffer, MSG_CMD_MSG, msg_len) == 0) {
+		/* Id is followed by a single space and the body. The last byte
+		 * bounds strtoul and is put back, the body may not end in a
+		 * newline.
+		 */
+		last = buffer[buffer_len - 1];
+		buffer[buffer_len - 1] = '\0';
+		id = strtoul(&buffer[msg_len], &end, 16);
+		buffer[buffer_len - 1] = last;
+		if (end == &buffer[msg_len] || *end != ' ' || id > UINT32_MAX
+		    || (to = user_table_find_id(active_users, id))
+		    == USER_SLOT_NONE) {
+			notice_send(active_users, slot, "No such user.\n");
+			return 1;
+		}
+		/* Direct messages cost one token per recipient too. */
+		if (!tbucket_take(&fanout_tat, cclock_ms() * 1000,
+		    FANOUT_RATE_INTERVAL, FANOUT_RATE_BURST, 2)) {
+			stats_inc(shed_fanout);
+			return 1;
+		}
+		sendall_args.buffer_len = buffer_len - (end + 1 - buffer);
+		sendall_args.buffer = msg_formatter(active_users->slab.id[slot],
+		    active_users->slab.id[to], end + 1,
+		    &sendall_args.buffer_len);
+		sendall_func(active_users, to, &sendall_args);
+		/* Sender sees their own message, as in rooms. */
+		if (to != slot)
+			sendall_func(active_users, slot, &sendall_args);
+		return 1;
 	}
 
-	bytes = sendto(user->recv_fd, send_buffer, buffer_len, 0,
-	    (void *)&user->addr, user->addr_len);
-	if (bytes < 1) {
-		perror("%d: sendto (%s): %s", user->recv_fd,
-		    addr2str(user->addr_family, (void *)&user->addr),
+	return 0;
+}
+
+static void sendall_func(const struct user_table *table, uint32_t slot,
+    void *args0)
+{
+	struct sendall_func_args *args = args0;
+	const struct user_cold *cold = &table->slab.cold[slot];
+	struct sendq *q = NULL;
+	int ret = 0;
+
+	/* Shared memory clients get their copy in their own ring. */
+	if (table->slab.sock[slot] == USER_SOCK_SHM) {
+		if (shm_send(&shm, (void *)&cold->addr, cold->addr_len,
+		    args->buffer, args->buffer_len) != 0)
+			pdebug("shm client (%s) is gone",
+			    addr2str(cold->addr_family, (void *)&cold->addr));
+		return;
+	}
+	q = &_sendqs[table->slab.sock[slot]];
+	ret = sendq_send(q, args->buffer, args->buffer_len,
+	    (void *)&cold->addr, cold->addr_len);
+	if (ret != 0) {
+		perror("%d: sendto (%s): %s", q->fd,
+		    addr2str(cold->addr_family, (void *)&cold->addr),
 		    strerror(errno));
 		return;
 	}
 	/* Print debugging infomation. */
-	pdebug("%d: sendto (%s): %zd bytes", user->recv_fd,
-	    addr2str(user->addr_family, (void *)&user->addr), bytes);
+	pdebug("%d: sendto (%s): %zu bytes", q->fd,
+	    addr2str(cold->addr_family, (void *)&cold->addr),
+	    args->buffer_len);
 }
 
-static void timeout_func(const struct user *user, void *args0)
+static void notice_send(const struct user_table *table, uint32_t slot,
+    const char *text)
+{
+	struct sendall_func_args args = {0};
+
+	args.buffer_len = strlen(text);
+	args.buffer = msg_formatter(0, table->slab.id[slot], text,
+	    &args.buffer_len);
+	sendall_func(table, slot, &args);
+}
+
+static void history_send(const struct user_table *table, uint32_t slot,
+    uint16_t room)
+{
+	const struct user_cold *cold = &table->slab.cold[slot];
+	struct sendq *q = NULL;
+	int ret = 0;
+
+	if (table->slab.sock[slot] == USER_SOCK_SHM) return;
+	if (!tbucket_take(&fanout_tat, cclock_ms() * 1000,
+	    FANOUT_RATE_INTERVAL, FANOUT_RATE_BURST, HISTORY_REPLAY))
+		return;
+	q = &_sendqs[table->slab.sock[slot]];
+	ret = history_replay(&history, room, HISTORY_REPLAY, q,
+	    (void *)&cold->addr, cold->addr_len);
+	if (ret == -1) {
+		pwarn("%d: history replay (%s): %s", q->fd,
+		    addr2str(cold->addr_family, (void *)&cold->addr),
+		    strerror(errno));
+	}
+}
+
+static void timeout_func(const struct user_table *table, uint32_t slot,
+    void *args0)
 {
 	struct timeout_func_args *args = args0;
+	const struct user_cold *cold = &table->slab.cold[slot];
+	struct sendq *q = NULL;
 	const char *send_buffer = NULL;
 	size_t send_buffer_len = sizeof(MSG_USR_TIMEOUT_STR);
-	ssize_t bytes = 0;
+	int ret = 0;
 
 	(void)args; /* We don't use it yet. */
-	send_buffer = msg_formatter(0, user->id, MSG_USR_TIMEOUT_STR,
-	    &send_buffer_len);
+	send_buffer = msg_formatter(0, table->slab.id[slot],
+	    MSG_USR_TIMEOUT_STR, &send_buffer_len);
+	/* Repeated against datagram loss, the ring needs it once. */
+	if (table->slab.sock[slot] == USER_SOCK_SHM) {
+		shm_send(&shm, (void *)&cold->addr, cold->addr_len,
+		    send_buffer, send_buffer_len);
+		return;
+	}
+	q = &_sendqs[table->slab.sock[slot]];
 
 	for (size_t n = 0; n < MSG_USR_TIMEOUT_COUNT; ++n) {
-		bytes = sendto(user->recv_fd, send_buffer, send_buffer_len, 0,
-		    (void *)&user->addr, user->addr_len);
-		if (bytes < 1) {
-			perror("%d: sendto (%s): %s", user->recv_fd,
-			    addr2str(user->addr_family, (void *)&user->addr),
+		ret = sendq_send(q, send_buffer, send_buffer_len,
+		    (void *)&cold->addr, cold->addr_len);
+		if (ret != 0) {
+			perror("%d: sendto (%s): %s", q->fd,
+			    addr2str(cold->addr_family, (void *)&cold->addr),
 			    strerror(errno));
 			return;
 		}
 	}
 	/* Print debugging infomation. */
-	pdebug("%d: sendto (%s): %zd bytes", user->recv_fd,
-	    addr2str(user->addr_family, (void *)&user->addr), bytes);
+	pdebug("%d: sendto (%s): %zu bytes", q->fd,
+	    addr2str(cold->addr_family, (void *)&cold->addr),
+	    send_buffer_len);
 }
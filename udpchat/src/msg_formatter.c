@@ -11,20 +11,22 @@
 static __thread char return_buffer[MSG_TOTAL_LEN] = {0};
 static __thread char id_buffer[MSG_ID_LEN] = {0};
 /* body USES NEWLINE AS ZERO TERMINATOR. */
-const char *msg_formatter(uint16_t sender_id, uint16_t receiver_id,
+const char *msg_formatter(uint32_t sender_id, uint32_t receiver_id,
     const char *body, size_t *len)
 {
 	size_t free = 0;
-	(void)receiver_id;
 
 	if (body != NULL) {
 		/* Copy id to start of buffer without terminator. */
-		snprintf(id_buffer, sizeof(id_buffer), "%3" PRIu16,
-		    sender_id % 999);
+		snprintf(id_buffer, sizeof(id_buffer), "%0*" PRIx32,
+		    MSG_ID_LEN - 1, sender_id);
 		memcpy(&return_buffer[free], id_buffer, MSG_ID_LEN - 1);
 		free += MSG_ID_LEN - 1;
-		/* Copy format string after id without terminator. */
-		memcpy(&return_buffer[free], "| ", MSG_F_LEN - 1);
+		/* Copy format string after id without terminator, direct
+		 * messages are marked with '>'.
+		 */
+		memcpy(&return_buffer[free], receiver_id != 0 ? "> " : "| ",
+		    MSG_F_LEN - 1);
 		free += MSG_F_LEN - 1;
 		/* Copy body after format string without newline and add newline. */
 		memcpy(&return_buffer[free], body, MIN(*len, MSG_BODY_LEN) - 1);
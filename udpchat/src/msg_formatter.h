@@ -5,7 +5,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-const char *msg_formatter(uint16_t _sender_id, uint16_t _receiver_id,
+/* Format body from sender_id. receiver_id is 0 for room messages, and the
+ * receiver's id for direct messages. Ids are shown in hex, as /msg takes
+ * them.
+ */
+const char *msg_formatter(uint32_t _sender_id, uint32_t _receiver_id,
     const char *_body, size_t *_body_len);
 
 #endif
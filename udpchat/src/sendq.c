@@ -0,0 +1,116 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+#include "sendq.h"
+#include "stats.h"
+
+/* Turn EPOLLOUT on or off for the queue's socket. */
+static int sendq_arm(struct sendq *q, bool out);
+
+int sendq_init(struct sendq *q, int fd, int epfd, uint32_t epdata,
+    size_t cap)
+{
+	memset(q, 0, sizeof(*q));
+	q->cap = cap;
+	q->fd = fd;
+	q->epfd = epfd;
+	q->epdata = epdata;
+
+	return 0;
+}
+
+int sendq_send(struct sendq *q, const void *buf, size_t len,
+    const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct sendq_entry *entry = NULL;
+
+	if (q->len == 0) {
+		if (sendto(q->fd, buf, len, MSG_DONTWAIT, addr, addr_len) >= 0)
+			return 0;
+		/* A full AF_UNIX peer doesn't make the socket unwritable, so
+		 * EPOLLOUT would never stop firing. Drop instead, also for
+		 * peers that went away.
+		 */
+		if (addr->sa_family == AF_UNIX && (errno == EAGAIN
+		    || errno == EWOULDBLOCK || errno == ECONNREFUSED
+		    || errno == ENOENT)) {
+			stats_inc(send_dropped);
+			return 0;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+			return -1;
+		/* Wait for room in the send buffer. */
+		if (sendq_arm(q, true) != 0)
+			return -1;
+	}
+
+	/* Most sockets never block, so the ring is allocated on first use. */
+	if (q->ring == NULL) {
+		q->ring = calloc(q->cap, sizeof(*q->ring));
+		if (q->ring == NULL) return -1;
+	}
+	if (q->len == q->cap) {
+		/* Full, drop oldest. */
+		q->head = (q->head + 1) % q->cap;
+		--q->len;
+		stats_inc(send_dropped);
+	}
+	entry = &q->ring[(q->head + q->len) % q->cap];
+	if (len > sizeof(entry->buf)) len = sizeof(entry->buf);
+	if (addr_len > sizeof(entry->addr)) addr_len = sizeof(entry->addr);
+	memcpy(entry->buf, buf, len);
+	entry->len = len;
+	memcpy(&entry->addr, addr, addr_len);
+	entry->addr_len = addr_len;
+	++q->len;
+	stats_inc(send_queued);
+
+	return 0;
+}
+
+int sendq_flush(struct sendq *q)
+{
+	while (q->len > 0) {
+		struct sendq_entry *entry = &q->ring[q->head];
+
+		if (sendto(q->fd, entry->buf, entry->len, MSG_DONTWAIT,
+		    (void *)&entry->addr, entry->addr_len) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK
+			    || errno == ENOBUFS)
+				return 0;
+			/* Drop datagrams we can't send (e.g. EHOSTUNREACH),
+			 * so one bad address doesn't block the queue.
+			 */
+			stats_inc(send_dropped);
+		}
+		q->head = (q->head + 1) % q->cap;
+		--q->len;
+	}
+
+	return sendq_arm(q, false);
+}
+
+void sendq_free(struct sendq *q)
+{
+	free(q->ring);
+	memset(q, 0, sizeof(*q));
+}
+
+static int sendq_arm(struct sendq *q, bool out)
+{
+	struct epoll_event event = {0};
+
+	event.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	event.data.u32 = q->epdata;
+
+	return epoll_ctl(q->epfd, EPOLL_CTL_MOD, q->fd, &event);
+}
@@ -0,0 +1,52 @@
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "config.h"
+
+struct sendq_entry {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	uint16_t len;
+	char buf[MSG_TOTAL_LEN];
+};
+
+/* Bounded queue of datagrams that didn't fit in the socket send buffer.
+ * A queue belongs to one socket of one shard, and is only used by that
+ * shard's thread. When the queue is not empty, EPOLLOUT is enabled on the
+ * socket and sendq_flush should be called when it fires. If the queue is
+ * full the oldest datagram is dropped.
+ */
+struct sendq {
+	int fd;
+	int epfd; /* Used to enable and disable EPOLLOUT. */
+	uint32_t epdata; /* epoll_event.data.u32 of fd. */
+	struct sendq_entry *ring;
+	size_t cap, head, len;
+};
+
+/* Init queue with room for cap datagrams, the ring is allocated when the
+ * first datagram is queued.
+ * Returns 0 on success, 1 on error (errno is set).
+ */
+int sendq_init(struct sendq *_q, int _fd, int _epfd, uint32_t _epdata,
+    size_t _cap);
+/* Send datagram now, or queue it if the socket would block. Datagrams are
+ * always sent in order, so nothing is sent directly while the queue is not
+ * empty. buf is truncated to MSG_TOTAL_LEN when queued. Datagrams to
+ * AF_UNIX peers that can't take them are dropped, never queued.
+ * Returns 0 if sent or queued, -1 on error (errno is set).
+ */
+int sendq_send(struct sendq *_q, const void *_buf, size_t _len,
+    const struct sockaddr *_addr, socklen_t _addr_len);
+/* Send queued datagrams until the socket would block.
+ * Returns 0 on success, -1 on error (errno is set).
+ */
+int sendq_flush(struct sendq *_q);
+void sendq_free(struct sendq *_q);
+
+#endif
@@ -0,0 +1,347 @@
+#define _GNU_SOURCE /* memfd_create, accept4 */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "shm.h"
+#include "common/net.h"
+
+_Static_assert(SHM_MSG_LEN >= MSG_TOTAL_LEN, "SHM_MSG_LEN too small");
+_Static_assert((SHM_RING_SLOTS & (SHM_RING_SLOTS - 1)) == 0
+    && (SHM_RECV_SLOTS & (SHM_RECV_SLOTS - 1)) == 0,
+    "SHM_*_SLOTS must be powers of two");
+
+/* Create a memfd of size bytes that can't shrink or grow, so the other side
+ * can't make our mapping fault. Returns fd, or -1 on error.
+ */
+static int shm_memfd(const char *name, size_t size);
+/* Close fds and unmap what was mapped, entries of -1 and NULL are skipped. */
+static void shm_release(int conn, int *fds, void *hdr, size_t hdr_size,
+    const void *recv, size_t recv_size);
+
+int shm_listen(struct shm_server *shm, const char *spec)
+{
+	struct sockaddr_un addr = {0};
+	socklen_t addr_len = 0;
+	int ret = 0;
+
+	memset(shm, 0, sizeof(*shm));
+	shm->listen_fd = -1;
+	addr_len = unix_addr_set(&addr, spec);
+	if (addr_len == 0) {
+		errno = EINVAL;
+		goto socket_err;
+	}
+
+	shm->listen_fd = socket(AF_UNIX,
+	    SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (shm->listen_fd == -1) goto socket_err;
+	if (unix_bind(shm->listen_fd, (void *)&addr, addr_len) != 0
+	    || listen(shm->listen_fd, SOMAXCONN) != 0)
+		goto listen_err;
+	ret = pthread_mutex_init(&shm->lock, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto mutex_err;
+	}
+	for (size_t n = 0; n < SHM_PEERS_MAX; ++n) {
+		ret = pthread_mutex_init(&shm->send_locks[n], NULL);
+		if (ret == 0) continue;
+		while (n-- > 0) pthread_mutex_destroy(&shm->send_locks[n]);
+		pthread_mutex_destroy(&shm->lock);
+		errno = ret;
+		goto mutex_err;
+	}
+
+	return 0;
+
+mutex_err:
+	sock_unlink(shm->listen_fd);
+listen_err:
+	ret = errno;
+	close(shm->listen_fd);
+	errno = ret;
+socket_err:
+	memset(shm, 0, sizeof(*shm));
+	shm->listen_fd = -1;
+	return 1;
+}
+
+int shm_accept(struct shm_server *shm, size_t shard)
+{
+	struct shm_peer peer = {0};
+	const uint32_t magic = SHM_MAGIC;
+	struct iovec iov = {(void *)&magic, sizeof(magic)};
+	char control[CMSG_SPACE(sizeof(peer.fds))] = {0};
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg = NULL;
+	size_t idx = 0;
+	int ret = 0;
+
+	for (size_t n = 0; n < SHM_FDS; ++n) peer.fds[n] = -1;
+	peer.conn = accept4(shm->listen_fd, NULL, NULL,
+	    SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (peer.conn == -1) {
+		/* Another shard took it, or the client gave up. */
+		if (errno == EAGAIN || errno == EWOULDBLOCK
+		    || errno == ECONNABORTED)
+			return -2;
+		return -1;
+	}
+
+	peer.hdr_size = sizeof(*peer.hdr)
+	    + SHM_RING_SLOTS * sizeof(peer.hdr->ring[0]);
+	peer.fds[SHM_FD_PEER] = shm_memfd("udpchat-peer", peer.hdr_size);
+	if (peer.fds[SHM_FD_PEER] == -1) goto err;
+	peer.hdr = mmap(NULL, peer.hdr_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, peer.fds[SHM_FD_PEER], 0);
+	if (peer.hdr == MAP_FAILED) {
+		peer.hdr = NULL;
+		goto err;
+	}
+	peer.hdr->magic = SHM_MAGIC;
+	peer.hdr->version = SHM_VERSION;
+	peer.hdr->slots = SHM_RING_SLOTS;
+	/* Asleep until the first message. */
+	peer.hdr->server_waiting = 1;
+	peer.recv_size = sizeof(*peer.recv)
+	    + SHM_RECV_SLOTS * sizeof(peer.recv->ring[0]);
+	peer.fds[SHM_FD_RECV] = shm_memfd("udpchat-recv", peer.recv_size);
+	if (peer.fds[SHM_FD_RECV] == -1) goto err;
+	peer.recv = mmap(NULL, peer.recv_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, peer.fds[SHM_FD_RECV], 0);
+	if (peer.recv == MAP_FAILED) {
+		peer.recv = NULL;
+		goto err;
+	}
+	peer.recv->magic = SHM_MAGIC;
+	peer.recv->version = SHM_VERSION;
+	peer.recv->slots = SHM_RECV_SLOTS;
+#ifdef F_SEAL_FUTURE_WRITE
+	/* The client can only map it read-only. The server doesn't read it
+	 * back, so a client that still writes it only hurts itself.
+	 */
+	fcntl(peer.fds[SHM_FD_RECV], F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+	peer.fds[SHM_FD_IN] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	peer.fds[SHM_FD_OUT] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (peer.fds[SHM_FD_IN] == -1 || peer.fds[SHM_FD_OUT] == -1)
+		goto err;
+	peer.shard = shard;
+
+	pthread_mutex_lock(&shm->lock);
+	while (idx < SHM_PEERS_MAX && shm->peers[idx].live) ++idx;
+	if (idx == SHM_PEERS_MAX) {
+		pthread_mutex_unlock(&shm->lock);
+		errno = ENOSPC;
+		goto err;
+	}
+	/* Unique, so a new client never inherits an old client's user. */
+	peer.addr.sun_family = AF_UNIX;
+	ret = snprintf(&peer.addr.sun_path[1], sizeof(peer.addr.sun_path) - 1,
+	    SHM_ADDR_PREFIX "%zu-%u", idx, ++shm->accepted);
+	peer.addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + ret;
+	peer.live = true;
+	pthread_mutex_lock(&shm->send_locks[idx]);
+	shm->peers[idx] = peer;
+	pthread_mutex_unlock(&shm->send_locks[idx]);
+	if (idx >= shm->peers_len) shm->peers_len = idx + 1;
+	pthread_mutex_unlock(&shm->lock);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(peer.fds));
+	memcpy(CMSG_DATA(cmsg), peer.fds, sizeof(peer.fds));
+	if (sendmsg(peer.conn, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+		ret = errno;
+		shm_peer_close(shm, idx);
+		errno = ret;
+		return -1;
+	}
+
+	return idx;
+
+err:
+	shm_release(peer.conn, peer.fds, peer.hdr, peer.hdr_size, peer.recv,
+	    peer.recv_size);
+	return -1;
+}
+
+ssize_t shm_recv(struct shm_peer *peer, char *buf)
+{
+	struct shm_peer_hdr *hdr = peer->hdr;
+	const uint64_t tail = peer->tail;
+	const struct shm_slot *slot = &hdr->ring[tail % SHM_RING_SLOTS];
+	size_t len = 0;
+
+	/* A bogus head only makes us read the client's own slots again. */
+	if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) == tail) return -1;
+	/* The client may still scribble on it, use a copy of len. */
+	len = MIN(__atomic_load_n(&slot->len, __ATOMIC_RELAXED),
+	    SHM_MSG_LEN);
+	memcpy(buf, slot->buf, len);
+	peer->tail = tail + 1;
+	__atomic_store_n(&hdr->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return len;
+}
+
+bool shm_sleep(struct shm_peer *peer)
+{
+	struct shm_peer_hdr *hdr = peer->hdr;
+	eventfd_t value = 0;
+
+	eventfd_read(peer->fds[SHM_FD_IN], &value);
+	__atomic_store_n(&hdr->server_waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST) == peer->tail)
+		return true;
+	/* If the client didn't see the flag, nobody wrote the eventfd. */
+	if (__atomic_exchange_n(&hdr->server_waiting, 0, __ATOMIC_ACQ_REL))
+		eventfd_write(peer->fds[SHM_FD_IN], 1);
+	return false;
+}
+
+bool shm_addr_is(const struct sockaddr_un *addr, socklen_t addr_len)
+{
+	const size_t prefix = sizeof(SHM_ADDR_PREFIX) - 1;
+
+	return addr->sun_family == AF_UNIX
+	    && addr_len > offsetof(struct sockaddr_un, sun_path) + 1 + prefix
+	    && addr->sun_path[0] == '\0'
+	    && memcmp(&addr->sun_path[1], SHM_ADDR_PREFIX, prefix) == 0;
+}
+
+int shm_send(struct shm_server *shm, const struct sockaddr_un *addr,
+    socklen_t addr_len, const char *buf, size_t len)
+{
+	const size_t prefix = sizeof(SHM_ADDR_PREFIX) - 1;
+	struct shm_peer *peer = NULL;
+	struct shm_slot *slot = NULL;
+	unsigned long idx = 0;
+	uint64_t pos = 0;
+
+	/* Addresses are made by shm_accept, the index follows the prefix. */
+	if (!shm_addr_is(addr, addr_len)) {
+		errno = ENOENT;
+		return -1;
+	}
+	idx = strtoul(&addr->sun_path[1 + prefix], NULL, 10);
+	if (len > SHM_MSG_LEN) len = SHM_MSG_LEN;
+
+	if (idx >= SHM_PEERS_MAX) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	pthread_mutex_lock(&shm->send_locks[idx]);
+	peer = &shm->peers[idx];
+	/* The slot may have been reused by a newer client. */
+	if (!peer->live || peer->addr_len != addr_len
+	    || memcmp(&peer->addr, addr, addr_len) != 0) {
+		pthread_mutex_unlock(&shm->send_locks[idx]);
+		errno = ENOENT;
+		return -1;
+	}
+	pos = peer->recv_head++;
+	slot = &peer->recv->ring[pos % SHM_RECV_SLOTS];
+	__atomic_store_n(&slot->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->len = len;
+	memcpy(slot->buf, buf, len);
+	__atomic_store_n(&slot->seq, 2 * pos + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&peer->recv->head, pos + 1, __ATOMIC_RELEASE);
+
+	/* Order the head before the waiting flag, see shm_client_recv. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&peer->hdr->client_waiting, __ATOMIC_RELAXED)
+	    && __atomic_exchange_n(&peer->hdr->client_waiting, 0,
+	    __ATOMIC_ACQ_REL))
+		eventfd_write(peer->fds[SHM_FD_OUT], 1);
+	pthread_mutex_unlock(&shm->send_locks[idx]);
+
+	return 0;
+}
+
+void shm_peer_close(struct shm_server *shm, size_t idx)
+{
+	struct shm_peer peer = {0};
+
+	pthread_mutex_lock(&shm->lock);
+	pthread_mutex_lock(&shm->send_locks[idx]);
+	peer = shm->peers[idx];
+	memset(&shm->peers[idx], 0, sizeof(shm->peers[idx]));
+	pthread_mutex_unlock(&shm->send_locks[idx]);
+	while (shm->peers_len > 0 && !shm->peers[shm->peers_len - 1].live)
+		--shm->peers_len;
+	pthread_mutex_unlock(&shm->lock);
+
+	shm_release(peer.conn, peer.fds, peer.hdr, peer.hdr_size, peer.recv,
+	    peer.recv_size);
+}
+
+void shm_close(struct shm_server *shm)
+{
+	if (shm->listen_fd == -1) return;
+
+	for (size_t n = 0; n < SHM_PEERS_MAX; ++n) {
+		if (shm->peers[n].live) shm_peer_close(shm, n);
+	}
+	sock_unlink(shm->listen_fd);
+	close(shm->listen_fd);
+	for (size_t n = 0; n < SHM_PEERS_MAX; ++n) {
+		pthread_mutex_destroy(&shm->send_locks[n]);
+	}
+	pthread_mutex_destroy(&shm->lock);
+	memset(shm, 0, sizeof(*shm));
+	shm->listen_fd = -1;
+}
+
+static int shm_memfd(const char *name, size_t size)
+{
+	int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	int ret = 0;
+
+	if (fd == -1) return -1;
+	if (ftruncate(fd, size) != 0
+	    || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+		ret = errno;
+		close(fd);
+		errno = ret;
+		return -1;
+	}
+
+	return fd;
+}
+
+static void shm_release(int conn, int *fds, void *hdr, size_t hdr_size,
+    const void *recv, size_t recv_size)
+{
+	const int err = errno;
+
+	if (hdr != NULL) munmap(hdr, hdr_size);
+	if (recv != NULL) munmap((void *)recv, recv_size);
+	for (size_t n = 0; n < SHM_FDS; ++n) {
+		if (fds[n] != -1) close(fds[n]);
+	}
+	if (conn != -1) close(conn);
+	errno = err;
+}
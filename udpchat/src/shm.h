@@ -0,0 +1,189 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+
+/* Shared memory transport for clients on the same host (-S). A client
+ * connects to a SOCK_SEQPACKET socket and gets SHM_FDS fds with SCM_RIGHTS:
+ * - SHM_FD_PEER, a memfd with struct shm_peer_hdr and the ring of messages
+ *   from the client to the server (single producer, single consumer).
+ * - SHM_FD_RECV, a read-only memfd with the ring of messages to the
+ *   client. Only what the server sends to this user is written there, the
+ *   same way as datagrams, so a client never sees other users' messages.
+ * - SHM_FD_IN and SHM_FD_OUT, eventfds to wake the server and the client.
+ *   A side only writes one when the other side said it sleeps, so busy
+ *   clients exchange messages without any syscall.
+ * The server never trusts what the client can write: it keeps its own
+ * copies of its ring positions and only reads messages and the client's
+ * waiting flag from shared memory.
+ * Closing the connection disconnects the client.
+ */
+#define SHM_MAGIC (0x55434853) /* "UCHS" */
+#define SHM_VERSION (2)
+/* User addresses of clients are abstract names starting with this. */
+#define SHM_ADDR_PREFIX "udpchat-shm-"
+
+enum {
+	SHM_FD_PEER,
+	SHM_FD_RECV,
+	SHM_FD_IN,
+	SHM_FD_OUT,
+	SHM_FDS
+};
+
+/* A message. Slots of the receive ring are a seqlock, seq is 2 * pos + 1
+ * while the slot for position pos is written and 2 * pos + 2 when it is
+ * done. The client's ring only uses len and buf.
+ */
+struct shm_slot {
+	uint64_t seq;
+	uint16_t len;
+	char buf[SHM_MSG_LEN];
+};
+
+/* Start of SHM_FD_PEER. head and tail only grow, the slot of position pos
+ * is ring[pos % slots]. A side that is going to sleep sets its waiting
+ * flag, the other side clears it and writes the eventfd.
+ */
+struct shm_peer_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint64_t head __attribute__((aligned(64))); /* Written by the client. */
+	uint32_t client_waiting; /* Client sleeps on SHM_FD_OUT. */
+	uint64_t tail __attribute__((aligned(64))); /* Written by the server. */
+	uint32_t server_waiting; /* Server sleeps on SHM_FD_IN. */
+	struct shm_slot ring[] __attribute__((aligned(64)));
+};
+
+/* Start of SHM_FD_RECV, only the server writes it. Clients that fall more
+ * than slots behind lose the oldest messages, the server never waits.
+ */
+struct shm_recv_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint64_t head __attribute__((aligned(64))); /* Next position. */
+	struct shm_slot ring[] __attribute__((aligned(64)));
+};
+
+/* Server side of a client, owned by the shard that accepted it. Only the
+ * owner reads the client's ring and closes it, senders only write the
+ * receive ring of live clients while holding the peer's send lock.
+ */
+struct shm_peer {
+	bool live;
+	size_t shard;
+	int conn;
+	int fds[SHM_FDS];
+	struct shm_peer_hdr *hdr;
+	size_t hdr_size;
+	struct shm_recv_ring *recv;
+	size_t recv_size;
+	/* Private copies of hdr->tail and recv->head. */
+	uint64_t tail;
+	uint64_t recv_head;
+	/* Address of the client's user, an abstract name that isn't bound.
+	 * It starts with the index of the peer, see shm_send.
+	 */
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+};
+
+struct shm_server {
+	int listen_fd;
+	/* Taken to add and remove peers. */
+	pthread_mutex_t lock;
+	struct shm_peer peers[SHM_PEERS_MAX];
+	/* Taken to write the receive ring of the peer with the same index,
+	 * and to add or remove it. Shards sending to different clients don't
+	 * contend.
+	 */
+	pthread_mutex_t send_locks[SHM_PEERS_MAX];
+	size_t peers_len; /* Highest live index + 1. */
+	uint32_t accepted; /* Makes user addresses unique. */
+};
+
+/* Client side, see shm_client_open. */
+struct shm_client {
+	int conn;
+	int fds[SHM_FDS];
+	struct shm_peer_hdr *hdr;
+	size_t hdr_size;
+	const struct shm_recv_ring *recv;
+	size_t recv_size;
+	uint64_t cursor; /* Next receive position to read. */
+	uint64_t lost; /* Messages overwritten before they were read. */
+	uint64_t spin; /* ns */
+};
+
+/* Listen on spec, a UNIX_PREFIX address without the prefix. The socket is
+ * non-blocking.
+ * Returns 0 on success, 1 on error (errno is set).
+ */
+int shm_listen(struct shm_server *_shm, const char *_spec);
+/* Accept one client for shard and send it its fds.
+ * Returns the index of the peer, -1 on error (errno is set) and -2 when no
+ * client is waiting.
+ */
+int shm_accept(struct shm_server *_shm, size_t _shard);
+/* Copy the next message of peer to buf (SHM_MSG_LEN bytes), only called by
+ * the owner. Returns its length, or -1 when the ring is empty.
+ */
+ssize_t shm_recv(struct shm_peer *_peer, char *_buf);
+/* Tell the client peer the server sleeps, call when shm_recv found the
+ * ring empty. Returns false if a message arrived meanwhile, the eventfd is
+ * readable again then.
+ */
+bool shm_sleep(struct shm_peer *_peer);
+/* True if addr (addr_len bytes) has the form of a client's user address,
+ * an abstract name starting with SHM_ADDR_PREFIX.
+ */
+bool shm_addr_is(const struct sockaddr_un *_addr, socklen_t _addr_len);
+/* Write a message to the receive ring of the client with the user address
+ * addr, and wake it if it sleeps. Messages longer than SHM_MSG_LEN are
+ * truncated.
+ * Returns 0 on success, -1 when the client is gone (errno is ENOENT).
+ */
+int shm_send(struct shm_server *_shm, const struct sockaddr_un *_addr,
+    socklen_t _addr_len, const char *_buf, size_t _len);
+/* Remove peer, only called by the owner after the fds left its epoll. */
+void shm_peer_close(struct shm_server *_shm, size_t _peer);
+/* Close every peer and the socket, shards must be stopped. */
+void shm_close(struct shm_server *_shm);
+
+/* Client side, in shm_client.c so the server doesn't carry it. */
+
+/* Connect to a server listening on spec (as for shm_listen).
+ * Returns 0 on success, 1 on error (errno is set).
+ */
+int shm_client_open(struct shm_client *_cl, const char *_spec);
+/* Queue a message to the server, never blocks.
+ * Returns 0 on success, -1 on error (errno is set).
+ *
+ * Possible errors:
+ * EMSGSIZE - len is larger than SHM_MSG_LEN.
+ * EAGAIN - The ring is full.
+ */
+int shm_client_send(struct shm_client *_cl, const void *_buf, size_t _len);
+/* Copy the next message for this client to buf (SHM_MSG_LEN bytes). Spins
+ * first, then sleeps on SHM_FD_OUT, up to timeout ms per wakeup (-1 waits
+ * forever).
+ * Returns its length, or -1 on error (errno is set).
+ *
+ * Possible errors:
+ * ETIMEDOUT - Nothing arrived within timeout.
+ * ECONNRESET - The server closed the connection.
+ */
+ssize_t shm_client_recv(struct shm_client *_cl, char *_buf, int _timeout);
+void shm_client_close(struct shm_client *_cl);
+
+#endif
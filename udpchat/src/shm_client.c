@@ -0,0 +1,220 @@
+#define _GNU_SOURCE /* MSG_CMSG_CLOEXEC */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#include "config.h"
+#include "shm.h"
+#include "common/net.h"
+
+/* Client side of the shared memory transport, see shm.h. Not part of the
+ * server, clients build it with common/net.c (see shmchat.c).
+ */
+
+static uint64_t shm_now_ns(void);
+
+int shm_client_open(struct shm_client *cl, const char *spec)
+{
+	struct sockaddr_un addr = {0};
+	socklen_t addr_len = 0;
+	uint32_t magic = 0;
+	struct iovec iov = {&magic, sizeof(magic)};
+	char control[CMSG_SPACE(sizeof(cl->fds))] = {0};
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg = NULL;
+	ssize_t ret = 0;
+
+	memset(cl, 0, sizeof(*cl));
+	cl->conn = -1;
+	for (size_t n = 0; n < SHM_FDS; ++n) cl->fds[n] = -1;
+	cl->spin = SHM_SPIN_MIN * 1000;
+	addr_len = unix_addr_set(&addr, spec);
+	if (addr_len == 0) {
+		errno = EINVAL;
+		goto err;
+	}
+	cl->conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (cl->conn == -1) goto err;
+	if (connect(cl->conn, (void *)&addr, addr_len) != 0) goto err;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ret = recvmsg(cl->conn, &msg, MSG_CMSG_CLOEXEC);
+	if (ret == -1) goto err;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	/* A full server closes the connection without fds. */
+	if (ret != sizeof(magic) || magic != SHM_MAGIC || cmsg == NULL
+	    || cmsg->cmsg_type != SCM_RIGHTS
+	    || cmsg->cmsg_len != CMSG_LEN(sizeof(cl->fds))) {
+		errno = ECONNREFUSED;
+		goto err;
+	}
+	memcpy(cl->fds, CMSG_DATA(cmsg), sizeof(cl->fds));
+
+	cl->hdr_size = sizeof(*cl->hdr)
+	    + SHM_RING_SLOTS * sizeof(cl->hdr->ring[0]);
+	cl->hdr = mmap(NULL, cl->hdr_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, cl->fds[SHM_FD_PEER], 0);
+	if (cl->hdr == MAP_FAILED) {
+		cl->hdr = NULL;
+		goto err;
+	}
+	cl->recv_size = sizeof(*cl->recv)
+	    + SHM_RECV_SLOTS * sizeof(cl->recv->ring[0]);
+	cl->recv = mmap(NULL, cl->recv_size, PROT_READ, MAP_SHARED,
+	    cl->fds[SHM_FD_RECV], 0);
+	if (cl->recv == MAP_FAILED) {
+		cl->recv = NULL;
+		goto err;
+	}
+	if (cl->hdr->version != SHM_VERSION
+	    || cl->hdr->slots != SHM_RING_SLOTS
+	    || cl->recv->slots != SHM_RECV_SLOTS) {
+		errno = EPROTO;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	ret = errno;
+	shm_client_close(cl);
+	errno = ret;
+	return 1;
+}
+
+int shm_client_send(struct shm_client *cl, const void *buf, size_t len)
+{
+	struct shm_peer_hdr *hdr = cl->hdr;
+	const uint64_t head = hdr->head;
+	struct shm_slot *slot = &hdr->ring[head % SHM_RING_SLOTS];
+
+	if (len > SHM_MSG_LEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (head - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE)
+	    >= SHM_RING_SLOTS) {
+		errno = EAGAIN;
+		return -1;
+	}
+	slot->len = len;
+	memcpy(slot->buf, buf, len);
+	__atomic_store_n(&hdr->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->server_waiting, __ATOMIC_SEQ_CST)
+	    && __atomic_exchange_n(&hdr->server_waiting, 0, __ATOMIC_ACQ_REL))
+		eventfd_write(cl->fds[SHM_FD_IN], 1);
+
+	return 0;
+}
+
+ssize_t shm_client_recv(struct shm_client *cl, char *buf, int timeout)
+{
+	const struct shm_recv_ring *recv = cl->recv;
+	/* The connection only becomes readable when the server is gone. */
+	struct pollfd pfds[2] = {
+		{cl->fds[SHM_FD_OUT], POLLIN, 0}, {cl->conn, POLLIN, 0}
+	};
+	uint64_t deadline = 0, seq = 0, head = 0;
+	eventfd_t value = 0;
+	/* client_waiting is set, the next empty check sleeps. */
+	bool armed = false;
+	size_t len = 0;
+	int ret = 0;
+
+	for (;;) {
+		const struct shm_slot *slot =
+		    &recv->ring[cl->cursor % SHM_RECV_SLOTS];
+		const uint64_t want = 2 * cl->cursor + 2;
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == want) {
+			len = MIN(slot->len, SHM_MSG_LEN);
+			memcpy(buf, slot->buf, len);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED)
+			    != seq)
+				continue; /* Overwritten while copying. */
+			++cl->cursor;
+			if (armed) {
+				__atomic_store_n(&cl->hdr->client_waiting, 0,
+				    __ATOMIC_RELAXED);
+			} else if (deadline != 0) {
+				/* Found while spinning, spin longer. */
+				cl->spin = MIN(cl->spin * 2,
+				    SHM_SPIN_MAX * 1000ULL);
+			}
+			return len;
+		} else if (seq > want) {
+			/* Lapped, skip to the oldest slot still there. */
+			head = __atomic_load_n(&recv->head, __ATOMIC_ACQUIRE);
+			cl->lost += head - SHM_RECV_SLOTS - cl->cursor;
+			cl->cursor = head - SHM_RECV_SLOTS;
+			continue;
+		}
+
+		/* Nothing new, spin first. */
+		if (!armed) {
+			if (deadline == 0) deadline = shm_now_ns() + cl->spin;
+			if (shm_now_ns() < deadline) continue;
+			cl->spin = MAX(cl->spin / 2, SHM_SPIN_MIN * 1000ULL);
+			armed = true;
+			/* Check the ring once more after the flag is set, the
+			 * server checks the flag after it moved head.
+			 */
+			__atomic_store_n(&cl->hdr->client_waiting, 1,
+			    __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			continue;
+		}
+		ret = poll(pfds, 2, timeout);
+		if (ret <= 0 || pfds[1].revents != 0) {
+			__atomic_store_n(&cl->hdr->client_waiting, 0,
+			    __ATOMIC_RELAXED);
+			if (ret == 0) errno = ETIMEDOUT;
+			else if (ret > 0) errno = ECONNRESET;
+			return -1;
+		}
+		eventfd_read(cl->fds[SHM_FD_OUT], &value);
+		/* The server cleared the flag when it woke us. */
+		__atomic_store_n(&cl->hdr->client_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void shm_client_close(struct shm_client *cl)
+{
+	const int err = errno;
+
+	if (cl->hdr != NULL) munmap(cl->hdr, cl->hdr_size);
+	if (cl->recv != NULL) munmap((void *)cl->recv, cl->recv_size);
+	for (size_t n = 0; n < SHM_FDS; ++n) {
+		if (cl->fds[n] != -1) close(cl->fds[n]);
+	}
+	if (cl->conn != -1) close(cl->conn);
+	errno = err;
+	memset(cl, 0, sizeof(*cl));
+	cl->conn = -1;
+	for (size_t n = 0; n < SHM_FDS; ++n) cl->fds[n] = -1;
+}
+
+static uint64_t shm_now_ns(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
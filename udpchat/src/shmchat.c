@@ -0,0 +1,117 @@
+#define _POSIX_C_SOURCE 200809L /* POSIX-2008 */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "shm.h"
+
+/* Chat with a udpchat server over shared memory (-S): every line of stdin
+ * is sent as a message, every message from the server goes to stdout. At
+ * the end of stdin, messages are read until none came for WAIT_MS.
+ */
+#define WAIT_MS (500)
+
+/* Sends lines of stdin, the main thread receives. The client's two rings
+ * have one producer and one consumer each, so both can use it at once.
+ */
+static void *send_func(void *args);
+struct send_func_args {
+	struct shm_client *cl;
+	bool done; /* stdin ended. */
+	int err; /* errno of the failed send, 0 if none. */
+};
+
+int main(int argc, char *argv[])
+{
+	struct shm_client cl = {0};
+	struct send_func_args args = {0};
+	pthread_t sender = {0};
+	char buffer[SHM_MSG_LEN] = {0};
+	ssize_t len = 0;
+	int ret = 0, status = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s path\n", argv[0]);
+		return 1;
+	}
+	if (shm_client_open(&cl, argv[1]) != 0) {
+		fprintf(stderr, "Failed to connect to '%s': %s\n", argv[1],
+		    strerror(errno));
+		return 1;
+	}
+	args.cl = &cl;
+	ret = pthread_create(&sender, NULL, send_func, &args);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		shm_client_close(&cl);
+		return 1;
+	}
+
+	for (;;) {
+		len = shm_client_recv(&cl, buffer,
+		    __atomic_load_n(&args.done, __ATOMIC_ACQUIRE)
+		    ? WAIT_MS : 100);
+		if (len >= 0) {
+			fwrite(buffer, 1, len, stdout);
+			fflush(stdout);
+		} else if (errno != ETIMEDOUT) {
+			fprintf(stderr, "Failed to receive: %s\n",
+			    strerror(errno));
+			status = 1;
+			break;
+		} else if (__atomic_load_n(&args.done, __ATOMIC_ACQUIRE)) {
+			/* Timed out after stdin ended. */
+			break;
+		}
+	}
+	/* The server left while stdin is open, exit takes the sender down. */
+	if (!__atomic_load_n(&args.done, __ATOMIC_ACQUIRE))
+		return status;
+	pthread_join(sender, NULL);
+	if (args.err != 0) {
+		fprintf(stderr, "Failed to send: %s\n", strerror(args.err));
+		status = 1;
+	}
+	if (cl.lost > 0)
+		fprintf(stderr, "%llu messages lost\n",
+		    (unsigned long long)cl.lost);
+	shm_client_close(&cl);
+
+	return status;
+}
+
+static void *send_func(void *args0)
+{
+	struct send_func_args *args = args0;
+	const struct timespec backoff = {0, 100000}; /* 100 us */
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t len = 0;
+
+	while ((len = getline(&line, &line_cap, stdin)) > 0) {
+		if ((size_t)len > MSG_BODY_LEN) {
+			/* The server cuts it anyway, keep the newline. */
+			line[MSG_BODY_LEN - 1] = '\n';
+			len = MSG_BODY_LEN;
+		}
+		/* The server takes its time, wait for room in the ring. */
+		while (shm_client_send(args->cl, line, len) != 0) {
+			if (errno != EAGAIN) {
+				args->err = errno;
+				goto out;
+			}
+			nanosleep(&backoff, NULL);
+		}
+	}
+out:
+	free(line);
+	__atomic_store_n(&args->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
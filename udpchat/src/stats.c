@@ -0,0 +1,126 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "stats.h"
+#include "common/print.h"
+#include "common/net.h"
+
+struct stats stats_arr[SHARD_MAX] = {{0}};
+/* Threads that never attach count into the first set. */
+__thread struct stats *_stats = &stats_arr[0];
+/* Keeps shards from freeing their rxdrops while they are printed. */
+static pthread_mutex_t rxdrops_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void stats_attach(size_t shard)
+{
+	_stats = &stats_arr[shard];
+}
+
+/* Print p50, p99 and max of h in us, if it has any values. */
+static void hist_print(const char *name, size_t shard, const struct hist *h);
+
+void stats_attach_rxdrop(size_t shard, const struct rxdrop *rxdrops,
+    size_t rxdrops_len)
+{
+	pthread_mutex_lock(&rxdrops_lock);
+	stats_arr[shard].rxdrops = rxdrops;
+	stats_arr[shard].rxdrops_len = rxdrops != NULL ? rxdrops_len : 0;
+	pthread_mutex_unlock(&rxdrops_lock);
+}
+
+void stats_print(size_t shards_len)
+{
+	struct stats sum = {0};
+	struct hist shard_queue, shard_send;
+
+	for (size_t n = 0; n < shards_len && n < SHARD_MAX; ++n) {
+		sum.msg_recv += __atomic_load_n(&stats_arr[n].msg_recv,
+		    __ATOMIC_RELAXED);
+		sum.shed_user += __atomic_load_n(&stats_arr[n].shed_user,
+		    __ATOMIC_RELAXED);
+		sum.shed_fanout += __atomic_load_n(&stats_arr[n].shed_fanout,
+		    __ATOMIC_RELAXED);
+		sum.send_queued += __atomic_load_n(&stats_arr[n].send_queued,
+		    __ATOMIC_RELAXED);
+		sum.send_dropped += __atomic_load_n(&stats_arr[n].send_dropped,
+		    __ATOMIC_RELAXED);
+		sum.rx_dropped += __atomic_load_n(&stats_arr[n].rx_dropped,
+		    __ATOMIC_RELAXED);
+		sum.capture_dropped += __atomic_load_n(
+		    &stats_arr[n].capture_dropped, __ATOMIC_RELAXED);
+		hist_merge(&sum.rx_queue, &stats_arr[n].rx_queue);
+		hist_merge(&sum.rx_send, &stats_arr[n].rx_send);
+	}
+
+	pinfo("stats: recv %" PRIu64 " rx-dropped %" PRIu64
+	    " shed-user %" PRIu64 " shed-fanout %" PRIu64
+	    " send-queued %" PRIu64 " send-dropped %" PRIu64, sum.msg_recv,
+	    sum.rx_dropped, sum.shed_user, sum.shed_fanout, sum.send_queued,
+	    sum.send_dropped);
+	if (sum.capture_dropped > 0) {
+		pinfo("stats: capture-dropped %" PRIu64, sum.capture_dropped);
+	}
+	/* Only sockets that ever dropped, there may be thousands. */
+	pthread_mutex_lock(&rxdrops_lock);
+	for (size_t n = 0; n < shards_len && n < SHARD_MAX; ++n) {
+		const struct rxdrop *rxdrops = stats_arr[n].rxdrops;
+
+		for (size_t i = 0; i < stats_arr[n].rxdrops_len; ++i) {
+			const uint64_t dropped = __atomic_load_n(
+			    &rxdrops[i].dropped, __ATOMIC_RELAXED);
+
+			struct sockaddr_storage addr = {0};
+			socklen_t addr_len = sizeof(addr);
+			struct addr_key key = {0};
+			char port[sizeof(":65535")] = "";
+
+			if (dropped == 0) continue;
+			if (getsockname(rxdrops[i].fd, (void *)&addr,
+			    &addr_len) != 0)
+				continue;
+			addr_key_set(&key, (void *)&addr);
+			/* AF_UNIX sockets have no port. */
+			if (key.family != AF_UNIX)
+				snprintf(port, sizeof(port), ":%u",
+				    ntohs(key.port));
+			pinfo("stats: shard %zu %s%s rx-dropped %" PRIu64
+			    " (%" PRIu64 "/s)", n,
+			    addr2str(addr.ss_family, (void *)&addr), port,
+			    dropped,
+			    __atomic_load_n(&rxdrops[i].rate,
+			    __ATOMIC_RELAXED));
+		}
+	}
+	pthread_mutex_unlock(&rxdrops_lock);
+	if (hist_total(&sum.rx_queue) == 0) return;
+	hist_print("rx-queue", SHARD_MAX, &sum.rx_queue);
+	hist_print("rx-send", SHARD_MAX, &sum.rx_send);
+	if (shards_len < 2) return;
+	for (size_t n = 0; n < shards_len && n < SHARD_MAX; ++n) {
+		memset(&shard_queue, 0, sizeof(shard_queue));
+		memset(&shard_send, 0, sizeof(shard_send));
+		hist_merge(&shard_queue, &stats_arr[n].rx_queue);
+		hist_merge(&shard_send, &stats_arr[n].rx_send);
+		hist_print("rx-queue", n, &shard_queue);
+		hist_print("rx-send", n, &shard_send);
+	}
+}
+
+static void hist_print(const char *name, size_t shard, const struct hist *h)
+{
+	const uint64_t total = hist_total(h);
+	char prefix[32] = "";
+
+	if (total == 0) return;
+	if (shard < SHARD_MAX)
+		snprintf(prefix, sizeof(prefix), "shard %zu ", shard);
+	pinfo("stats: %s%s n %" PRIu64 " p50 %.1fus p99 %.1fus "
+	    "p999 %.1fus max %.1fus", prefix, name, total,
+	    hist_quantile(h, 500) / 1000.0, hist_quantile(h, 990) / 1000.0,
+	    hist_quantile(h, 999) / 1000.0, h->max / 1000.0);
+}
@@ -0,0 +1,55 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "common/hist.h"
+#include "common/rxdrop.h"
+
+/* Counters, one set per shard so shards never write the same cache line.
+ * Only the owning shard writes, stats_print sums all sets.
+ */
+struct stats {
+	uint64_t msg_recv; /* Datagrams received. */
+	uint64_t shed_user; /* Dropped by the per user token bucket. */
+	uint64_t shed_fanout; /* Dropped by the global fan-out bucket. */
+	uint64_t send_queued; /* Sends that would block, see sendq.h. */
+	uint64_t send_dropped; /* Dropped from a full (or failing) sendq. */
+	uint64_t rx_dropped; /* Dropped by the kernel (SO_RXQ_OVFL). */
+	uint64_t capture_dropped; /* Not captured, the ring was full. */
+	/* Sockets of the shard, see stats_attach_rxdrop. */
+	const struct rxdrop *rxdrops;
+	size_t rxdrops_len;
+	/* With -t, time from the kernel timestamp of a datagram until it was
+	 * read (queueing delay), and until its messages were sent.
+	 */
+	struct hist rx_queue;
+	struct hist rx_send;
+} __attribute__((aligned(64)));
+
+extern struct stats stats_arr[SHARD_MAX];
+/* Counters of the current thread, see stats_attach. */
+extern __thread struct stats *_stats;
+
+/* Make the calling thread count into shard's counters. */
+void stats_attach(size_t _shard);
+/* Print drops of the shard's sockets with the stats, until detached with
+ * NULL.
+ */
+void stats_attach_rxdrop(size_t _shard, const struct rxdrop *_rxdrops,
+    size_t _rxdrops_len);
+/* Print the sum of the first shards_len shards with pinfo. Latencies are
+ * also printed for every shard, a saturated shard has a queue delay far
+ * above the others.
+ */
+void stats_print(size_t _shards_len);
+
+#define stats_inc(_field) \
+	__atomic_add_fetch(&_stats->_field, 1, __ATOMIC_RELAXED)
+#define stats_add(_field, _n) \
+	__atomic_add_fetch(&_stats->_field, (_n), __ATOMIC_RELAXED)
+#define stats_hist(_field, _ns) hist_add(&_stats->_field, (_ns))
+
+#endif
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE /* syscall */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "steer.h"
+#include "common/print.h"
+
+/* eBPF instructions, named after the kernel's macros. */
+#define INSN(code, dst, src, off, imm) \
+    ((struct bpf_insn){(code), (dst), (src), (off), (imm)})
+#define MOV64_REG(dst, src) INSN(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+#define MOV64_IMM(dst, imm) INSN(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define ALU64_IMM(op, dst, imm) INSN(BPF_ALU64 | (op) | BPF_K, dst, 0, 0, imm)
+#define ALU32_IMM(op, dst, imm) INSN(BPF_ALU | (op) | BPF_K, dst, 0, 0, imm)
+#define ALU32_REG(op, dst, src) INSN(BPF_ALU | (op) | BPF_X, dst, src, 0, 0)
+#define TO_HOST(dst, bits) INSN(BPF_ALU | BPF_END | BPF_TO_BE, dst, 0, 0, bits)
+#define LDX_MEM(size, dst, src, off) \
+    INSN(BPF_LDX | (size) | BPF_MEM, dst, src, off, 0)
+#define STX_MEM(size, dst, src, off) \
+    INSN(BPF_STX | (size) | BPF_MEM, dst, src, off, 0)
+#define JNE_IMM(dst, imm, off) INSN(BPF_JMP | BPF_JNE | BPF_K, dst, 0, off, imm)
+#define CALL(func) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, func)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* Stack of the eBPF program, below the frame pointer r10. */
+#define FP_KEY (-4) /* u32 shard */
+#define FP_PORT (-8) /* u16 */
+#define FP_IHL (-12) /* u8 */
+#define FP_ADDR (-32) /* 16 bytes */
+
+static int bpf(int cmd, union bpf_attr *attr);
+static enum steer_kind steer_ebpf(const int *sfds, size_t sfds_len,
+    int family);
+static enum steer_kind steer_cbpf(const int *sfds, size_t sfds_len,
+    int family);
+/* Append r0 = bpf_skb_load_bytes_relative(r6, r2, r10 + fp, len, NET) to
+ * prog, with r2 set to off unless off is -1. Returns the new length.
+ */
+static size_t ebpf_load(struct bpf_insn *prog, size_t prog_len, int off,
+    int fp, int len);
+
+enum steer_kind steer_attach(const int *sfds, size_t sfds_len, int family)
+{
+	enum steer_kind kind = STEER_NONE;
+
+	if (family != AF_INET && family != AF_INET6) {
+		errno = EAFNOSUPPORT;
+		return STEER_NONE;
+	}
+	kind = steer_ebpf(sfds, sfds_len, family);
+	if (kind != STEER_NONE) return kind;
+	pdebug("%d: eBPF steering: %s, trying cBPF", sfds[0],
+	    strerror(errno));
+	return steer_cbpf(sfds, sfds_len, family);
+}
+
+const char *steer_str(enum steer_kind kind)
+{
+	switch (kind) {
+	case STEER_EBPF: return "ebpf";
+	case STEER_CBPF: return "cbpf";
+	default: return "none";
+	}
+}
+
+static int bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static enum steer_kind steer_ebpf(const int *sfds, size_t sfds_len,
+    int family)
+{
+	struct bpf_insn prog[64];
+	size_t prog_len = 0, pass = 0;
+	/* Jumps to the end, patched once it is known. */
+	size_t jumps[4] = {0}, jumps_len = 0;
+	const int words = family == AF_INET6 ? 4 : 1;
+	union bpf_attr attr = {0};
+	uint32_t key = 0;
+	uint64_t value = 0;
+	int map_fd = -1, prog_fd = -1, ret = 0;
+
+	attr.map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+	attr.key_size = sizeof(key);
+	attr.value_size = sizeof(value);
+	attr.max_entries = sfds_len;
+	map_fd = bpf(BPF_MAP_CREATE, &attr);
+	if (map_fd == -1) return STEER_NONE;
+	for (key = 0; key < sfds_len; ++key) {
+		memset(&attr, 0, sizeof(attr));
+		value = sfds[key];
+		attr.map_fd = map_fd;
+		attr.key = (uintptr_t)&key;
+		attr.value = (uintptr_t)&value;
+		attr.flags = BPF_ANY;
+		if (bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) goto err;
+	}
+
+	/* Keep the context in r6, helpers clobber r1-r5. */
+	prog[prog_len++] = MOV64_REG(BPF_REG_6, BPF_REG_1);
+	prog_len = ebpf_load(prog, prog_len, family == AF_INET6 ? 8 : 12,
+	    FP_ADDR, 4 * words);
+	jumps[jumps_len++] = prog_len;
+	prog[prog_len++] = JNE_IMM(BPF_REG_0, 0, 0);
+	if (family == AF_INET6) {
+		/* Extension headers are rare enough to ignore. */
+		prog_len = ebpf_load(prog, prog_len, 40, FP_PORT, 2);
+	} else {
+		prog_len = ebpf_load(prog, prog_len, 0, FP_IHL, 1);
+		jumps[jumps_len++] = prog_len;
+		prog[prog_len++] = JNE_IMM(BPF_REG_0, 0, 0);
+		prog[prog_len++] = LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_10, FP_IHL);
+		prog[prog_len++] = ALU64_IMM(BPF_AND, BPF_REG_2, 0xf);
+		prog[prog_len++] = ALU64_IMM(BPF_LSH, BPF_REG_2, 2);
+		prog_len = ebpf_load(prog, prog_len, -1, FP_PORT, 2);
+	}
+	jumps[jumps_len++] = prog_len;
+	prog[prog_len++] = JNE_IMM(BPF_REG_0, 0, 0);
+
+	/* Same hash as steer_cbpf, see steer.h. */
+	prog[prog_len++] = LDX_MEM(BPF_H, BPF_REG_7, BPF_REG_10, FP_PORT);
+	prog[prog_len++] = TO_HOST(BPF_REG_7, 16);
+	for (int n = 0; n < words; ++n) {
+		prog[prog_len++] = LDX_MEM(BPF_W, BPF_REG_8, BPF_REG_10,
+		    FP_ADDR + 4 * n);
+		prog[prog_len++] = TO_HOST(BPF_REG_8, 32);
+		prog[prog_len++] = ALU32_REG(BPF_XOR, BPF_REG_7, BPF_REG_8);
+	}
+	prog[prog_len++] = ALU32_IMM(BPF_MUL, BPF_REG_7, (int32_t)STEER_MUL);
+	prog[prog_len++] = ALU32_IMM(BPF_RSH, BPF_REG_7, 16);
+	prog[prog_len++] = ALU32_IMM(BPF_MOD, BPF_REG_7, sfds_len);
+	prog[prog_len++] = STX_MEM(BPF_W, BPF_REG_10, BPF_REG_7, FP_KEY);
+	/* bpf_sk_select_reuseport(ctx, map, &key, 0), when it fails the
+	 * kernel falls back to its own hash.
+	 */
+	prog[prog_len++] = MOV64_REG(BPF_REG_1, BPF_REG_6);
+	prog[prog_len++] = INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2,
+	    BPF_PSEUDO_MAP_FD, 0, map_fd);
+	prog[prog_len++] = INSN(0, 0, 0, 0, 0);
+	prog[prog_len++] = MOV64_REG(BPF_REG_3, BPF_REG_10);
+	prog[prog_len++] = ALU64_IMM(BPF_ADD, BPF_REG_3, FP_KEY);
+	prog[prog_len++] = MOV64_IMM(BPF_REG_4, 0);
+	prog[prog_len++] = CALL(BPF_FUNC_sk_select_reuseport);
+	pass = prog_len;
+	prog[prog_len++] = MOV64_IMM(BPF_REG_0, SK_PASS);
+	prog[prog_len++] = EXIT();
+	for (size_t n = 0; n < jumps_len; ++n) {
+		prog[jumps[n]].off = pass - jumps[n] - 1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = prog_len;
+	attr.license = (uintptr_t)"MIT";
+	prog_fd = bpf(BPF_PROG_LOAD, &attr);
+	if (prog_fd == -1) goto err;
+	/* The group keeps the program, and the program the map. */
+	if (setsockopt(sfds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+	    &prog_fd, sizeof(prog_fd)) != 0)
+		goto err;
+	close(prog_fd);
+	close(map_fd);
+
+	return STEER_EBPF;
+
+err:
+	ret = errno;
+	if (prog_fd != -1) close(prog_fd);
+	close(map_fd);
+	errno = ret;
+	return STEER_NONE;
+}
+
+static enum steer_kind steer_cbpf(const int *sfds, size_t sfds_len,
+    int family)
+{
+	struct sock_filter prog[32];
+	struct sock_fprog fprog = {0, prog};
+	size_t len = 0;
+
+	/* Datagrams are pulled past the UDP header when the program runs,
+	 * so everything is loaded relative to the network header.
+	 */
+	if (family == AF_INET6) {
+		prog[len++] = (struct sock_filter)BPF_STMT(
+		    BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 40);
+	} else {
+		prog[len++] = (struct sock_filter)BPF_STMT(
+		    BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF);
+		prog[len++] = (struct sock_filter)BPF_STMT(
+		    BPF_ALU | BPF_AND | BPF_K, 0xf);
+		prog[len++] = (struct sock_filter)BPF_STMT(
+		    BPF_ALU | BPF_LSH | BPF_K, 2);
+		prog[len++] = (struct sock_filter)BPF_STMT(
+		    BPF_MISC | BPF_TAX, 0);
+		prog[len++] = (struct sock_filter)BPF_STMT(
+		    BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF);
+	}
+	for (int n = 0; n < (family == AF_INET6 ? 4 : 1); ++n) {
+		prog[len++] = (struct sock_filter)BPF_STMT(
+		    BPF_MISC | BPF_TAX, 0);
+		prog[len++] = (struct sock_filter)BPF_STMT(
+		    BPF_LD | BPF_W | BPF_ABS,
+		    SKF_NET_OFF + (family == AF_INET6 ? 8 : 12) + 4 * n);
+		prog[len++] = (struct sock_filter)BPF_STMT(
+		    BPF_ALU | BPF_XOR | BPF_X, 0);
+	}
+	prog[len++] = (struct sock_filter)BPF_STMT(
+	    BPF_ALU | BPF_MUL | BPF_K, STEER_MUL);
+	prog[len++] = (struct sock_filter)BPF_STMT(
+	    BPF_ALU | BPF_RSH | BPF_K, 16);
+	prog[len++] = (struct sock_filter)BPF_STMT(
+	    BPF_ALU | BPF_MOD | BPF_K, sfds_len);
+	/* Indexes past the group fall back to the kernel's hash. */
+	prog[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+	fprog.len = len;
+
+	if (setsockopt(sfds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog,
+	    sizeof(fprog)) != 0)
+		return STEER_NONE;
+
+	return STEER_CBPF;
+}
+
+static size_t ebpf_load(struct bpf_insn *prog, size_t prog_len, int off,
+    int fp, int len)
+{
+	prog[prog_len++] = MOV64_REG(BPF_REG_1, BPF_REG_6);
+	if (off != -1) prog[prog_len++] = MOV64_IMM(BPF_REG_2, off);
+	prog[prog_len++] = MOV64_REG(BPF_REG_3, BPF_REG_10);
+	prog[prog_len++] = ALU64_IMM(BPF_ADD, BPF_REG_3, fp);
+	prog[prog_len++] = MOV64_IMM(BPF_REG_4, len);
+	prog[prog_len++] = MOV64_IMM(BPF_REG_5, BPF_HDR_START_NET);
+	prog[prog_len++] = CALL(BPF_FUNC_skb_load_bytes_relative);
+
+	return prog_len;
+}
@@ -0,0 +1,33 @@
+#ifndef STEER_H
+#define STEER_H
+
+#include <stddef.h>
+
+/* Steering of a reuseport group (-a). Without a program the kernel picks a
+ * shard by the hash of the 4-tuple. With one, every datagram goes to shard
+ *   ((words of source address ^ source port) * STEER_MUL >> 16) % shards
+ * with the address words and port in host order, so which shard serves a
+ * client only depends on its address and the shard count.
+ */
+#define STEER_MUL (0x9E3779B1U)
+
+/* How a group is steered, see steer_attach. */
+enum steer_kind {
+	STEER_NONE,
+	STEER_EBPF,
+	STEER_CBPF
+};
+
+/* Attach a steering program to the reuseport group of sfds, sfds[n] is the
+ * socket of shard n and all are bound to the same family address. Tries a
+ * SO_ATTACH_REUSEPORT_EBPF program with a socket array first, which needs
+ * CAP_BPF (or CAP_SYS_ADMIN), then a SO_ATTACH_REUSEPORT_CBPF program that
+ * indexes the group in the order the sockets were bound.
+ * Returns how the group is steered, STEER_NONE on error (errno is set).
+ */
+enum steer_kind steer_attach(const int *_sfds, size_t _sfds_len,
+    int _family);
+/* Name of kind for logs. */
+const char *steer_str(enum steer_kind _kind);
+
+#endif
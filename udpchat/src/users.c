@@ -5,93 +5,456 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
+#include <sys/random.h>
 
-#include "util/net.h"
+#include "config.h"
+#include "common/net.h"
+#include "util/clock.h"
+#include "util/ratelimit.h"
 
-int user_table_init(struct user_table *table, time_t timeout)
+/* Lock-free slot allocation from the slab. */
+static uint32_t user_slab_pop(struct user_slab *slab);
+static void user_slab_push(struct user_slab *slab, uint32_t slot);
+/* Get a snapshot from the pool, or allocate one if the pool is empty. Must
+ * be called while holding write_lock.
+ */
+static struct user_snap *user_snap_get(struct user_table *table);
+/* Recycle everything retired before the oldest online reader's epoch. Must
+ * be called while holding write_lock.
+ */
+static void user_table_reclaim(struct user_table *table);
+/* Build and publish a snapshot from the current one and the pending users,
+ * kicking timed out users if timeout_func isn't NULL. Must be called while
+ * holding write_lock. Returns 0 on success, 1 on error.
+ */
+static int user_table_build(struct user_table *table,
+    user_table_timeout_func_t timeout_func, void *timeout_func_args);
+/* Add slot to the index of snap, which must not be published yet. */
+static void user_snap_insert(const struct user_table *table,
+    struct user_snap *snap, uint32_t slot);
+/* Slot of the user with key and addr in snap, or USER_SLOT_NONE. */
+static uint32_t user_snap_find(const struct user_table *table,
+    const struct user_snap *snap, uint64_t key, const struct addr_key *akey,
+    const struct sockaddr_storage *addr, socklen_t addr_len);
+/* Whether the user in cold has key and addr, AF_UNIX keys are only a hash
+ * of the path.
+ */
+static bool user_cold_eq(const struct user_cold *cold,
+    const struct addr_key *key, const struct sockaddr_storage *addr,
+    socklen_t addr_len);
+/* Id of the user with key in slot, never 0. */
+static uint32_t user_table_id(const struct user_table *table, uint64_t key,
+    uint32_t slot);
+
+int user_table_init(struct user_table *table, uint64_t timeout, size_t cap,
+    size_t readers_len)
 {
+	struct user_slab *slab = &table->slab;
+	int ret = 0;
+
+	/* At least one id bit is left for the hash. */
+	assert(cap > 0 && cap <= UINT32_MAX / 2);
 	memset(table, 0, sizeof(*table));
 	table->timeout = timeout;
+	table->rate_interval = MSG_RATE_INTERVAL;
+	table->rate_burst = MSG_RATE_BURST;
+	table->epoch = 1;
+	table->pending = USER_SLOT_NONE;
+	table->retired_slots = USER_SLOT_NONE;
+	/* Ids aren't guessable from the address, unless getrandom fails. */
+	if (getrandom(&table->id_secret, sizeof(table->id_secret), 0)
+	    != sizeof(table->id_secret))
+		table->id_secret = time(NULL) ^ (uintptr_t)table;
+	while (table->id_bits < 32 && (1ULL << table->id_bits) < cap)
+		++table->id_bits;
+	/* Index is at most half full, so probe sequences stay short. */
+	table->index_mask = 1;
+	while (table->index_mask < cap * 2 - 1)
+		table->index_mask = table->index_mask * 2 + 1;
+
+	/* Allocate slab, all slots start on the free stack. */
+	slab->cap = cap;
+	slab->key = calloc(cap, sizeof(*slab->key));
+	slab->id = calloc(cap, sizeof(*slab->id));
+	slab->sock = calloc(cap, sizeof(*slab->sock));
+	slab->last_msg = calloc(cap, sizeof(*slab->last_msg));
+	slab->tat = calloc(cap, sizeof(*slab->tat));
+	slab->cold = calloc(cap, sizeof(*slab->cold));
+	slab->room = calloc(cap, sizeof(*slab->room));
+	slab->mcast = calloc(cap, sizeof(*slab->mcast));
+	if (slab->key == NULL || slab->id == NULL || slab->sock == NULL
+	    || slab->last_msg == NULL || slab->tat == NULL
+	    || slab->cold == NULL || slab->room == NULL || slab->mcast == NULL)
+		goto slab_err;
+	for (size_t n = 0; n < cap; ++n) {
+		slab->cold[n].next = n + 1 < cap ? n + 1 : USER_SLOT_NONE;
+	}
+	slab->free_head = 0;
+
+	/* Rooms and scratch space for flush. */
+	table->rooms = calloc(ROOM_MAX, sizeof(*table->rooms));
+	table->scratch = calloc(cap, sizeof(*table->scratch));
+	if (table->rooms == NULL || table->scratch == NULL)
+		goto snap_err;
+	memcpy(table->rooms[0].name, "lobby", sizeof("lobby"));
+
+	/* Current snapshot and one spare, so the first flush doesn't
+	 * allocate.
+	 */
+	table->snap = user_snap_get(table);
+	if (table->snap == NULL) goto snap_err;
+	table->snap_pool = user_snap_get(table);
+	if (table->snap_pool == NULL) goto snap_err;
+
+	table->readers = calloc(readers_len, sizeof(*table->readers));
+	if (table->readers == NULL) goto readers_err;
+	table->readers_len = readers_len;
+	ret = pthread_mutex_init(&table->write_lock, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto mutex_err;
+	}
 
 	return 0;
+mutex_err:
+	free(table->readers);
+readers_err:
+snap_err:
+	free(table->snap);
+	free(table->snap_pool);
+	free(table->rooms);
+	free(table->scratch);
+slab_err:
+	free(slab->room);
+	free(slab->mcast);
+	free(slab->key);
+	free(slab->id);
+	free(slab->sock);
+	free(slab->last_msg);
+	free(slab->tat);
+	free(slab->cold);
+	return 1;
 }
 
 int user_table_update(struct user_table *table, const struct user *user,
+    uint32_t *out_slot)
+{
+	struct user_slab *slab = &table->slab;
+	const struct user_snap *snap = __atomic_load_n(&table->snap,
+	    __ATOMIC_ACQUIRE);
+	struct addr_key akey = {0};
+	uint64_t key = 0;
+	uint32_t slot = 0, head = 0;
+
+	/* Family was checked by the caller. */
+	addr_key_set(&akey, (const void *)&user->addr);
+	if (user->sock == USER_SOCK_SHM) akey.family = USER_KEY_SHM;
+	key = addr_key_hash(&akey);
+	slot = user_snap_find(table, snap, key, &akey, &user->addr,
+	    user->addr_len);
+	if (slot != USER_SLOT_NONE) {
+		/* Found! Another shard may update the same user. */
+		if (!tbucket_take(&slab->tat[slot], user->last_msg * 1000,
+		    table->rate_interval, table->rate_burst, 1))
+			return 1;
+		__atomic_store_n(&slab->last_msg[slot], user->last_msg,
+		    __ATOMIC_RELAXED);
+		__atomic_store_n(&slab->sock[slot], user->sock,
+		    __ATOMIC_RELAXED);
+
+		*out_slot = slot;
+		return 0;
+	}
+
+	/* If not found, take a free slot and push it to pending stack. */
+	slot = user_slab_pop(slab);
+	if (slot == USER_SLOT_NONE) {
+		errno = ENOSPC;
+		return 2;
+	}
+	slab->key[slot] = key;
+	__atomic_store_n(&slab->id[slot], user_table_id(table, key, slot),
+	    __ATOMIC_RELAXED);
+	slab->sock[slot] = user->sock;
+	slab->last_msg[slot] = user->last_msg;
+	/* First message takes one token from a full bucket. */
+	slab->tat[slot] = 0;
+	tbucket_take(&slab->tat[slot], user->last_msg * 1000,
+	    table->rate_interval, table->rate_burst, 1);
+	slab->cold[slot].key = akey;
+	slab->cold[slot].addr = user->addr;
+	slab->cold[slot].addr_len = user->addr_len;
+	slab->cold[slot].addr_family = user->addr_family;
+	slab->room[slot] = 0; /* Everybody starts in the lobby. */
+	slab->mcast[slot] = false;
+
+	head = __atomic_load_n(&table->pending, __ATOMIC_RELAXED);
+	do {
+		slab->cold[slot].next = head;
+	} while (!__atomic_compare_exchange_n(&table->pending, &head, slot,
+	    true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	*out_slot = slot;
+	return 3;
+}
+
+int user_table_flush(struct user_table *table,
     user_table_timeout_func_t timeout_func, void *timeout_func_args)
 {
-	struct user *p = table->start, *tmp = NULL;
+	int ret = 0;
+
+	assert(timeout_func != NULL);
+	/* Somebody else is publishing, they will pick up our users. */
+	if (pthread_mutex_trylock(&table->write_lock) != 0)
+		return 0;
+	ret = user_table_build(table, timeout_func, timeout_func_args);
+	pthread_mutex_unlock(&table->write_lock);
+
+	return ret;
+}
+
+int user_table_publish(struct user_table *table)
+{
+	int ret = 0;
+
+	if (__atomic_load_n(&table->pending, __ATOMIC_ACQUIRE) == USER_SLOT_NONE
+	    && !__atomic_load_n(&table->dirty, __ATOMIC_ACQUIRE))
+		return 0;
+	/* The lock holder may have exchanged pending before our push, so
+	 * wait for it instead of leaving our users to it. Once we have the
+	 * lock they are either published or still pending, and build does
+	 * nothing if nothing is left.
+	 */
+	pthread_mutex_lock(&table->write_lock);
+	ret = user_table_build(table, NULL, NULL);
+	pthread_mutex_unlock(&table->write_lock);
 
-	/* Cycle throught linked list to check if user is already part. */
-	while (p != NULL && p->next != NULL) {
-		tmp = p;
-		p = p->next;
+	return ret;
+}
 
-		if (sockaddr_cmp(&tmp->addr, &user->addr, tmp->addr_len) == 0) {
-			/* Found! */
-			if (tmp->last_msg == user->last_msg) return 1;
-			if (tmp->last_msg_xs == user->last_msg_xs) return 1;
-			/* If we don't update last_msg, they will time out. */
-			tmp->last_msg = user->last_msg;
-			tmp->last_msg_xs = user->last_msg_xs;
-			tmp->recv_fd = user->recv_fd;
-			tmp->id = user->id;
+static int user_table_build(struct user_table *table,
+    user_table_timeout_func_t timeout_func, void *timeout_func_args)
+{
+	struct user_slab *slab = &table->slab;
+	struct user_snap *old = NULL, *snap = NULL;
+	uint32_t pending = 0, slot = 0, *scratch = table->scratch;
+	size_t scratch_len = 0;
+	uint32_t pos[ROOM_MAX] = {0}, mcast_len = 0, mcast_pos = 0;
+	bool changed = false;
+	uint64_t now = cclock_ms();
 
+	pending = __atomic_exchange_n(&table->pending, USER_SLOT_NONE,
+	    __ATOMIC_ACQUIRE);
+	old = table->snap;
+	/* Rooms changed since last snapshot. */
+	changed = __atomic_exchange_n(&table->dirty, false, __ATOMIC_ACQ_REL);
+	/* Don't build a new snapshot if there is nothing to do. */
+	if (pending == USER_SLOT_NONE && !changed) {
+		size_t n = 0;
+		for (; timeout_func != NULL && n < old->len; ++n) {
+			if (__atomic_load_n(&slab->last_msg[old->slots[n]],
+			    __ATOMIC_RELAXED) + table->timeout < now)
+				break;
+		}
+		if (timeout_func == NULL || n == old->len) {
+			user_table_reclaim(table);
 			return 0;
-		} else if (tmp->last_msg + table->timeout < time(NULL)) {
-			/* Call timeout_func before deleting. */
-			timeout_func(tmp, timeout_func_args);
-
-			/* Remove tmp from list. */
-			if (tmp->prev != NULL && tmp->next != NULL) {
-				/* prev & next are not NULL. */
-				tmp->prev->next = tmp->next;
-				tmp->next->prev = tmp->prev;
-			} else if (tmp->prev != NULL) {
-				/* prev is not NULL, next is. */
-				tmp->prev->next = NULL;
-				table->end = tmp->prev;
-			} else if (tmp->next != NULL) {
-				/* prev is NULL, next is not. */
-				tmp->next->prev = NULL;
-				table->start = tmp->next;
-			} else {
-				/*  is only element, remove itself. */
-				table->start = NULL;
-				table->end = NULL;
-			}
-
-			memset(tmp, 0, sizeof(*tmp));
-			free(tmp);
 		}
 	}
-	if (p != NULL && sockaddr_cmp(&p->addr, &user->addr, p->addr_len) == 0) {
-		/* Found! */
-		if (p->last_msg == user->last_msg) return 1;
-		if (p->last_msg_xs == user->last_msg_xs) return 1;
-		/* If we don't update last_msg, they will time out. */
-		p->last_msg = p->last_msg;
-		p->last_msg_xs = user->last_msg_xs;
-		p->recv_fd = user->recv_fd;
-		p->id = user->id;
 
-		return 0;
+	snap = user_snap_get(table);
+	if (snap == NULL) {
+		/* Put pending users back, so they are not lost. */
+		while (pending != USER_SLOT_NONE) {
+			slot = pending;
+			pending = slab->cold[slot].next;
+			slab->cold[slot].next = __atomic_load_n(&table->pending,
+			    __ATOMIC_RELAXED);
+			while (!__atomic_compare_exchange_n(&table->pending,
+			    &slab->cold[slot].next, slot, true,
+			    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		}
+		return 1;
+	}
+
+	/* Keep active users and retire timeed out users. The index of the
+	 * new snapshot is built on the way, so pending users are deduped
+	 * without scanning.
+	 */
+	memset(snap->index, 0xff,
+	    ((size_t)table->index_mask + 1) * sizeof(snap->index[0]));
+	for (size_t n = 0; n < old->len; ++n) {
+		slot = old->slots[n];
+		if (timeout_func != NULL && __atomic_load_n(
+		    &slab->last_msg[slot], __ATOMIC_RELAXED)
+		    + table->timeout < now) {
+			/* Call timeout_func before retiring. */
+			timeout_func(table, slot, timeout_func_args);
+			slab->cold[slot].retire_epoch = table->epoch;
+			slab->cold[slot].next = table->retired_slots;
+			table->retired_slots = slot;
+			__atomic_store_n(&slab->id[slot], 0,
+			    __ATOMIC_RELAXED);
+			changed = true;
+		} else {
+			scratch[scratch_len++] = slot;
+			user_snap_insert(table, snap, slot);
+		}
+	}
+	/* Add pending users, the same user might be queued more than once. */
+	while (pending != USER_SLOT_NONE) {
+		slot = pending;
+		pending = slab->cold[slot].next;
+		if (user_snap_find(table, snap, slab->key[slot],
+		    &slab->cold[slot].key, &slab->cold[slot].addr,
+		    slab->cold[slot].addr_len) != USER_SLOT_NONE) {
+			/* Never published, but its id may have been sent
+			 * already, so retire it like a timed out user.
+			 */
+			__atomic_store_n(&slab->id[slot], 0,
+			    __ATOMIC_RELAXED);
+			slab->cold[slot].retire_epoch = table->epoch;
+			slab->cold[slot].next = table->retired_slots;
+			table->retired_slots = slot;
+		} else {
+			scratch[scratch_len++] = slot;
+			user_snap_insert(table, snap, slot);
+			changed = true;
+		}
 	}
 
-	/* If not found, add user to end of list. */
-	tmp = malloc(sizeof(*tmp));
-	if (tmp == NULL) return 1;
-	memcpy(tmp, user, sizeof(*tmp));
+	/* Group users by room (counting sort), so every room is a dense
+	 * range of the snapshot. Multicast members of the lobby are placed
+	 * last in the lobby range.
+	 */
+	memset(snap->room_off, 0, (ROOM_MAX + 1) * sizeof(snap->room_off[0]));
+	for (size_t n = 0; n < scratch_len; ++n) {
+		++snap->room_off[slab->room[scratch[n]] + 1];
+		if (slab->room[scratch[n]] == 0 && slab->mcast[scratch[n]])
+			++mcast_len;
+	}
+	for (size_t r = 0; r < ROOM_MAX; ++r) {
+		/* Forget names of empty rooms, the lobby always stays. */
+		if (r != 0 && snap->room_off[r + 1] == 0)
+			table->rooms[r].name[0] = '\0';
+		snap->room_off[r + 1] += snap->room_off[r];
+		pos[r] = snap->room_off[r];
+	}
+	snap->mcast_off = snap->room_off[1] - mcast_len;
+	mcast_pos = snap->mcast_off;
+	for (size_t n = 0; n < scratch_len; ++n) {
+		uint16_t room = slab->room[scratch[n]];
+		uint32_t at = room == 0 && slab->mcast[scratch[n]]
+		    ? mcast_pos++ : pos[room]++;
+		snap->slots[at] = scratch[n];
+	}
+	snap->len = scratch_len;
 
-	if (table->start == NULL) {
-		/* start and end are NULL. */
-		table->start = tmp;
-		table->end = tmp;
+	if (changed) {
+		__atomic_store_n(&table->snap, snap, __ATOMIC_SEQ_CST);
+		old->retire_epoch = table->epoch;
+		old->next = table->retired_snaps;
+		table->retired_snaps = old;
+		__atomic_add_fetch(&table->epoch, 1, __ATOMIC_SEQ_CST);
 	} else {
-		/* start and end are not NULL. */
-		table->end->next = tmp;
-		tmp->prev = table->end;
-		table->end = tmp;
+		snap->next = table->snap_pool;
+		table->snap_pool = snap;
+	}
+	user_table_reclaim(table);
+
+	return 0;
+}
+
+size_t user_table_len(const struct user_table *table)
+{
+	return __atomic_load_n(&table->snap, __ATOMIC_ACQUIRE)->len;
+}
+
+size_t user_table_room_len(const struct user_table *table, uint16_t room)
+{
+	const struct user_snap *snap = __atomic_load_n(&table->snap,
+	    __ATOMIC_ACQUIRE);
+
+	assert(room < ROOM_MAX);
+	return snap->room_off[room + 1] - snap->room_off[room];
+}
+
+int user_table_join(struct user_table *table, uint32_t slot,
+    const char *name, size_t name_len)
+{
+	int room = -1;
+
+	if (name_len == 0 || name_len >= ROOM_NAME_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&table->write_lock);
+	/* Find room, or the first free one. */
+	for (int r = 0; r < ROOM_MAX; ++r) {
+		if (strncmp(table->rooms[r].name, name, name_len) == 0
+		    && table->rooms[r].name[name_len] == '\0') {
+			room = r;
+			break;
+		} else if (room == -1 && table->rooms[r].name[0] == '\0') {
+			room = r;
+		}
+	}
+	if (room == -1) {
+		pthread_mutex_unlock(&table->write_lock);
+		errno = ENOSPC;
+		return -1;
+	}
+	if (table->rooms[room].name[0] == '\0') {
+		memcpy(table->rooms[room].name, name, name_len);
+		table->rooms[room].name[name_len] = '\0';
+	}
+	__atomic_store_n(&table->slab.room[slot], room, __ATOMIC_RELAXED);
+	__atomic_store_n(&table->dirty, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&table->write_lock);
+
+	return room;
+}
+
+void user_table_set_mcast(struct user_table *table, uint32_t slot, bool on)
+{
+	pthread_mutex_lock(&table->write_lock);
+	__atomic_store_n(&table->slab.mcast[slot], on, __ATOMIC_RELAXED);
+	__atomic_store_n(&table->dirty, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&table->write_lock);
+}
+
+uint32_t user_table_find_id(const struct user_table *table, uint32_t id)
+{
+	uint32_t slot = id & (uint32_t)((1ULL << table->id_bits) - 1);
+
+	/* Slot may be free or reused, check it still has the id. */
+	if (id == 0 || slot >= table->slab.cap
+	    || __atomic_load_n(&table->slab.id[slot], __ATOMIC_RELAXED) != id)
+		return USER_SLOT_NONE;
+
+	return slot;
+}
+
+int user_table_every_room(const struct user_table *table, uint16_t room,
+    bool skip_mcast, user_table_every_func_t every_func,
+    void *every_func_args)
+{
+	const struct user_snap *snap = __atomic_load_n(&table->snap,
+	    __ATOMIC_ACQUIRE);
+	uint32_t end = 0;
+	assert(every_func != NULL);
+	assert(room < ROOM_MAX);
+
+	/* Members of room are next to each other in the snapshot, lobby
+	 * multicast members are at the end.
+	 */
+	end = room == 0 && skip_mcast ? snap->mcast_off
+	    : snap->room_off[room + 1];
+	for (uint32_t n = snap->room_off[room]; n < end; ++n) {
+		every_func(table, snap->slots[n], every_func_args);
 	}
 
 	return 0;
@@ -100,69 +463,227 @@ int user_table_update(struct user_table *table, const struct user *user,
 int user_table_every(const struct user_table *table,
     user_table_every_func_t every_func, void *every_func_args)
 {
+	const struct user_snap *snap = __atomic_load_n(&table->snap,
+	    __ATOMIC_ACQUIRE);
 	assert(every_func != NULL);
 
-	/* Cycle throught every element and call func with args. */
-	for (struct user *p = table->start; p != NULL; p = p->next) {
-		every_func(p, every_func_args);
+	/* Cycle throught every slot and call func with args. */
+	for (size_t n = 0; n < snap->len; ++n) {
+		every_func(table, snap->slots[n], every_func_args);
 	}
 
 	return 0;
 }
 
-void user_table_free(struct user_table *table)
+void user_table_online(struct user_table *table, size_t reader)
 {
-	struct user *prev = table->start, *tmp = NULL;
+	user_table_quiescent(table, reader);
+}
 
-	while (prev->next != NULL) {
-		tmp = prev;
-		prev = prev->next;
+void user_table_quiescent(struct user_table *table, size_t reader)
+{
+	assert(reader < table->readers_len);
+	__atomic_store_n(&table->readers[reader].epoch,
+	    __atomic_load_n(&table->epoch, __ATOMIC_SEQ_CST),
+	    __ATOMIC_SEQ_CST);
+	/* Epoch must be visible before we read the snapshot again. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 
-		memset(tmp, 0, sizeof(*tmp));
-		free(tmp);
-	}
-	memset(prev, 0, sizeof(*prev));
-	free(prev);
+void user_table_offline(struct user_table *table, size_t reader)
+{
+	assert(reader < table->readers_len);
+	__atomic_store_n(&table->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
 
-	memset(table, 0, sizeof(*table));
+static uint32_t user_slab_pop(struct user_slab *slab)
+{
+	uint64_t head = __atomic_load_n(&slab->free_head, __ATOMIC_ACQUIRE);
+	uint64_t next = 0;
+	uint32_t slot = 0;
+
+	do {
+		slot = (uint32_t)head;
+		if (slot == USER_SLOT_NONE) return USER_SLOT_NONE;
+		/* Bump tag, so a pop and push in between fails the CAS. */
+		next = ((head >> 32) + 1) << 32;
+		next |= __atomic_load_n(&slab->cold[slot].next,
+		    __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&slab->free_head, &head, next,
+	    true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return slot;
 }
 
-uint16_t user_calculate_id(const struct user *user)
+static void user_slab_push(struct user_slab *slab, uint32_t slot)
 {
-	uint16_t id = 0;
+	uint64_t head = __atomic_load_n(&slab->free_head, __ATOMIC_RELAXED);
+	uint64_t next = 0;
 
-	if (user->addr_family == AF_INET) {
-		const struct sockaddr_in *sock4 = (void *)&user->addr;
-		/* 4 bytes */
-		uint8_t *ip_buffer = (void *)&sock4->sin_addr.s_addr;
+	do {
+		__atomic_store_n(&slab->cold[slot].next, (uint32_t)head,
+		    __ATOMIC_RELAXED);
+		next = (((head >> 32) + 1) << 32) | slot;
+	} while (!__atomic_compare_exchange_n(&slab->free_head, &head, next,
+	    true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-		/* 997 is prime, and very close to 999. */
-		id += ip_buffer[0];
-		id += ip_buffer[1];
-		id %= 997;
-		id += ip_buffer[2];
-		id += ip_buffer[3];
+static struct user_snap *user_snap_get(struct user_table *table)
+{
+	struct user_snap *snap = table->snap_pool;
+	size_t cap = table->slab.cap;
+
+	if (snap != NULL) {
+		table->snap_pool = snap->next;
+	} else {
+		/* index, slots and room_off follow the header in the same
+		 * block.
+		 */
+		snap = malloc(sizeof(*snap) + ((size_t)table->index_mask + 1)
+		    * sizeof(snap->index[0]) + cap * sizeof(snap->slots[0])
+		    + (ROOM_MAX + 1) * sizeof(snap->room_off[0]));
+		if (snap == NULL) return NULL;
+		snap->index = (uint32_t *)(snap + 1);
+		snap->slots = snap->index + table->index_mask + 1;
+		snap->room_off = snap->slots + cap;
+		/* Empty, in case it is published before it is built. */
+		memset(snap->index, 0xff, ((size_t)table->index_mask + 1)
+		    * sizeof(snap->index[0]));
+	}
+	snap->len = 0;
+	snap->mcast_off = 0;
+	memset(snap->room_off, 0, (ROOM_MAX + 1) * sizeof(snap->room_off[0]));
+	snap->next = NULL;
 
-		id %= 999;
-		if (id == 0) id = 999;
+	return snap;
+}
+
+static void user_table_reclaim(struct user_table *table)
+{
+	struct user_slab *slab = &table->slab;
+	uint64_t min = UINT64_MAX;
+	struct user_snap **sp = &table->retired_snaps;
+	uint32_t *up = &table->retired_slots;
 
-		return id;
-	} else if (user->addr_family == AF_INET6) {
-		const struct sockaddr_in6 *sock6 = (void *)&user->addr;
-		/* 16 bytes */
-		uint8_t *ip_buffer = (void *)sock6->sin6_addr.s6_addr;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (size_t n = 0; n < table->readers_len; ++n) {
+		uint64_t epoch = __atomic_load_n(&table->readers[n].epoch,
+		    __ATOMIC_SEQ_CST);
+		if (epoch != 0 && epoch < min)
+			min = epoch;
+	}
 
-		for (size_t n = 0; n < 16; ++n) {
-			id += ip_buffer[n];
-			if (n % 2 == 1)
-				id %= 997;
+	/* Everything retired before min can't be referenced anymore. */
+	while (*sp != NULL) {
+		struct user_snap *tmp = *sp;
+		if (tmp->retire_epoch < min) {
+			*sp = tmp->next;
+			tmp->next = table->snap_pool;
+			table->snap_pool = tmp;
+		} else {
+			sp = &tmp->next;
+		}
+	}
+	while (*up != USER_SLOT_NONE) {
+		uint32_t slot = *up;
+		if (slab->cold[slot].retire_epoch < min) {
+			*up = slab->cold[slot].next;
+			user_slab_push(slab, slot);
+		} else {
+			up = &slab->cold[slot].next;
 		}
+	}
+}
 
-		id %= 999;
-		if (id == 0) id = 999;
+void user_table_free(struct user_table *table)
+{
+	struct user_slab *slab = &table->slab;
+	struct user_snap *snap = NULL;
 
-		return id;
-	} else {
-		return 0;
+	free(table->snap);
+	while (table->retired_snaps != NULL) {
+		snap = table->retired_snaps;
+		table->retired_snaps = snap->next;
+		free(snap);
+	}
+	while (table->snap_pool != NULL) {
+		snap = table->snap_pool;
+		table->snap_pool = snap->next;
+		free(snap);
 	}
+	free(slab->key);
+	free(slab->id);
+	free(slab->sock);
+	free(slab->last_msg);
+	free(slab->tat);
+	free(slab->cold);
+	free(slab->room);
+	free(slab->mcast);
+	free(table->rooms);
+	free(table->scratch);
+	free(table->readers);
+	pthread_mutex_destroy(&table->write_lock);
+
+	memset(table, 0, sizeof(*table));
+}
+
+static void user_snap_insert(const struct user_table *table,
+    struct user_snap *snap, uint32_t slot)
+{
+	uint32_t i = (uint32_t)table->slab.key[slot] & table->index_mask;
+
+	while (snap->index[i] != USER_SLOT_NONE)
+		i = (i + 1) & table->index_mask;
+	snap->index[i] = slot;
+}
+
+static uint32_t user_snap_find(const struct user_table *table,
+    const struct user_snap *snap, uint64_t key, const struct addr_key *akey,
+    const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+	const struct user_slab *slab = &table->slab;
+	uint32_t i = (uint32_t)key & table->index_mask, slot = 0;
+
+	/* The index is never full, so every probe ends at an empty entry. */
+	while ((slot = snap->index[i]) != USER_SLOT_NONE) {
+		if (slab->key[slot] == key && user_cold_eq(&slab->cold[slot],
+		    akey, addr, addr_len))
+			return slot;
+		i = (i + 1) & table->index_mask;
+	}
+
+	return USER_SLOT_NONE;
+}
+
+static bool user_cold_eq(const struct user_cold *cold,
+    const struct addr_key *key, const struct sockaddr_storage *addr,
+    socklen_t addr_len)
+{
+	if (!addr_key_eq(&cold->key, key)) return false;
+	if (key->family != AF_UNIX && key->family != USER_KEY_SHM)
+		return true;
+
+	return cold->addr_len == addr_len
+	    && memcmp(&cold->addr, addr, addr_len) == 0;
+}
+
+static uint32_t user_table_id(const struct user_table *table, uint64_t key,
+    uint32_t slot)
+{
+	/* splitmix64 finalizer, spreads the secret over every bit. */
+	uint64_t hash = key ^ table->id_secret;
+	uint32_t id = 0;
+
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	/* Slot makes ids of active users unique, the hash makes them hard to
+	 * guess and different when a slot is reused.
+	 */
+	id = table->id_bits < 32 ? (uint32_t)(hash << table->id_bits) : 0;
+	id |= slot;
+	/* 0 is the server. */
+	if (id == 0) id = 1U << table->id_bits;
+
+	return id;
 }
@@ -3,47 +3,208 @@
 
 #include <stddef.h>
 #include <stdint.h>
-#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "config.h"
+#include "common/net.h"
+
+/* A user as received from the network, used to update the table. */
 struct user {
 	/* Address of client. */
 	struct sockaddr_storage addr; /* Client address. */
 	socklen_t addr_len; /* Client address lenhgt.*/
 	int addr_family; /* Client address family. */
-	int recv_fd; /* Receive file descriptor. */
-	uint16_t id; /* 16 bit id. */
+	uint16_t sock; /* Index of bound address, every shard has a socket. */
 
 	/* Throatteling infomation. */
-	time_t last_msg; /* used for timeout. */
-	time_t last_msg_xs; /* used for anti spam */
+	uint64_t last_msg; /* used for timeout (ms, see util/clock.h). */
+};
+
+/* Cold part of a user slot, only used when sending and when the address
+ * key matched.
+ */
+struct user_cold {
+	struct addr_key key; /* Compared when the hashed key matched. */
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int addr_family;
+	/* Free, pending and retire list infomation. */
+	uint32_t next;
+	uint64_t retire_epoch;
+};
+
+/* Users live in slots of a fixed size slab. Hot fields are stored as
+ * separate arrays (structure-of-arrays) indexed by slot, so scans only touch
+ * the memory they need.
+ */
+struct user_slab {
+	size_t cap;
+	/* Hot. */
+	uint64_t *key; /* addr_key_hash of cold.key. */
+	uint32_t *id; /* See user_table_find_id, 0 when not in use. */
+	uint16_t *sock;
+	uint16_t *room;
+	bool *mcast; /* Receives lobby messages from the multicast group. */
+	uint64_t *last_msg;
+	uint64_t *tat; /* Message token bucket, see util/ratelimit.h. */
+	/* Cold. */
+	struct user_cold *cold;
+	/* Lock-free free stack, upper 32 bits are an ABA tag. */
+	uint64_t free_head;
+};
+
+/* Immutable list of active slots. A new snapshot is published every time
+ * the writer adds or removes users, readers never see a half done update.
+ * index is an open addressing hash table of the same slots by key (linear
+ * probing, USER_SLOT_NONE when empty), so lookups don't scan. Slots are
+ * grouped by room, members of room r are slots[room_off[r]] to
+ * slots[room_off[r + 1] - 1]. Lobby members in the multicast group are
+ * last in the lobby, from slots[mcast_off].
+ */
+struct user_snap {
+	size_t len;
+	struct user_snap *next; /* Retire list and pool. */
+	uint64_t retire_epoch;
+	uint32_t *index; /* index_mask + 1 entries, at most half are used. */
+	uint32_t *slots;
+	uint32_t *room_off; /* ROOM_MAX + 1 offsets. */
+	uint32_t mcast_off;
+};
+
+/* Room 0 is the lobby, other rooms are free when name is empty. */
+struct user_room {
+	char name[ROOM_NAME_LEN];
+};
 
-	/* Linked list infomation. */
-	struct user *next;
-	struct user *prev;
+/* Per reader epoch, padded so readers don't share cache lines. */
+struct user_reader {
+	uint64_t epoch; /* 0 when offline. */
+	char pad[64 - sizeof(uint64_t)];
 };
 
+/* The user table is shared between all receive shards. Readers (lookup and
+ * every) don't take any locks, they only have to report quiescent states
+ * with user_table_quiescent. Writers queue new users on a lock-free pending
+ * stack, and the thread that wins the write lock publishes them in a single
+ * batch. Expiries are batched the same way on the housekeeping tick. Old
+ * snapshots and removed users are recycled when every reader has passed a
+ * quiescent state (QSBR).
+ */
 struct user_table {
-	struct user *start, *end;
-	time_t timeout;
+	struct user_slab slab;
+	struct user_snap *snap; /* Current snapshot. */
+	uint32_t pending; /* Lock-free stack of new slots. */
+	uint64_t timeout; /* ms */
+	uint32_t index_mask; /* See user_snap.index. */
+	/* Per user token bucket, set to MSG_RATE_* by init (us, tokens). */
+	uint64_t rate_interval, rate_burst;
+
+	pthread_mutex_t write_lock;
+	uint64_t epoch; /* Global epoch, starts at 1. */
+	struct user_reader *readers;
+	size_t readers_len;
+	/* Ids are a keyed hash of the address with the slot in the low
+	 * id_bits bits, so no two users share an id and the slot is found
+	 * without a lookup.
+	 */
+	uint64_t id_secret;
+	unsigned id_bits;
+	/* Only touched while holding write_lock. */
+	struct user_room *rooms;
+	bool dirty; /* A user changed room, read without the lock. */
+	uint32_t *scratch; /* cap slots, used to build snapshots. */
+	struct user_snap *retired_snaps;
+	uint32_t retired_slots;
+	struct user_snap *snap_pool; /* Reclaimed snapshots. */
 };
 
-typedef void (*user_table_every_func_t)(const struct user *, void *);
-typedef void (*user_table_timeout_func_t)(const struct user *, void *);
+/* No slot, ends the free, pending and retire lists. */
+#define USER_SLOT_NONE (UINT32_MAX)
+/* user.sock of shared memory clients (see shm.h), they have no socket. */
+#define USER_SOCK_SHM (UINT16_MAX)
+/* addr_key family of shared memory clients. Their abstract names are never
+ * bound, this keeps a datagram sent from the same name from matching them.
+ */
+#define USER_KEY_SHM (AF_MAX)
+
+typedef void (*user_table_every_func_t)(const struct user_table *, uint32_t,
+    void *);
+typedef void (*user_table_timeout_func_t)(const struct user_table *, uint32_t,
+    void *);
 
-int user_table_init(struct user_table *_table, time_t _timeout);
-/* Used to keep user in table, will also kick timeed out users.
- * Return 1 when spam is detected.
+/* Create table with room for cap users and readers_len readers, reader ids
+ * are 0 to readers_len-1. All memory is allocated here, users joining and
+ * leaving don't allocate.
+ * Returns 0 on success, 1 on error (errno is set).
+ */
+int user_table_init(struct user_table *_table, uint64_t _timeout, size_t _cap,
+    size_t _readers_len);
+/* Used to keep user in table, user->addr must be AF_INET or AF_INET6.
+ * Known users are found through the snapshot index and updated in place,
+ * new users are queued and become visible on the next user_table_publish.
+ * The user's token bucket is checked before anything is changed.
+ * Return 0 for known users, 3 for new users, 1 when spam is detected and 2
+ * when the table is full.
  */
 int user_table_update(struct user_table *_table, const struct user *_user,
+    uint32_t *_slot);
+/* Publish queued users and kick timeed out users, expiry scans every user
+ * so this belongs on the housekeeping tick. Only one thread flushes at a
+ * time, if another thread is flushing this returns without doing anything.
+ * Time is read from cclock_ms, so the caller must have ticked the clock.
+ * Return 0 on success, 1 on error.
+ */
+int user_table_flush(struct user_table *_table,
     user_table_timeout_func_t _timeout_func, void *_timeout_func_args);
+/* Publish queued users and room changes without kicking anybody, returns
+ * right away when nothing is queued. Otherwise blocks on the write lock, so
+ * the users this thread queued are in the snapshot when it returns.
+ * Return 0 on success, 1 on error.
+ */
+int user_table_publish(struct user_table *_table);
+/* Count of users in the current snapshot. */
+size_t user_table_len(const struct user_table *_table);
+/* Count of users in room in the current snapshot. */
+size_t user_table_room_len(const struct user_table *_table, uint16_t _room);
+/* Move slot to room name (created if missing), visible after the next
+ * user_table_publish. Blocks on the write lock.
+ * Returns room, or -1 on error (errno is set).
+ *
+ * Possible errors:
+ * EINVAL - Name is empty or too long.
+ * ENOSPC - All rooms are used.
+ */
+int user_table_join(struct user_table *_table, uint32_t _slot,
+    const char *_name, size_t _name_len);
+/* Mark slot as member of the multicast group, visible after the next
+ * user_table_publish. Blocks on the write lock.
+ */
+void user_table_set_mcast(struct user_table *_table, uint32_t _slot,
+    bool _on);
+/* Find active user with id, returns USER_SLOT_NONE if not found. */
+uint32_t user_table_find_id(const struct user_table *_table, uint32_t _id);
+/* Call every_func with every member of room in the current snapshot. With
+ * skip_mcast lobby members in the multicast group are skipped.
+ */
+int user_table_every_room(const struct user_table *_table, uint16_t _room,
+    bool _skip_mcast, user_table_every_func_t _every_func,
+    void *_every_func_args);
+/* Call every_func with every slot in the current snapshot. */
 int user_table_every(const struct user_table *_table,
     user_table_every_func_t _every_func, void *_every_func_args);
+/* Reader state changes. A reader must be online while calling update and
+ * every, and has to report quiescent states regularly (once per loop).
+ * Go offline before blocking for a long time, so writers don't wait for you.
+ */
+void user_table_online(struct user_table *_table, size_t _reader);
+void user_table_quiescent(struct user_table *_table, size_t _reader);
+void user_table_offline(struct user_table *_table, size_t _reader);
+/* Free table, must only be called when no readers are left. */
 void user_table_free(struct user_table *_table);
 
-/* Uses addr_family and addr. */
-uint16_t user_calculate_id(const struct user *_user);
 
 #endif
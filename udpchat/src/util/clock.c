@@ -0,0 +1,33 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <time.h>
+
+#include "clock.h"
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define _CCLOCK_ID CLOCK_MONOTONIC_COARSE
+#else
+#define _CCLOCK_ID CLOCK_MONOTONIC
+#endif
+
+__thread uint64_t _cclock_now = 0;
+
+uint64_t cclock_tick(void)
+{
+	struct timespec ts = {0};
+
+	/* Can only fail with invalid arguments. */
+	clock_gettime(_CCLOCK_ID, &ts);
+	_cclock_now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	return _cclock_now;
+}
+
+uint64_t cclock_real_ns(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
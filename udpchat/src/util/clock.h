@@ -0,0 +1,27 @@
+#ifndef UTIL_CLOCK_H
+#define UTIL_CLOCK_H
+#include <stdint.h>
+
+/* Cached monotonic clock in milliseconds. Every thread has its own copy,
+ * which is only refreshed by cclock_tick. Call cclock_tick once per loop
+ * iteration, and use cclock_ms everywhere else, so the hot paths never read
+ * the real clock.
+ */
+extern __thread uint64_t _cclock_now;
+
+/* Refresh the cached time of this thread and return it. Uses
+ * CLOCK_MONOTONIC_COARSE when available, it's only a few ms behind and
+ * doesn't leave the vDSO.
+ */
+uint64_t cclock_tick(void);
+/* Real time in ns, read on every call. Kernel receive timestamps
+ * (SO_TIMESTAMPNS) use this clock.
+ */
+uint64_t cclock_real_ns(void);
+/* Cached time of this thread, as of the last cclock_tick. */
+static inline uint64_t cclock_ms(void)
+{
+	return _cclock_now;
+}
+
+#endif /* UTIL_CLOCK_H */
@@ -0,0 +1,31 @@
+#ifndef UTIL_RATELIMIT_H
+#define UTIL_RATELIMIT_H
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Token bucket stored as a single "theoretical arrival time" (GCRA), so it
+ * fits inline in other structures and can be updated with one CAS.
+ *
+ * interval - time per token (us).
+ * burst    - bucket size (tokens).
+ * cost     - tokens to take.
+ * now      - current time (us).
+ *
+ * Returns true if the tokens were taken, false if the bucket is empty, in
+ * which case the bucket is not changed.
+ */
+static inline bool tbucket_take(uint64_t *tat, uint64_t now, uint64_t interval,
+    uint64_t burst, uint64_t cost)
+{
+	uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED), new = 0;
+
+	do {
+		new = (old > now ? old : now) + cost * interval;
+		if (new - now > burst * interval) return false;
+	} while (!__atomic_compare_exchange_n(tat, &old, new, true,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return true;
+}
+
+#endif /* UTIL_RATELIMIT_H */
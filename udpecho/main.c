@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* recvmmsg, SO_REUSEPORT, pthread_setaffinity_np */
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -6,6 +7,7 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -13,29 +15,35 @@
 #include <signal.h>
 #include <time.h>
 #include <stdatomic.h>
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
-#ifdef __STDC_NO_THREADS__
-#define thread_local __thread
-#else
-#include <threads.h>
-#endif
-
-/* Helper macros. */
-#define MAX(_a, _b) ((_a > _b) ? _a : _b)
-#define MIN(_a, _b) ((_a < _b) ? _a : _b)
-
-/* Max amount of addresses to try binding to. This is used when traversing
- * the addrinfo struct.
+/* Sockets, histograms, drop counting, the capture log and their compile
+ * time options are shared with udpchat (common/).
  */
-#define MAX_BIND_COUNT (10)
-/* Setup read timeout to 5 seconds. */
+#include "common/config.h"
+#include "common/net.h"
+#include "common/hist.h"
+#include "common/rxdrop.h"
+#include "common/capture.h"
+
+/* Max epoll events handled per wakeup. */
+#define MAX_EVENTS (64)
+/* How often the worker checks if it should stop (seconds). */
 #define MAX_RECV_TIMEOUT (5)
 /* The max size of datagram. */
 #define MAX_DATAGRAM_SIZE (2048)
+/* Datagrams read with one recvmmsg and echoed with one sendmmsg. */
+#define ECHO_BATCH (32)
+/* Sockets that drop datagrams get their SO_RCVBUF doubled every
+ * RXDROP_INTERVAL ms, see rxdrop.h.
+ */
+#define RXDROP_INTERVAL (1000)
 
 /* Mutex that is locked and unlocked when using logging functions. */
 static pthread_mutex_t log_mutex = {0};
@@ -45,46 +53,101 @@ static char *progname = "";
 
 /* Various logging functions. */
 bool pdebug_enabled = true;
+bool pinfo_enabled = true;
 bool pwarn_enabled = true;
 bool perr_enabled = true;
 
-static inline void pdebug(const char *format, ...);
+static inline void pdebug_(const char *format, ...);
+/* Arguments (like addr2str) are only evaluated when debug is enabled. */
+#define pdebug(...) do { if (pdebug_enabled) pdebug_(__VA_ARGS__); } while (0)
+static inline void pinfo(const char *format, ...);
 static inline void pwarn(const char *format, ...);
 static inline void perr(const char *format, ...);
 
-/* Create addrinfo from supplied info. If bind_ips is NULL, the OS chooses
- * an address to bind to.
- */
-static int create_addrinfo(const char *port,
-    const char *bind_ips[MAX_BIND_COUNT], size_t bind_ips_len,
-    struct addrinfo **addr);
-/* Convert addrinfo struct to ip, supports both ipv4 and ipv6.
- * The returned string is allocated in static memory.
+static void hist_print(const char *name, const struct hist *h);
+/* Real time in ns, the clock of SO_TIMESTAMPNS. */
+static uint64_t real_ns(void);
+/* Monotonic time in ms and ns. */
+static uint64_t mono_ms(void);
+static uint64_t mono_ns(void);
+
+/* Raise the open file limit to the hard limit, so many addresses can be
+ * bound.
  */
-static const char *addr2str(const struct addrinfo *addr);
-static thread_local char _ip_buffer[MAX(INET6_ADDRSTRLEN, INET_ADDRSTRLEN)] = {0};
+static void raise_nofile(size_t need);
 
-/* The main read and write loop, used in new threads. */
+/* The main read and write loop, used in new threads. Every worker has one
+ * epoll loop serving all its sockets.
+ */
 static void *rw_loop_func(void *args);
+struct rw_loop_args;
+/* Print drops of every socket that dropped. */
+static void rxdrop_print(const struct rw_loop_args *args);
 struct rw_loop_args {
-	int sfd;
+	int *sfd_arr;
+	size_t sfd_arr_len;
 	atomic_bool run;
+	struct rxdrop *rxdrops; /* One per socket. */
+	bool rx_timestamps; /* Sockets have SOCK_OPT_TIMESTAMP. */
+	/* The worker's ring of the capture log, NULL unless capturing (-w).
+	 * Records that didn't fit are counted in capture_dropped.
+	 */
+	struct capture_ring *capture;
+	uint64_t capture_dropped;
+	/* Time from the kernel timestamp until the datagram was read, and
+	 * until the echo was sent.
+	 */
+	struct hist rx_queue;
+	struct hist rx_send;
+	/* Low latency mode (-l), spin for spin_us after the last datagram
+	 * before blocking in epoll again. Spins that received something are
+	 * hits, spins that found every socket empty are idle, and sleeps
+	 * count the times the budget ran out.
+	 */
+	unsigned spin_us;
+	uint64_t spin_hits, spin_idle, spin_sleeps;
 };
+/* Receive buffers of a worker, reused for sending the echo. */
+struct echo_bufs {
+	struct mmsghdr msgs[ECHO_BATCH];
+	struct iovec iovs[ECHO_BATCH];
+	struct sockaddr_storage addrs[ECHO_BATCH];
+	char control[ECHO_BATCH][RX_CMSG_LEN];
+	char buffers[ECHO_BATCH][MAX_DATAGRAM_SIZE];
+};
+/* Receive up to ECHO_BATCH datagrams from socket idx without blocking and
+ * echo them. Returns count of datagrams, or -1 on error.
+ */
+static int echo_batch(struct rw_loop_args *args, struct echo_bufs *bufs,
+    size_t idx);
+/* Poll every socket until no datagram arrived for spin_us.
+ * Returns 0 on success, -1 on error.
+ */
+static int echo_spin(struct rw_loop_args *args, struct echo_bufs *bufs);
+/* Print spin efficiency of low latency mode. */
+static void spin_print(const struct rw_loop_args *args);
 
 int main(int argc, char *argv[])
 {
 	struct addrinfo *addr = NULL;
+	struct sock_opts sock_opts = {0};
 	char *port = "";
-	char *bind_ips[MAX_BIND_COUNT] = {0};
+	char **bind_ips = NULL;
 	size_t bind_ips_len = 0;
 	int status = EXIT_FAILURE, ret = 0;
-	int sfd_arr[MAX_BIND_COUNT] = {0};
-	size_t sfd_arr_len = 0;
-	pthread_t children[MAX_BIND_COUNT] = {0};
-	size_t children_len = 0;
-	struct rw_loop_args children_args[MAX_BIND_COUNT] = {0};
-	size_t children_args_len = 0;
+	int *sfd_arr = NULL;
+	size_t sfd_arr_len = 0, addr_len = 0;
+	pthread_t child = 0;
+	pthread_attr_t child_attr;
+	cpu_set_t cpus;
+	long cpu = -1, busy_poll = SOCK_BUSY_POLL, value = 0;
+	char *end = NULL;
+	bool child_started = false;
+	static struct rw_loop_args child_args = {0};
+	static struct capture capture = {.fd = -1};
+	char *capture_path = NULL;
 	sigset_t sigset = {0};
+	int sig = 0, opt = 0;
 
 	/* Setup pthread mutex. */
 	ret = pthread_mutex_init(&log_mutex, NULL);
@@ -99,7 +162,9 @@ int main(int argc, char *argv[])
 		goto sigset_err;
 	}
 	ret = sigaddset(&sigset, SIGTERM);
-	ret = sigaddset(&sigset, SIGINT);
+	ret += sigaddset(&sigset, SIGINT);
+	/* SIGUSR1 prints latency histograms. */
+	ret += sigaddset(&sigset, SIGUSR1);
 	if (ret != 0) {
 		perr("Failed to add last signal to sigset: %s", strerror(errno));
 		goto sigset_err;
@@ -112,22 +177,49 @@ int main(int argc, char *argv[])
 
 	/* Set program name. */
 	progname = argv[0];
+	/* Parse options:
+	 * -t: record kernel receive timestamps.
+	 * -l us: low latency mode, spin for us before blocking. Turns off
+	 *        debug output, a log line per datagram costs more than the
+	 *        echo.
+	 * -p us: SO_BUSY_POLL, the kernel polls the device queue for us.
+	 * -c cpu: pin the worker (and hint SO_INCOMING_CPU).
+	 * -w file: capture received datagrams to file.
+	 */
+	while ((opt = getopt(argc, argv, "tl:p:c:w:")) != -1) {
+		if (opt == 't') {
+			child_args.rx_timestamps = true;
+			continue;
+		} else if (opt == 'w') {
+			capture_path = optarg;
+			continue;
+		} else if (opt == '?') {
+			goto usage_err;
+		}
+		value = strtol(optarg, &end, 10);
+		if (end == optarg || *end != '\0' || value < 0
+		    || value > INT32_MAX)
+			goto usage_err;
+		if (opt == 'l') {
+			child_args.spin_us = value;
+			pdebug_enabled = value == 0;
+		}
+		else if (opt == 'p')
+			busy_poll = value;
+		else
+			cpu = value;
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 	/* Parse args. argc variables:
 	 * 0: progname
 	 * 1: port
 	 * 2+: addresses to bind to
 	 */
-	if (argc == 2) {
-		port = argv[1];
-	} else if (argc > 2) {
+	if (argc >= 2) {
 		port = argv[1];
-		for (int n = 2; n < argc; ++n) {
-			if (bind_ips_len >= MAX_BIND_COUNT - 1) {
-				perr("Too many interfaces provided");
-				goto args_err;
-			}
-			bind_ips[bind_ips_len++] = argv[n];
-		}
+		bind_ips = &argv[2];
+		bind_ips_len = argc - 2;
 	} else {
 		perr("Not enough arguments");
 		goto args_err;
@@ -137,54 +229,71 @@ int main(int argc, char *argv[])
 	ret = create_addrinfo(port, (const char **)bind_ips, bind_ips_len,
 	    &addr);
 	if (ret != 0) {
-		perr("Failed to create addrinfo: Please check port and ip");
+		perr("Failed to create addrinfo: %s", gai_strerror(ret));
 		goto addrinfo_err;
 	}
 
-	/* Fill fd arr with -1. */
-	for (size_t n = 0; n < MAX_BIND_COUNT; ++n) {
-		sfd_arr[n] = -1;
+	/* One socket per node at most. */
+	for (struct addrinfo *ca = addr; ca != NULL; ca = ca->ai_next) {
+		++addr_len;
+	}
+	sfd_arr = calloc(addr_len, sizeof(*sfd_arr));
+	child_args.rxdrops = calloc(addr_len, sizeof(*child_args.rxdrops));
+	if (sfd_arr == NULL || child_args.rxdrops == NULL) {
+		perr("Failed to allocate sockets: %s", strerror(errno));
+		goto socket_err;
+	}
+	raise_nofile(addr_len);
+	/* Tuning is best effort. */
+	sock_opts.want = SOCK_OPT_CLOEXEC | SOCK_OPT_NONBLOCK;
+	if (SOCK_RCVBUF > 0) {
+		sock_opts.want |= SOCK_OPT_RCVBUF;
+		sock_opts.rcvbuf = SOCK_RCVBUF;
+	}
+	if (SOCK_SNDBUF > 0) {
+		sock_opts.want |= SOCK_OPT_SNDBUF;
+		sock_opts.sndbuf = SOCK_SNDBUF;
 	}
+	if (SOCK_BUFFORCE)
+		sock_opts.want |= SOCK_OPT_BUFFORCE;
+	if (busy_poll > 0) {
+		sock_opts.want |= SOCK_OPT_BUSY_POLL;
+		sock_opts.busy_poll = busy_poll;
+	}
+	/* Let the kernel steer to sockets of the pinned cpu (REUSEPORT
+	 * groups only).
+	 */
+	if (cpu >= 0) {
+		sock_opts.want |= SOCK_OPT_INCOMING_CPU;
+		sock_opts.incoming_cpu = cpu;
+	}
+	if (child_args.rx_timestamps)
+		sock_opts.want |= SOCK_OPT_TIMESTAMP;
+	sock_opts.want |= SOCK_OPT_RXQ_OVFL;
 	/* Create sockets and then bind them. */
 	for (struct addrinfo *ca = addr; ca != NULL; ca = ca->ai_next) {
-		/* Create socket. */
-		int sfd = socket(ca->ai_family, ca->ai_socktype,
-		    ca->ai_protocol);
+		unsigned int applied = 0;
+		char applied_str[128] = "";
+		int sfd = create_socket(ca, &sock_opts, &applied);
 		if (sfd == -1) {
-			pwarn("Failed to create socket (%s): %s",
-			    addr2str(ca),
+			pwarn("Failed to bind '%s': %s",
+			    addr2str(ca->ai_family, ca->ai_addr),
 			    strerror(errno));
 			continue;
 		}
-		pdebug("Created socket %i", sfd, addr2str(ca));
-
-		/* Bind socket. */
-		ret = bind(sfd, ca->ai_addr, ca->ai_addrlen);
-		if (ret != 0) {
-			pwarn("Failed to bind '%s' to %i: %s", addr2str(ca),
-			    sfd, strerror(errno));
-			close(sfd);
-			continue;
-		}
-		pdebug("Bound '%s' to %i", addr2str(ca), sfd);
-
-		/* Setup timeout on socket. */
-		struct timeval tv = {0};
-		tv.tv_sec = MAX_RECV_TIMEOUT;
-		ret = setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-		if (ret != 0) {
-			pwarn("Failed to set socket timeout: %s",
-			    strerror(errno));
-			close(sfd);
-			continue;
+		pdebug("Bound '%s' to %i (%s)",
+		    addr2str(ca->ai_family, ca->ai_addr), sfd,
+		    sock_opts_str(applied, applied_str, sizeof(applied_str)));
+		if (ca->ai_family == AF_UNIX) applied |= UNIX_SKIP;
+		if (sock_opts.want & ~applied & ~SOCK_OPT_BUFFORCE) {
+			pwarn("Options not applied on '%s': %s",
+			    addr2str(ca->ai_family, ca->ai_addr),
+			    sock_opts_str(sock_opts.want & ~applied,
+			    applied_str, sizeof(applied_str)));
 		}
 
 		/* Add to array of sockets. */
-		if (sfd_arr_len >= MAX_BIND_COUNT) {
-			pwarn("Reached socket limit (%zu)", sfd_arr_len);
-			close(sfd);
-			break;
-		}
+		rxdrop_init(&child_args.rxdrops[sfd_arr_len], sfd, mono_ms());
 		sfd_arr[sfd_arr_len++] = sfd;
 	}
 	if (sfd_arr_len == 0) {
@@ -192,56 +301,86 @@ int main(int argc, char *argv[])
 		goto socket_err;
 	}
 
-	/* Create one thread per fd. */
-	for (size_t n = 0; n < sfd_arr_len; ++n) {
-		pthread_t thread = 0;
-
-		children_args[n].sfd = sfd_arr[n];
-		children_args[n].run = true;
-		ret = pthread_create(&thread, NULL, rw_loop_func,
-		    &children_args[n]);
-		if (ret != 0) {
-			perr("Failed to create thread for %i: %s", sfd_arr[n],
+	if (capture_path != NULL) {
+		/* One ring, the worker is the only writer. */
+		if (capture_open(&capture, capture_path, 1, CAPTURE_RING_SIZE)
+		    != 0) {
+			perr("Failed to open capture '%s': %s", capture_path,
 			    strerror(errno));
 			goto thread_err;
 		}
+		child_args.capture = &capture.rings[0];
+		pinfo("Capturing received datagrams to %s", capture_path);
+	}
 
-		if (children_len >= MAX_BIND_COUNT) {
-			pwarn("Thread limit reached (%zu)", children_len);
-			break;
+	/* Create worker, it serves every socket. */
+	child_args.sfd_arr = sfd_arr;
+	child_args.sfd_arr_len = sfd_arr_len;
+	child_args.run = true;
+	pthread_attr_init(&child_attr);
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		ret = pthread_attr_setaffinity_np(&child_attr, sizeof(cpus),
+		    &cpus);
+		if (ret != 0) {
+			perr("Failed to pin worker to cpu %ld: %s", cpu,
+			    strerror(ret));
+			pthread_attr_destroy(&child_attr);
+			goto thread_err;
 		}
-		children[children_len++] = thread;
 	}
+	ret = pthread_create(&child, &child_attr, rw_loop_func, &child_args);
+	pthread_attr_destroy(&child_attr);
+	if (ret != 0) {
+		perr("Failed to create worker thread: %s", strerror(ret));
+		goto thread_err;
+	}
+	child_started = true;
+	if (child_args.spin_us > 0)
+		pinfo("Low latency mode, spin %u us", child_args.spin_us);
 
 	/* This "hack" forces the main thread to sleep until it unlocks.*/
-	ret = sigwait(&sigset, &ret);
+	while ((ret = sigwait(&sigset, &sig)) == 0 && sig == SIGUSR1) {
+		hist_print("rx-queue", &child_args.rx_queue);
+		hist_print("rx-send", &child_args.rx_send);
+		rxdrop_print(&child_args);
+		spin_print(&child_args);
+	}
 	if (ret != 0) {
-		pwarn("sigwait failed: %s", strerror(errno));
+		pwarn("sigwait failed: %s", strerror(ret));
 	} else {
 		pdebug("sigwait: closing program nicely");
 	}
+	hist_print("rx-queue", &child_args.rx_queue);
+	hist_print("rx-send", &child_args.rx_send);
+	rxdrop_print(&child_args);
+	spin_print(&child_args);
 	status = 0;
 
 thread_err:
-	/* Tell all thread to stop. */
-	for (size_t n = 0; n < children_len; ++n) {
-		atomic_store(&children_args[n].run, false);
-	}
-	/* Join all threads, and wait for them to stop. */
-	for (size_t n = 0; n < children_len; ++n) {
-		ret = pthread_join(children[n], NULL);
+	/* Tell worker to stop, and wait for it. */
+	atomic_store(&child_args.run, false);
+	if (child_started) {
+		ret = pthread_join(child, NULL);
 		if (ret != 0) {
-			perr("Error from pthread_join: %s", strerror(errno));
+			perr("Error from pthread_join: %s", strerror(ret));
 		}
 	}
+	if (capture.fd != -1) {
+		capture_close(&capture);
+		pinfo("Captured %" PRIu64 " bytes to %s, %" PRIu64 " dropped",
+		    capture.written, capture_path,
+		    child_args.capture_dropped);
+	}
 	/* Close all open sockets/fds. */
 	for (size_t n = 0; n < sfd_arr_len; ++n) {
-		/* Socket 0,1,2 are used by stdin, stdout and stderr. */
-		if (sfd_arr[n] != -1) {
-			close(sfd_arr[n]);
-		}
+		sock_unlink(sfd_arr[n]);
+		close(sfd_arr[n]);
 	}
 socket_err:
+	free(sfd_arr);
+	free(child_args.rxdrops);
 	freeaddrinfo(addr);
 addrinfo_err:
 sigset_err:
@@ -249,147 +388,342 @@ sigset_err:
 mutex_err:
 args_err:
 	return status;
+usage_err:
+	perr("Usage: %s [-t] [-l spin_us] [-p busy_poll_us] [-c cpu] "
+	    "[-w capture] port [addresses...]", progname);
+	goto args_err;
 }
 
 static void *rw_loop_func(void *args0)
 {
 	struct rw_loop_args *args = args0;
-	char buffer[MAX_DATAGRAM_SIZE] = {0};
-	struct sockaddr_storage sockaddr = {0};
-	struct addrinfo addr = {0};
-	ssize_t ret = 0, bytes = 0;
+	struct echo_bufs *bufs = NULL;
+	uint64_t now_ms = 0, next_tick = 0;
+	struct epoll_event events[MAX_EVENTS] = {{0}};
+	struct epoll_event event = {0};
+	int epfd = -1, nfds = 0, ret = 0;
+	void *status = NULL;
+
+	bufs = calloc(1, sizeof(*bufs));
+	if (bufs == NULL) {
+		perr("Failed to allocate buffers: %s", strerror(errno));
+		return NULL+1;
+	}
+	for (size_t n = 0; n < ECHO_BATCH; ++n) {
+		bufs->msgs[n].msg_hdr.msg_name = &bufs->addrs[n];
+		bufs->msgs[n].msg_hdr.msg_iov = &bufs->iovs[n];
+		bufs->msgs[n].msg_hdr.msg_iovlen = 1;
+		bufs->iovs[n].iov_base = bufs->buffers[n];
+	}
 
-	addr.ai_addr = (struct sockaddr*)&sockaddr;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perr("Failed to create epoll: %s", strerror(errno));
+		free(bufs);
+		return NULL+1;
+	}
+	for (size_t n = 0; n < args->sfd_arr_len; ++n) {
+		event.events = EPOLLIN;
+		event.data.u32 = n;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, args->sfd_arr[n], &event)
+		    != 0) {
+			perr("s%i: Failed to add to epoll: %s",
+			    args->sfd_arr[n], strerror(errno));
+			status = NULL+1;
+			goto epoll_err;
+		}
+	}
 
-	pdebug("s%i: Started master loop", args->sfd);
+	pdebug("Started master loop (%zu sockets)", args->sfd_arr_len);
 
 	while (atomic_load(&args->run) == true) {
-		/* Set correct size before calling. */
-		addr.ai_addrlen = sizeof(sockaddr);
-		/* Reset ip to 0. */
-		memset(addr.ai_addr, 0, sizeof(sockaddr));
-
-		/* Receive message and store sender ip in addr.ai_addr. */
-		ret = recvfrom(args->sfd, buffer, sizeof(buffer), 0,
-		    addr.ai_addr, &addr.ai_addrlen);
-
-		/* Set family according to size of struct. */
-		addr.ai_family = addr.ai_addrlen == sizeof(struct sockaddr_in) ?
-		    AF_INET : AF_INET6;
-		/* Print sender ip and bytes read. */
-		if (ret < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				pdebug("s%i: TIMEOUT", args->sfd,
-				    addr2str(&addr), ret);
-				continue;
+		nfds = epoll_wait(epfd, events, MAX_EVENTS,
+		    MAX_RECV_TIMEOUT * 1000);
+		now_ms = mono_ms();
+		if (now_ms >= next_tick) {
+			for (size_t n = 0; n < args->sfd_arr_len; ++n) {
+				rxdrop_tick(&args->rxdrops[n], now_ms);
 			}
-			perr("Encountered error from recvfrom: %s",
-			     strerror(errno));
-			return NULL+1;
-		} else {
-			bytes = ret;
-			pdebug("s%i: %s: %d bytes", args->sfd, addr2str(&addr),
-			    bytes);
+			next_tick = now_ms + RXDROP_INTERVAL;
 		}
-
-		/* Send the message back. */
-		ret = sendto(args->sfd, buffer, (size_t)bytes, 0, addr.ai_addr,
-		    addr.ai_addrlen);
-		if (ret < 0) {
-			perr("Encountered error from sendto: %s",
+		if (nfds == 0) {
+			pdebug("TIMEOUT");
+			continue;
+		} else if (nfds < 0) {
+			if (errno == EINTR) continue;
+			perr("Encountered error from epoll_wait: %s",
 			    strerror(errno));
-			return NULL+1;
-		} else if (ret < bytes) {
-			pwarn("Could not send full message (%zu of %zu): %s",
-			    (size_t)ret, (size_t)bytes, strerror(errno));
+			status = NULL+1;
+			goto epoll_err;
+		}
+
+		for (int n = 0; n < nfds; ++n) {
+			/* Drain socket, sockets are non-blocking. */
+			while ((ret = echo_batch(args, bufs,
+			    events[n].data.u32)) == ECHO_BATCH);
+			if (ret < 0) {
+				status = NULL+1;
+				goto epoll_err;
+			}
+		}
+		/* Low latency mode, wait for the next datagram here instead
+		 * of paying for the wakeup from epoll_wait.
+		 */
+		if (args->spin_us > 0 && echo_spin(args, bufs) != 0) {
+			status = NULL+1;
+			goto epoll_err;
 		}
 	}
 
-	return NULL;
+epoll_err:
+	close(epfd);
+	free(bufs);
+	return status;
 }
 
-static const char *addr2str(const struct addrinfo *addr)
+static int echo_batch(struct rw_loop_args *args, struct echo_bufs *bufs,
+    size_t idx)
 {
-	if (addr->ai_family == AF_INET) {
-		struct sockaddr_in *a4 = (struct sockaddr_in *)addr->ai_addr;
-		const char *ret = inet_ntop(AF_INET, (void *)&a4->sin_addr,
-		    _ip_buffer, sizeof(_ip_buffer));
-		if (ret == NULL) {
-			perr("Failed to convert addrinfo4 to str: %s",
-			    strerror(errno));
-			return NULL;
+	struct rxdrop *rd = &args->rxdrops[idx];
+	const int sfd = args->sfd_arr[idx];
+	struct rx_cmsg cmsg = {0};
+	uint64_t rx_ns[ECHO_BATCH] = {0}, now_ns = 0, batch_ns = 0;
+	int count = 0, sent = 0, ret = 0;
+
+	/* Set correct sizes before calling. */
+	for (size_t n = 0; n < ECHO_BATCH; ++n) {
+		struct msghdr *msg = &bufs->msgs[n].msg_hdr;
+
+		msg->msg_namelen = sizeof(bufs->addrs[n]);
+		msg->msg_control = bufs->control[n];
+		msg->msg_controllen = sizeof(bufs->control[n]);
+		bufs->iovs[n].iov_len = MAX_DATAGRAM_SIZE;
+	}
+
+	/* Receive messages and store sender ips in msg_name. */
+	count = recvmmsg(sfd, bufs->msgs, ECHO_BATCH, MSG_DONTWAIT, NULL);
+	if (count < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+		perr("Encountered error from recvmmsg: %s", strerror(errno));
+		return -1;
+	}
+
+	for (int n = 0; n < count; ++n) {
+		struct msghdr *msg = &bufs->msgs[n].msg_hdr;
+
+		rx_cmsg_parse(msg, &cmsg);
+		rxdrop_update(rd, cmsg.dropped);
+		/* AF_UNIX names vary in length and unbound senders have
+		 * none, clear what's left of the previous name.
+		 */
+		if (msg->msg_namelen == 0
+		    || bufs->addrs[n].ss_family == AF_UNIX) {
+			memset((char *)msg->msg_name + msg->msg_namelen, 0,
+			    sizeof(bufs->addrs[n]) - msg->msg_namelen);
+			bufs->addrs[n].ss_family = AF_UNIX;
 		}
-		return ret;
-	} else if(addr->ai_family == AF_INET6) {
-		struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)addr->ai_addr;
-		const char *ret = inet_ntop(AF_INET6,
-		    (void *)&a6->sin6_addr, _ip_buffer, sizeof(_ip_buffer));
-		if (ret == NULL) {
-			perr("Failed to convert addrinfo6 to str: %s",
-			    strerror(errno));
-			return NULL;
+		rx_ns[n] = cmsg.timestamp;
+		if (rx_ns[n] != 0) {
+			now_ns = real_ns();
+			hist_add(&args->rx_queue, now_ns > rx_ns[n]
+			    ? now_ns - rx_ns[n] : 0);
 		}
-		return ret;
-	} else {
-		perr("Failed to convert addrinfo to str: Unknown ip family");
-		return NULL;
+		if (args->capture != NULL) {
+			/* Without kernel timestamps one clock read per batch. */
+			if (rx_ns[n] == 0 && batch_ns == 0) batch_ns = real_ns();
+			if (!capture_add(args->capture, msg->msg_name,
+			    bufs->buffers[n], bufs->msgs[n].msg_len,
+			    rx_ns[n] != 0 ? rx_ns[n] : batch_ns))
+				++args->capture_dropped;
+		}
+
+		/* Print sender ip and bytes read. */
+		pdebug("s%i: %s: %u bytes", sfd,
+		    addr2str(bufs->addrs[n].ss_family, msg->msg_name),
+		    bufs->msgs[n].msg_len);
+
+		/* Echo exactly what was received, without the control
+		 * messages.
+		 */
+		bufs->iovs[n].iov_len = bufs->msgs[n].msg_len;
+		msg->msg_control = NULL;
+		msg->msg_controllen = 0;
 	}
-}
 
-static int create_addrinfo(const char *port,
-    const char *bind_ips[MAX_BIND_COUNT], size_t bind_ips_len,
-    struct addrinfo **out)
-{
-	struct addrinfo *first = NULL, *current = NULL, hints = {0};
-	int status = 1, ret = 0;
+	/* Send the messages back. */
+	while (sent < count) {
+		ret = sendmmsg(sfd, &bufs->msgs[sent], count - sent,
+		    MSG_DONTWAIT);
+		if (ret < 0) {
+			/* Full send buffer (or a bad address) drops the echo,
+			 * like the network would. Unbound AF_UNIX senders
+			 * (ENOTCONN) can't be answered at all.
+			 */
+			if (bufs->msgs[sent].msg_hdr.msg_namelen
+			    > sizeof(sa_family_t))
+				pwarn("Encountered error from sendmmsg: %s",
+				    strerror(errno));
+			++sent;
+			continue;
+		}
+		sent += ret;
+	}
+	if (args->rx_timestamps) {
+		now_ns = real_ns();
+		for (int n = 0; n < count; ++n) {
+			if (rx_ns[n] == 0) continue;
+			hist_add(&args->rx_send, now_ns > rx_ns[n]
+			    ? now_ns - rx_ns[n] : 0);
+		}
+	}
 
-	hints.ai_family = AF_UNSPEC; /* Any IP version. */
-	hints.ai_socktype = SOCK_DGRAM; /* Must be datagram. */
-	/* Host must be an ip and if no host is provided let the os choose. */
-	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
-	hints.ai_protocol = IPPROTO_UDP; /* Must be UDP. */
+	return count;
+}
 
-	for (size_t n = 0; n < bind_ips_len; ++n) {
-		ret = getaddrinfo(bind_ips[n], port, &hints, &current);
-		if (ret != 0) {
-			if (first != NULL) {
-				freeaddrinfo(first);
-			}
-			perr("Failed to getaddrinfo: %s", gai_strerror(ret));
-			goto getaddrinfo_err;
+static int echo_spin(struct rw_loop_args *args, struct echo_bufs *bufs)
+{
+	const uint64_t budget = (uint64_t)args->spin_us * 1000;
+	uint64_t now = mono_ns(), deadline = now + budget;
+	uint64_t hits = 0, idle = 0;
+	bool hit = false;
+	int ret = 0;
+
+	while (now < deadline && atomic_load_explicit(&args->run,
+	    memory_order_relaxed)) {
+		hit = false;
+		for (size_t n = 0; n < args->sfd_arr_len; ++n) {
+			ret = echo_batch(args, bufs, n);
+			if (ret < 0) return -1;
+			hit |= ret > 0;
 		}
-		if (first == NULL) {
-			first = current;
+		now = mono_ns();
+		/* Every datagram restarts the budget. */
+		if (hit) {
+			++hits;
+			deadline = now + budget;
 		} else {
-			/* Set the last element of first to current. */
-			struct addrinfo *tmp = first;
-			while (tmp->ai_next != NULL) {
-				tmp = tmp->ai_next;
-			}
-			tmp->ai_next = current;
+			++idle;
 		}
 	}
 
-	if (bind_ips_len == 0) {
-		ret = getaddrinfo(NULL, port, &hints, &first);
-		if (ret != 0) {
-			perr("Failed to getaddrinfo: %s", gai_strerror(ret));
-			goto getaddrinfo_err;
+	/* Single writer, main reads them on SIGUSR1. */
+	__atomic_store_n(&args->spin_hits, args->spin_hits + hits,
+	    __ATOMIC_RELAXED);
+	__atomic_store_n(&args->spin_idle, args->spin_idle + idle,
+	    __ATOMIC_RELAXED);
+	__atomic_store_n(&args->spin_sleeps, args->spin_sleeps + 1,
+	    __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static void raise_nofile(size_t need)
+{
+	struct rlimit limit = {0};
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+	/* Keep some room for stdio and epoll. */
+	if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < need + 16) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+			pwarn("Failed to raise open file limit: %s",
+			    strerror(errno));
 		}
 	}
+}
 
-	status = 0;
-	*out = first;
+static void rxdrop_print(const struct rw_loop_args *args)
+{
+	struct sockaddr_storage addr = {0};
+	socklen_t addr_len = 0;
+	char port[sizeof(":65535")] = "";
+
+	/* Only sockets that ever dropped, there may be hundreds. */
+	for (size_t n = 0; n < args->sfd_arr_len; ++n) {
+		const struct rxdrop *rd = &args->rxdrops[n];
+		const uint64_t dropped = __atomic_load_n(&rd->dropped,
+		    __ATOMIC_RELAXED);
+
+		if (dropped == 0) continue;
+		/* addr2str reads all of sun_path. */
+		memset(&addr, 0, sizeof(addr));
+		addr_len = sizeof(addr);
+		if (getsockname(rd->fd, (struct sockaddr *)&addr, &addr_len)
+		    != 0)
+			continue;
+		/* AF_UNIX sockets have no port. */
+		port[0] = '\0';
+		if (addr.ss_family != AF_UNIX)
+			snprintf(port, sizeof(port), ":%u",
+			    ntohs(addr.ss_family == AF_INET
+			    ? ((struct sockaddr_in *)&addr)->sin_port
+			    : ((struct sockaddr_in6 *)&addr)->sin6_port));
+		pinfo("s%i: %s%s rx-dropped %" PRIu64 " (%" PRIu64 "/s)",
+		    rd->fd, addr2str(addr.ss_family, (struct sockaddr *)&addr),
+		    port, dropped,
+		    __atomic_load_n(&rd->rate, __ATOMIC_RELAXED));
+	}
+}
 
-getaddrinfo_err:
-	return status;
+static void spin_print(const struct rw_loop_args *args)
+{
+	const uint64_t hits = __atomic_load_n(&args->spin_hits,
+	    __ATOMIC_RELAXED);
+	const uint64_t idle = __atomic_load_n(&args->spin_idle,
+	    __ATOMIC_RELAXED);
+
+	if (args->spin_us == 0) return;
+	pinfo("spin: hits %" PRIu64 " idle %" PRIu64 " (%.1f%% hits) "
+	    "sleeps %" PRIu64, hits, idle,
+	    hits + idle > 0 ? 100.0 * hits / (hits + idle) : 0.0,
+	    __atomic_load_n(&args->spin_sleeps, __ATOMIC_RELAXED));
+}
+
+static uint64_t mono_ns(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t mono_ms(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t real_ns(void)
+{
+	struct timespec ts = {0};
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static inline void pdebug(const char *format, ...)
+static void hist_print(const char *name, const struct hist *h0)
+{
+	struct hist h = {{0}, 0};
+	uint64_t total = 0;
+
+	hist_merge(&h, h0);
+	total = hist_total(&h);
+	if (total == 0) return;
+	pinfo("%s n %" PRIu64 " p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus",
+	    name, total, hist_quantile(&h, 500) / 1000.0,
+	    hist_quantile(&h, 990) / 1000.0, hist_quantile(&h, 999) / 1000.0,
+	    h.max / 1000.0);
+}
+
+static inline void pdebug_(const char *format, ...)
 {
 	pthread_mutex_lock(&log_mutex);
 
-	if (!pdebug_enabled) return;
 	va_list ap;
 
 	fprintf(stderr, "%s: DEBUG: ", progname);
@@ -401,6 +735,22 @@ static inline void pdebug(const char *format, ...)
 	pthread_mutex_unlock(&log_mutex);
 }
 
+static inline void pinfo(const char *format, ...)
+{
+	if (!pinfo_enabled) return;
+	pthread_mutex_lock(&log_mutex);
+
+	va_list ap;
+
+	fprintf(stderr, "%s: INFO: ", progname);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+
+	pthread_mutex_unlock(&log_mutex);
+}
+
 static inline void pwarn(const char *format, ...)
 {
 	pthread_mutex_lock(&log_mutex);
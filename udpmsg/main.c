@@ -1,7 +1,1339 @@
+#define _GNU_SOURCE /* sendmmsg, recvmmsg, SO_TXTIME, be64toh */
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <endian.h>
+#include <inttypes.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef SO_TXTIME
+#include <linux/net_tstamp.h>
+#endif
+
+/* Control messages, latency histograms and the binary log format are
+ * shared with udpchat and udpecho (common/).
+ */
+#include "common/net.h"
+#include "common/hist.h"
+#include "common/capture.h"
+
+#define MAX_PACKET_SIZE 1212
+#define MAX_ERROR_COUNT 3
+#define PORT 10020
+
+/* Client defaults, see usage. */
+#define DEFAULT_RATE 1000
+#define DEFAULT_SIZE 64
+#define DEFAULT_BATCH 32
+#define MAX_BATCH 256
+/* Sleep instead of spinning when the next datagram is further away (ns),
+ * and wake up this much early to spin the rest.
+ */
+#define SLEEP_MIN (100 * 1000)
+#define SLEEP_SLACK (50 * 1000)
+/* With SO_TXTIME datagrams are handed to the kernel this early (ns), the
+ * qdisc (etf or fq) sends them at their txtime.
+ */
+#define TXTIME_LEAD (500 * 1000)
+/* With -e the client waits this long (ms) for the last echoes. */
+#define ECHO_WAIT 1000
+
+/* Server: seqs are checked for duplicates within this window, older ones
+ * are counted as late. Must be a multiple of 64.
+ */
+#define SEQ_WINDOW 65536
+/* Streams the server keeps apart at once, the least recently seen one is
+ * reported and dropped for a new one.
+ */
+#define STREAMS_MAX 64
+/* Seconds between server reports. */
+#define REPORT_INTERVAL 1
+/* Datagrams per recvmmsg, and how long it blocks (us) before reports and
+ * flushes are checked.
+ */
+#define RECV_BATCH 64
+#define RECV_TIMEOUT (10 * 1000)
+/* Output buffer, written with one writev when full or every flush ms. */
+#define OUT_CHUNKS 16
+#define OUT_CHUNK_SIZE (64 * 1024)
+/* Longest record, a text line for a datagram from the longest AF_UNIX name
+ * ('@' and the rest of sun_path) with a full quoted payload. Binary records
+ * and udpmsg datagrams are shorter.
+ */
+#define OUT_RECORD_MAX (sizeof("Received ( ): \"\"\n") \
+                        + 1 + sizeof(((struct sockaddr_un *)0)->sun_path) \
+                        + 20 /* len digits */ + MAX_PACKET_SIZE)
+#define DEFAULT_FLUSH 100
+
+/* Replay: max sockets, sources are spread over them by address. */
+#define REPLAY_SOCKETS_MAX 1024
+
+/* Every client datagram starts with this header, the rest is padding.
+ * All fields are big endian.
+ */
+#define MSG_MAGIC 0x554d5347 /* "UMSG" */
+struct msg_hdr {
+	uint32_t magic;
+	uint32_t stream; /* Random per client run, tells runs apart. */
+	uint64_t seq; /* 0 for the first datagram of a stream. */
+	uint64_t tx_ns; /* CLOCK_REALTIME the datagram was (to be) sent. */
+};
+
+struct client_opts {
+	uint64_t rate; /* Datagrams per second. */
+	uint64_t count; /* Stop after count datagrams, 0 for no limit. */
+	uint64_t duration; /* Stop after duration seconds, 0 for no limit. */
+	size_t size; /* Datagram size, at least sizeof(struct msg_hdr). */
+	size_t batch; /* Bucket size, max datagrams per sendmmsg. */
+	bool txtime; /* Let the kernel pace with SO_TXTIME. */
+	bool echo; /* Read echoes, for loss and round trip time. */
+};
+
+struct replay_opts {
+	double scale; /* Speed up original timing by scale, 0 for max speed. */
+	size_t batch; /* Max datagrams per sendmmsg. */
+	size_t sockets; /* Sockets to send from, see source_hash. */
+};
+
+enum out_format {
+	OUT_NONE,
+	OUT_TEXT, /* One line per datagram. */
+	OUT_BINARY, /* CAPTURE_MAGIC and a capture_rec per datagram. */
+};
+
+struct server_opts {
+	enum out_format format;
+	bool all; /* Also log udpmsg datagrams, not only count them. */
+	uint64_t flush; /* Max ms output stays buffered. */
+};
+
+/* Output is appended to fixed chunks, a record never spans two chunks. */
+struct out_buf {
+	int fd;
+	enum out_format format;
+	char *mem; /* OUT_CHUNKS * OUT_CHUNK_SIZE */
+	struct iovec iov[OUT_CHUNKS]; /* iov_len is the used part of a chunk. */
+	size_t chunk; /* Chunk being filled. */
+	uint64_t last_flush; /* ns, CLOCK_MONOTONIC */
+	uint64_t bytes, writes;
+};
+
+/* Receive state of one client stream. */
+struct stream_stats {
+	uint32_t stream;
+	uint64_t first; /* First seq seen. */
+	uint64_t next; /* Highest seq seen + 1. */
+	uint64_t recv, bytes;
+	uint64_t dup; /* Seen before (within SEQ_WINDOW). */
+	uint64_t reorder; /* Arrived after a higher seq. */
+	uint64_t late; /* Older than SEQ_WINDOW, can't tell if duplicate. */
+	uint64_t seen[SEQ_WINDOW / 64]; /* Bit per seq in [next - SEQ_WINDOW, next). */
+	struct hist latency; /* One-way, needs synchronized clocks. */
+	uint64_t latency_min; /* The histogram only keeps the max. */
+	uint64_t last_recv; /* recv at the last report. */
+	uint64_t last_rx; /* rx_ns of the last datagram. */
+};
+
+static volatile sig_atomic_t stop = 0;
+
+int parse_ip(const char *ip, struct sockaddr *addr);
+/* Parse ip and port into addr, returns length or 0 on error. Addresses
+ * starting with UNIX_PREFIX take no port.
+ */
+socklen_t parse_addr(const char *ip, const char *port,
+                     struct sockaddr_storage *addr);
+int server(int family, struct sockaddr *listen_addr, socklen_t listen_addr_len,
+           const struct server_opts *opts);
+int client(int family, struct sockaddr *remote_addr, socklen_t remote_addr_len,
+           const struct client_opts *opts);
+/* Read the echoes queued on the client's fd into st, waiting up to timeout
+ * ms for the first one (0 doesn't wait). Datagrams that aren't an echo of
+ * st's stream are skipped. Return 0 on success, 1 on error.
+ */
+int echo_recv(int fd, struct stream_stats *st, int timeout);
+/* Send the datagrams of a binary log (CAPTURE_MAGIC) at path to remote_addr,
+ * with their original timing scaled by opts->scale.
+ */
+int replay(const char *path, int family, struct sockaddr *remote_addr,
+           socklen_t remote_addr_len, const struct replay_opts *opts);
+/* Bind fd to an autobind (abstract) name if it is an AF_UNIX socket, so
+ * servers can reply. Returns 0 on success, -1 on error.
+ */
+int unix_autobind(int fd, int family);
+/* FNV-1a of the source address and port of rec. */
+uint32_t source_hash(const struct capture_rec *rec);
+void usage(const char *progname);
+void on_signal(int sig);
+
+/* Clocks in ns. */
+uint64_t clock_ns(clockid_t clock);
+/* Time of datagram number k of the schedule, relative to the start (ns).
+ * Split so k * 1e9 never overflows.
+ */
+uint64_t schedule_ns(uint64_t k, uint64_t rate);
+
+/* Return 0 on success, 1 on error (errno is set). */
+int out_init(struct out_buf *out, int fd, enum out_format format);
+/* Write everything buffered, now is CLOCK_MONOTONIC in ns.
+ * Return 0 on success, 1 on error.
+ */
+int out_flush(struct out_buf *out, uint64_t now);
+/* Append a record of a datagram, hdr is set for udpmsg datagrams.
+ * Return 0 on success, 1 if a flush failed.
+ */
+int out_record(struct out_buf *out, const struct sockaddr_storage *addr,
+               const char *payload, size_t len, uint64_t rx_ns,
+               const struct msg_hdr *hdr);
+/* Formatters, return the end of what they wrote to dst. */
+char *fmt_str(char *dst, const char *str);
+char *fmt_u64(char *dst, uint64_t value);
+char *fmt_hex32(char *dst, uint32_t value);
+char *fmt_ip(char *dst, const struct sockaddr_storage *addr);
+
+void stream_reset(struct stream_stats *st, uint32_t stream, uint64_t seq);
+/* Stats of stream in streams (len used), a new one starts at seq. When all
+ * STREAMS_MAX are used the least recently seen one is reported and reused.
+ */
+struct stream_stats *stream_find(struct stream_stats *streams, size_t *len,
+                                 uint32_t stream, uint64_t seq);
+void stream_update(struct stream_stats *st, uint64_t seq, size_t len,
+                   uint64_t latency);
+void stream_report(const struct stream_stats *st, double interval);
 
 int main(int argc, char *argv[]) {
+	struct sockaddr_storage addr = {0};
+	socklen_t addr_len = 0;
+	struct client_opts opts = {
+		DEFAULT_RATE, 0, 0, DEFAULT_SIZE, DEFAULT_BATCH, false, false
+	};
+	struct server_opts server_opts = {OUT_TEXT, false, DEFAULT_FLUSH};
+	struct replay_opts replay_opts = {1.0, DEFAULT_BATCH, 1};
+	const char *optstring = NULL, *path = NULL;
+	struct sigaction sa = {0};
+	const char *progname = argv[0];
+	char *end = NULL;
+	unsigned long long value = 0;
+	enum { MODE_SERVER, MODE_CLIENT, MODE_REPLAY } mode = MODE_SERVER;
+	int opt = 0;
+
 	if (argc < 3) {
+		fprintf(stderr, "Not enough arguments!\n");
+		usage(progname);
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp("server", argv[1]) == 0) {
+		mode = MODE_SERVER;
+		optstring = "f:F:a";
+	} else if (strcmp("client", argv[1]) == 0) {
+		mode = MODE_CLIENT;
+		optstring = "r:n:d:s:b:xe";
+	} else if (strcmp("replay", argv[1]) == 0) {
+		mode = MODE_REPLAY;
+		optstring = "S:mb:u:";
+	} else {
+		fprintf(stderr, "Unknown mode (first argument)!\n");
+		usage(progname);
+		return EXIT_FAILURE;
+	}
+
+	/* Options follow the mode. */
+	argc -= 1;
+	argv += 1;
+	while ((opt = getopt(argc, argv, optstring)) != -1) {
+		if (opt == 'x') {
+			opts.txtime = true;
+			continue;
+		} else if (opt == 'e') {
+			opts.echo = true;
+			continue;
+		} else if (opt == 'a') {
+			server_opts.all = true;
+			continue;
+		} else if (opt == 'f') {
+			if (strcmp(optarg, "text") == 0) {
+				server_opts.format = OUT_TEXT;
+			} else if (strcmp(optarg, "binary") == 0) {
+				server_opts.format = OUT_BINARY;
+			} else if (strcmp(optarg, "none") == 0) {
+				server_opts.format = OUT_NONE;
+			} else {
+				fprintf(stderr, "Unknown output format: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			continue;
+		} else if (opt == 'm') {
+			replay_opts.scale = 0;
+			continue;
+		} else if (opt == 'S') {
+			replay_opts.scale = strtod(optarg, &end);
+			if (end == optarg || *end != '\0' || !(replay_opts.scale > 0)) {
+				fprintf(stderr, "Invalid value for -S: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			continue;
+		} else if (opt == '?') {
+			usage(progname);
+			return EXIT_FAILURE;
+		}
+		errno = 0;
+		value = strtoull(optarg, &end, 10);
+		if (errno != 0 || end == optarg || *end != '\0') {
+			fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+			return EXIT_FAILURE;
+		}
+		switch (opt) {
+		case 'r': opts.rate = value; break;
+		case 'n': opts.count = value; break;
+		case 'd': opts.duration = value; break;
+		case 's': opts.size = value; break;
+		case 'b': opts.batch = value; break;
+		case 'F': server_opts.flush = value; break;
+		case 'u': replay_opts.sockets = value; break;
+		}
+	}
+	replay_opts.batch = opts.batch;
+	if (opts.rate == 0 || opts.rate > 1000000000
+	    || opts.size < sizeof(struct msg_hdr) || opts.size > MAX_PACKET_SIZE
+	    || opts.batch == 0 || opts.batch > MAX_BATCH) {
+		fprintf(stderr, "Rate must be 1 to 1e9, size %zu to %d, "
+		        "batch 1 to %d\n", sizeof(struct msg_hdr),
+		        MAX_PACKET_SIZE, MAX_BATCH);
+		return EXIT_FAILURE;
+	}
+	if (replay_opts.sockets == 0 || replay_opts.sockets > REPLAY_SOCKETS_MAX) {
+		fprintf(stderr, "Sockets must be 1 to %d\n", REPLAY_SOCKETS_MAX);
+		return EXIT_FAILURE;
+	}
+	/* Replay reads a log, given before the address. */
+	if (mode == MODE_REPLAY && optind < argc) path = argv[optind++];
+	if (optind >= argc) {
+		fprintf(stderr, "Not enough arguments!\n");
+		usage(progname);
+		return EXIT_FAILURE;
+	}
+
+	addr_len = parse_addr(argv[optind], optind + 1 < argc
+	                      ? argv[optind + 1] : NULL, &addr);
+	if (addr_len == 0) {
+		fprintf(stderr, "Failed to parse ip or port\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Stop loops cleanly, so the final report is printed. */
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (mode == MODE_CLIENT) {
+		return client(addr.ss_family, (struct sockaddr *)&addr, addr_len,
+		              &opts);
+	} else if (mode == MODE_REPLAY) {
+		return replay(path, addr.ss_family, (struct sockaddr *)&addr,
+		              addr_len, &replay_opts);
+	}
+
+	return server(addr.ss_family, (struct sockaddr *)&addr, addr_len,
+	              &server_opts);
+}
+
+void usage(const char *progname) {
+	fprintf(stderr,
+	        "Usage: %s server [-f text|binary|none] [-F ms] [-a] ip [port]\n"
+	        "       %s client [-r rate] [-n count] [-d seconds] [-s size] "
+	        "[-b batch] [-x] [-e] ip [port]\n"
+	        "       %s replay [-S scale | -m] [-b batch] [-u sockets] "
+	        "file ip [port]\n"
+	        "client:\n"
+	        "  -r  datagrams per second (%d)\n"
+	        "  -n  stop after count datagrams\n"
+	        "  -d  stop after seconds\n"
+	        "  -s  datagram size in bytes (%d)\n"
+	        "  -b  max burst, datagrams per sendmmsg (%d)\n"
+	        "  -x  pace in the kernel with SO_TXTIME (needs etf or fq)\n"
+	        "  -e  read echoes (udpecho), report loss and round trip time\n"
+	        "server:\n"
+	        "  -f  output format, one line or record per datagram (text)\n"
+	        "  -F  max ms output is buffered (%d)\n"
+	        "  -a  also output udpmsg client datagrams\n"
+	        "replay (a binary log of udpmsg server, udpecho or udpchat):\n"
+	        "  -S  speed up the original timing, 2 is twice as fast (1)\n"
+	        "  -m  send as fast as possible\n"
+	        "  -b  max datagrams per sendmmsg (%d)\n"
+	        "  -u  sockets to send from, a source always uses the same (1)\n"
+	        "ip may be unix:path or unix:@name for a Unix datagram socket.\n",
+	        progname, progname, progname, DEFAULT_RATE, DEFAULT_SIZE,
+	        DEFAULT_BATCH, DEFAULT_FLUSH, DEFAULT_BATCH);
+}
+
+void on_signal(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+/* Returns:
+ * -1 - invalid address
+ *  0 - ipv4 address
+ *  1 - ipv6 address
+ */
+int parse_ip(const char *ip, struct sockaddr *addr) {
+	int ret = 0;
+	struct in_addr ipv4 = {0};
+	struct in6_addr ipv6 = {0};
+
+	ret = inet_pton(AF_INET, ip, &ipv4);
+	if (ret == 1) {
+		((struct sockaddr_in *)addr)->sin_addr = ipv4;
+		return 0;
+	} else if (ret == 0) {
+		/* Try next family */
+	} else {
+		return -1;
+	}
+
+	ret = inet_pton(AF_INET6, ip, &ipv6);
+	if (ret == 1) {
+		((struct sockaddr_in6 *)addr)->sin6_addr = ipv6;
+		return 1;
+	} else {
+		return -1;
+	}
+}
+
+socklen_t parse_addr(const char *ip, const char *port,
+                     struct sockaddr_storage *addr) {
+	unsigned long portnum = PORT;
+	char *end = NULL;
+	int ret = 0;
+
+	if (strncmp(ip, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+		struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
+		const char *path = ip + sizeof(UNIX_PREFIX) - 1;
+		size_t len = strlen(path);
+
+		if (port != NULL || len == 0 || len >= sizeof(addr_un->sun_path))
+			return 0;
+		addr_un->sun_family = AF_UNIX;
+		memcpy(addr_un->sun_path, path, len);
+		/* Abstract names start with a 0 byte and aren't terminated. */
+		if (path[0] == '@') {
+			addr_un->sun_path[0] = '\0';
+		} else {
+			++len;
+		}
+		return offsetof(struct sockaddr_un, sun_path) + len;
+	}
+
+	if (port != NULL) {
+		portnum = strtoul(port, &end, 10);
+		if (end == port || *end != '\0' || portnum > 65535) return 0;
+	}
+
+	ret = parse_ip(ip, (struct sockaddr *)addr);
+	if (ret == 0) {
+		struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+
+		addr4->sin_port = htons(portnum);
+		addr4->sin_family = AF_INET;
+		return sizeof(*addr4);
+	} else if (ret == 1) {
+		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+
+		addr6->sin6_port = htons(portnum);
+		addr6->sin6_family = AF_INET6;
+		return sizeof(*addr6);
+	}
+
+	return 0;
+}
+
+uint64_t clock_ns(clockid_t clock) {
+	struct timespec ts = {0};
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t schedule_ns(uint64_t k, uint64_t rate) {
+	return k / rate * 1000000000 + k % rate * 1000000000 / rate;
+}
+
+int client(int family, struct sockaddr *remote_addr, socklen_t remote_addr_len,
+           const struct client_opts *opts) {
+	int fd = 0, ret = 0, status = EXIT_FAILURE;
+	static char buffers[MAX_BATCH][MAX_PACKET_SIZE];
+	static struct mmsghdr msgs[MAX_BATCH];
+	static struct iovec iovs[MAX_BATCH];
+	static char control[MAX_BATCH][CMSG_SPACE(sizeof(uint64_t))];
+	struct msg_hdr hdr = {0};
+	/* Echoes, latency is the round trip on our clock. */
+	static struct stream_stats echoes = {0};
+	struct timespec wake = {0};
+	/* Clock offsets, the schedule runs on CLOCK_MONOTONIC. */
+	uint64_t real_off = 0, tai_off = 0;
+	uint64_t start = 0, now = 0, end = 0, at = 0, due = 0, deadline = 0;
+	/* Next slot of the schedule, and datagrams sent (the next seq). */
+	uint64_t slot = 0, sent = 0, skipped = 0, retries = 0;
+	size_t n = 0;
+	bool txtime = opts->txtime;
+
+	/* Create socket fd. */
+	fd = socket(family, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("Failed to create socket");
+		goto socket_err;
+	}
+	/* Connected, so sendmmsg needs no addresses. */
+	if (unix_autobind(fd, family) != 0) {
+		perror("Failed to bind");
+		goto connect_err;
+	}
+	ret = connect(fd, remote_addr, remote_addr_len);
+	if (ret < 0) {
+		perror("Failed to connect");
+		goto connect_err;
+	}
+
+	if (txtime) {
+#ifdef SO_TXTIME
+		struct sock_txtime cfg = {CLOCK_TAI, 0};
+
+		if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) != 0) {
+			perror("SO_TXTIME not available, pacing in userspace");
+			txtime = false;
+		}
+#else
+		fprintf(stderr, "SO_TXTIME not available, pacing in userspace\n");
+		txtime = false;
+#endif
+	}
+
+	srandom(clock_ns(CLOCK_MONOTONIC) ^ getpid());
+	hdr.magic = htonl(MSG_MAGIC);
+	hdr.stream = htonl(random());
+	if (opts->echo) {
+#ifdef SO_TIMESTAMPNS
+		int on = 1;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0)
+			perror("Failed to enable SO_TIMESTAMPNS");
+#endif
+		stream_reset(&echoes, ntohl(hdr.stream), 0);
+	}
+	for (size_t i = 0; i < MAX_BATCH; ++i) {
+		iovs[i].iov_base = buffers[i];
+		iovs[i].iov_len = opts->size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if (txtime) {
+			struct cmsghdr *cmsg = NULL;
+
+			msgs[i].msg_hdr.msg_control = control[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+			cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+			cmsg->cmsg_level = SOL_SOCKET;
+#ifdef SCM_TXTIME
+			cmsg->cmsg_type = SCM_TXTIME;
+#endif
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+		}
+	}
+
+	start = clock_ns(CLOCK_MONOTONIC);
+	real_off = clock_ns(CLOCK_REALTIME) - start;
+	tai_off = clock_ns(CLOCK_TAI) - start;
+	if (opts->duration > 0) end = start + opts->duration * 1000000000;
+	fprintf(stderr, "INFO: stream %08" PRIx32 ": %" PRIu64 "/s, %zu bytes, "
+	        "burst %zu%s\n", ntohl(hdr.stream), opts->rate, opts->size,
+	        opts->batch, txtime ? ", SO_TXTIME" : "");
+
+	while (!stop && (opts->count == 0 || sent < opts->count)) {
+		now = clock_ns(CLOCK_MONOTONIC);
+		if (end != 0 && now >= end) break;
+
+		/* Slots due by now (or within TXTIME_LEAD, the kernel waits
+		 * for the rest). The schedule is absolute, so rounding never
+		 * drifts.
+		 */
+		at = now - start + (txtime ? TXTIME_LEAD : 0);
+		due = at / 1000000000 * opts->rate
+		      + at % 1000000000 * opts->rate / 1000000000 + 1;
+		if (due <= slot) {
+			/* Take the echoes while there is time. */
+			if (opts->echo && echo_recv(fd, &echoes, 0) != 0)
+				goto send_err;
+			/* Sleep most of the way, spin the rest. */
+			at = start + schedule_ns(slot, opts->rate);
+			if (at - now > SLEEP_MIN) {
+				at -= SLEEP_SLACK;
+				wake.tv_sec = at / 1000000000;
+				wake.tv_nsec = at % 1000000000;
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake,
+				                NULL);
+			}
+			continue;
+		}
+		/* Token bucket, never burst more than batch to catch up. */
+		if (due - slot > opts->batch) {
+			skipped += due - slot - opts->batch;
+			slot = due - opts->batch;
+		}
+		n = due - slot;
+		if (opts->count > 0 && n > opts->count - sent)
+			n = opts->count - sent;
+
+		for (size_t i = 0; i < n; ++i) {
+			at = schedule_ns(slot + i, opts->rate) + start;
+			hdr.seq = htobe64(sent + i);
+			hdr.tx_ns = htobe64((txtime ? at : now) + real_off);
+			memcpy(buffers[i], &hdr, sizeof(hdr));
+			if (txtime) {
+				uint64_t tai = at + tai_off;
+
+				memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msgs[i].msg_hdr)), &tai,
+				       sizeof(tai));
+			}
+		}
+
+		ret = sendmmsg(fd, msgs, n, 0);
+		if (ret < 0) {
+			/* Full queue, try again (the bucket limits the burst). */
+			if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR) {
+				++retries;
+				continue;
+			}
+			perror("Failed to send");
+			goto send_err;
+		}
+		slot += ret;
+		sent += ret;
+	}
+
+	now = clock_ns(CLOCK_MONOTONIC);
+	fprintf(stderr, "INFO: stream %08" PRIx32 ": sent %" PRIu64 " in %.3fs "
+	        "(%.0f/s), %" PRIu64 " slots skipped, %" PRIu64 " retries\n",
+	        ntohl(hdr.stream), sent, (now - start) / 1e9,
+	        sent / ((now - start) / 1e9), skipped, retries);
+	if (opts->echo) {
+		/* Wait for the echoes still on their way. */
+		deadline = now + ECHO_WAIT * 1000000ULL;
+		while (!stop && echoes.recv - echoes.dup < sent
+		       && (now = clock_ns(CLOCK_MONOTONIC)) < deadline) {
+			if (echo_recv(fd, &echoes,
+			              (deadline - now) / 1000000 + 1) != 0)
+				goto send_err;
+		}
+		/* Every seq sent is expected back, the last ones too. */
+		echoes.first = 0;
+		echoes.next = sent;
+		fprintf(stderr, "INFO: echoes, latency is the round trip:\n");
+		stream_report(&echoes, 0);
+	}
+	status = EXIT_SUCCESS;
+
+	send_err:
+	connect_err:
+	if (close(fd) != 0) perror("Failed to close fd");
+	socket_err:
+	return status;
+}
+
+int echo_recv(int fd, struct stream_stats *st, int timeout) {
+	static char buffers[RECV_BATCH][MAX_PACKET_SIZE];
+	static struct mmsghdr msgs[RECV_BATCH];
+	static struct iovec iovs[RECV_BATCH];
+	static char control[RECV_BATCH][RX_CMSG_LEN];
+	struct pollfd pfd = {fd, POLLIN, 0};
+	struct msg_hdr hdr = {0};
+	struct rx_cmsg cmsg = {0};
+	uint64_t rx_ns = 0, tx_ns = 0, batch_ns = 0;
+	int ret = 0;
+
+	if (timeout > 0) {
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR) {
+			perror("Failed to wait for echoes");
+			return 1;
+		} else if (ret <= 0) {
+			return 0;
+		}
+	}
+	for (size_t i = 0; i < RECV_BATCH; ++i) {
+		iovs[i].iov_base = buffers[i];
+		iovs[i].iov_len = MAX_PACKET_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = control[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+	}
+
+	do {
+		ret = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+		if (ret < 0) {
+			/* Nothing sent back yet is not an error. */
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+			    || errno == ECONNREFUSED)
+				return 0;
+			perror("Failed to receive echoes");
+			return 1;
+		}
+		batch_ns = 0;
+		for (int i = 0; i < ret; ++i) {
+			struct msghdr *msg = &msgs[i].msg_hdr;
+
+			rx_cmsg_parse(msg, &cmsg);
+			rx_ns = cmsg.timestamp;
+			/* recvmmsg only resets the lengths of what it filled, no
+			 * name is asked for.
+			 */
+			msg->msg_namelen = 0;
+			msg->msg_controllen = sizeof(control[i]);
+			if (msgs[i].msg_len < sizeof(hdr)) continue;
+			memcpy(&hdr, buffers[i], sizeof(hdr));
+			if (ntohl(hdr.magic) != MSG_MAGIC
+			    || ntohl(hdr.stream) != st->stream)
+				continue;
+			if (rx_ns == 0) {
+				if (batch_ns == 0) batch_ns = clock_ns(CLOCK_REALTIME);
+				rx_ns = batch_ns;
+			}
+			tx_ns = be64toh(hdr.tx_ns);
+			stream_update(st, be64toh(hdr.seq), msgs[i].msg_len,
+			              rx_ns > tx_ns ? rx_ns - tx_ns : 0);
+		}
+	/* A full batch means more may be queued. */
+	} while (ret == RECV_BATCH);
+
+	return 0;
+}
+
+int replay(const char *path, int family, struct sockaddr *remote_addr,
+           socklen_t remote_addr_len, const struct replay_opts *opts) {
+	int fd = 0, ret = 0, status = EXIT_FAILURE;
+	static int socks[REPLAY_SOCKETS_MAX];
+	static struct mmsghdr msgs[MAX_BATCH];
+	static struct iovec iovs[MAX_BATCH];
+	struct stat st = {0};
+	struct capture_rec rec = {0};
+	struct timespec wake = {0};
+	const char *map = NULL;
+	size_t pos = 0, len = 0, n = 0, done = 0, socks_len = 0;
+	/* Socket of a datagram, and of the batch. */
+	size_t sock = 0, batch_sock = 0;
+	uint64_t first = 0, start = 0, now = 0, due = 0, rx_ns = 0;
+	uint64_t sent = 0, bytes = 0, errors = 0, retries = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("Failed to open log");
+		goto open_err;
+	}
+	if (fstat(fd, &st) != 0) {
+		perror("Failed to stat log");
+		goto map_err;
+	}
+	if ((size_t)st.st_size < sizeof(CAPTURE_MAGIC) - 1) {
+		fprintf(stderr, "Not a udpmsg binary log: %s\n", path);
+		goto map_err;
+	}
+	/* Payloads are sent straight from the mapping. */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("Failed to map log");
+		goto map_err;
+	}
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+	if (memcmp(map, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1) != 0) {
+		fprintf(stderr, "Not a udpmsg binary log: %s\n", path);
+		goto socket_err;
+	}
+	pos = sizeof(CAPTURE_MAGIC) - 1;
+
+	/* Connected, so sendmmsg needs no addresses. */
+	for (; socks_len < opts->sockets; ++socks_len) {
+		socks[socks_len] = socket(family, SOCK_DGRAM, 0);
+		if (socks[socks_len] < 0) {
+			perror("Failed to create socket");
+			goto socket_err;
+		}
+		/* Distinct names, so every socket is its own source. */
+		if (unix_autobind(socks[socks_len], family) != 0) {
+			perror("Failed to bind");
+			++socks_len;
+			goto socket_err;
+		}
+		ret = connect(socks[socks_len], remote_addr, remote_addr_len);
+		if (ret < 0) {
+			perror("Failed to connect");
+			++socks_len;
+			goto socket_err;
+		}
+	}
+	for (size_t i = 0; i < MAX_BATCH; ++i) {
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if (pos + sizeof(rec) <= (size_t)st.st_size) {
+		memcpy(&rec, map + pos, sizeof(rec));
+		first = be64toh(rec.rx_ns);
+	}
+	start = now = clock_ns(CLOCK_MONOTONIC);
+	while (!stop && pos < (size_t)st.st_size) {
+		/* Batch datagrams that are due and go out the same socket. */
+		for (n = 0; n < opts->batch && pos < (size_t)st.st_size; ++n) {
+			if (pos + sizeof(rec) > (size_t)st.st_size) break;
+			memcpy(&rec, map + pos, sizeof(rec));
+			len = ntohl(rec.len);
+			if (len > st.st_size - pos - sizeof(rec)) break;
+			sock = opts->sockets > 1 ? source_hash(&rec) % opts->sockets : 0;
+			if (n > 0 && sock != batch_sock) break;
+
+			if (opts->scale > 0) {
+				/* Shards interleave, time may step back a little. */
+				rx_ns = be64toh(rec.rx_ns);
+				due = start + (rx_ns > first ? (rx_ns - first) / opts->scale
+				                             : 0);
+				if (due > now && n > 0) break;
+				if (due > now + SLEEP_MIN) {
+					wake.tv_sec = (due - SLEEP_SLACK) / 1000000000;
+					wake.tv_nsec = (due - SLEEP_SLACK) % 1000000000;
+					clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake,
+					                NULL);
+					if (stop) break;
+				}
+				while ((now = clock_ns(CLOCK_MONOTONIC)) < due);
+			}
+
+			iovs[n].iov_base = (void *)(map + pos + sizeof(rec));
+			iovs[n].iov_len = len;
+			batch_sock = sock;
+			pos += sizeof(rec) + len;
+		}
+		if (n == 0) {
+			if (!stop) fprintf(stderr, "WARN: log is truncated\n");
+			break;
+		}
+
+		for (done = 0; done < n;) {
+			ret = sendmmsg(socks[batch_sock], &msgs[done], n - done, 0);
+			if (ret < 0) {
+				if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR) {
+					++retries;
+					continue;
+				} else if (errno == ECONNREFUSED || errno == EMSGSIZE) {
+					/* Nobody listening yet or too large, skip one. */
+					++errors;
+					++done;
+					continue;
+				}
+				perror("Failed to send");
+				goto send_err;
+			}
+			for (int i = 0; i < ret; ++i) {
+				bytes += iovs[done + i].iov_len;
+			}
+			sent += ret;
+			done += ret;
+		}
+		now = clock_ns(CLOCK_MONOTONIC);
+	}
+
+	fprintf(stderr, "INFO: replayed %" PRIu64 " datagrams (%" PRIu64
+	        " bytes) in %.3fs (%.0f/s), %" PRIu64 " errors, %" PRIu64
+	        " retries\n", sent, bytes, (now - start) / 1e9,
+	        sent / ((now - start + 1) / 1e9), errors, retries);
+	status = EXIT_SUCCESS;
+
+	send_err:
+	socket_err:
+	for (size_t i = 0; i < socks_len; ++i) {
+		if (socks[i] >= 0 && close(socks[i]) != 0) perror("Failed to close fd");
+	}
+	munmap((void *)map, st.st_size);
+	map_err:
+	if (close(fd) != 0) perror("Failed to close log");
+	open_err:
+	return status;
+}
+
+int unix_autobind(int fd, int family) {
+	const sa_family_t addr = AF_UNIX;
+
+	if (family != AF_UNIX) return 0;
+	/* Only the family, the kernel picks a unique abstract name. */
+	return bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
+}
+
+uint32_t source_hash(const struct capture_rec *rec) {
+	const uint8_t *bytes = (const uint8_t *)&rec->family;
+	/* family, port and addr are adjacent. */
+	const size_t len = sizeof(*rec) - offsetof(struct capture_rec, family);
+	uint32_t hash = 2166136261U;
+
+	for (size_t i = 0; i < len; ++i) {
+		hash = (hash ^ bytes[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
+int server(int family, struct sockaddr *listen_addr, socklen_t listen_addr_len,
+           const struct server_opts *opts) {
+	// server fd, general return value, error count (used to stop loops)
+	int servfd = 0, ret = 0, errcount = 0, status = EXIT_FAILURE, on = 1;
+	static char buffers[RECV_BATCH][MAX_PACKET_SIZE];
+	static struct mmsghdr msgs[RECV_BATCH];
+	static struct iovec iovs[RECV_BATCH];
+	static struct sockaddr_storage addrs[RECV_BATCH];
+	static char control[RECV_BATCH][RX_CMSG_LEN];
+	struct timeval timeout = {0, RECV_TIMEOUT};
+	struct msg_hdr hdr = {0};
+	/* Clients send concurrently, each run is its own stream. */
+	static struct stream_stats streams[STREAMS_MAX];
+	struct stream_stats *st = NULL;
+	size_t streams_len = 0;
+	static struct out_buf out = {0};
+	struct rx_cmsg cmsg = {0};
+	/* Kernel receive queue drops, from SO_RXQ_OVFL. */
+	uint32_t dropped = 0, last_dropped = 0;
+	uint64_t rx_ns = 0, tx_ns = 0, now = 0, batch_ns = 0, last_report = 0;
+	bool is_msg = false;
+	/* Removed at exit, if bound to a path. */
+	const char *unix_path = NULL;
+
+	if (opts->format == OUT_BINARY && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "Not writing a binary log to a terminal\n");
+		goto socket_err;
+	}
+	if (out_init(&out, STDOUT_FILENO, opts->format) != 0) {
+		perror("Failed to allocate output buffer");
+		goto socket_err;
+	}
+
+	/* Create socket fd. */
+	servfd = socket(family, SOCK_DGRAM, 0);
+	if (servfd < 0) {
+		perror("Failed to create socket");
+		goto socket_err;
+	}
+
+	/* Kernel receive timestamps for one-way latency, drop counts, and a
+	 * timeout so reports and flushes happen while idle.
+	 */
+#ifdef SO_TIMESTAMPNS
+	if (setsockopt(servfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0)
+		perror("Failed to enable SO_TIMESTAMPNS");
+#endif
+#ifdef SO_RXQ_OVFL
+	if (setsockopt(servfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) != 0)
+		perror("Failed to enable SO_RXQ_OVFL");
+#endif
+	(void)on;
+	setsockopt(servfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	/* Bind address. */
+	ret = bind(servfd, listen_addr, listen_addr_len);
+	if (ret < 0) {
+		perror("Failed to bind");
+		goto bind_err;
+	}
+	if (family == AF_UNIX
+	    && ((struct sockaddr_un *)listen_addr)->sun_path[0] != '\0')
+		unix_path = ((struct sockaddr_un *)listen_addr)->sun_path;
+
+	for (size_t i = 0; i < RECV_BATCH; ++i) {
+		iovs[i].iov_base = buffers[i];
+		iovs[i].iov_len = MAX_PACKET_SIZE;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = control[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+	}
+	last_report = clock_ns(CLOCK_MONOTONIC);
+
+	/* Accept packets. */
+	while (!stop) {
+		now = clock_ns(CLOCK_MONOTONIC);
+		if (now - last_report >= REPORT_INTERVAL * 1000000000ULL) {
+			for (size_t s = 0; s < streams_len; ++s) {
+				st = &streams[s];
+				if (st->recv != st->last_recv)
+					stream_report(st, (now - last_report) / 1e9);
+				st->last_recv = st->recv;
+			}
+			if (dropped != last_dropped) {
+				fprintf(stderr, "WARN: receive queue dropped %" PRIu32
+				        " datagrams\n", (uint32_t)(dropped - last_dropped));
+			}
+			last_dropped = dropped;
+			last_report = now;
+		}
+		if (now - out.last_flush >= opts->flush * 1000000ULL) {
+			if (out_flush(&out, now) != 0) goto out_err;
+		}
+
+		/* Wait for one datagram, then take what is queued. */
+		ret = recvmmsg(servfd, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
+
+		/* Check error and handle appropriately. */
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				continue;
+			} else if (errno == ECONNREFUSED) {
+				++errcount;
+				fprintf(stderr,
+				        "Failed to receive: Connection refused (%d try): %s",
+				        errcount, strerror(errno));
+				if (errcount > MAX_ERROR_COUNT) {
+					goto recv_err;
+				}
+				continue;
+			} else {
+				perror("Failed to receive");
+				goto recv_err;
+			}
+		}
+
+		batch_ns = 0;
+		for (int i = 0; i < ret; ++i) {
+			struct msghdr *msg = &msgs[i].msg_hdr;
+
+			/* AF_UNIX names vary in length and unbound senders have none,
+			 * clear what's left of the previous name.
+			 */
+			if (family == AF_UNIX) {
+				memset((char *)&addrs[i] + msg->msg_namelen, 0,
+				       sizeof(addrs[i]) - msg->msg_namelen);
+				addrs[i].ss_family = AF_UNIX;
+			}
+			/* Kernel time if we got it, else one clock read per batch. */
+			rx_cmsg_parse(msg, &cmsg);
+			/* The counter is left out while it's 0. */
+			if (cmsg.dropped != 0) dropped = cmsg.dropped;
+			rx_ns = cmsg.timestamp;
+			if (rx_ns == 0) {
+				if (batch_ns == 0) batch_ns = clock_ns(CLOCK_REALTIME);
+				rx_ns = batch_ns;
+			}
+
+			is_msg = false;
+			if (msgs[i].msg_len >= sizeof(hdr)) {
+				memcpy(&hdr, buffers[i], sizeof(hdr));
+				is_msg = ntohl(hdr.magic) == MSG_MAGIC;
+			}
+			if (is_msg) {
+				tx_ns = be64toh(hdr.tx_ns);
+				st = stream_find(streams, &streams_len, ntohl(hdr.stream),
+				                 be64toh(hdr.seq));
+				st->last_rx = rx_ns;
+				/* Clocks that are behind count as no latency. */
+				stream_update(st, be64toh(hdr.seq), msgs[i].msg_len,
+				              rx_ns > tx_ns ? rx_ns - tx_ns : 0);
+			}
+
+			if (opts->format != OUT_NONE && (!is_msg || opts->all)) {
+				if (out_record(&out, &addrs[i], buffers[i], msgs[i].msg_len,
+				               rx_ns, is_msg ? &hdr : NULL) != 0) {
+					goto out_err;
+				}
+			}
+
+			/* recvmmsg only resets the lengths of what it filled. */
+			msg->msg_namelen = sizeof(addrs[i]);
+			msg->msg_controllen = sizeof(control[i]);
+		}
+	}
+
+	for (size_t s = 0; s < streams_len; ++s) {
+		stream_report(&streams[s], 0);
+	}
+	status = EXIT_SUCCESS;
+
+	recv_err:
+	if (out_flush(&out, 0) != 0) status = EXIT_FAILURE;
+	out_err:
+	if (opts->format != OUT_NONE) {
+		fprintf(stderr, "INFO: wrote %" PRIu64 " bytes in %" PRIu64
+		        " writes\n", out.bytes, out.writes);
+	}
+	if (unix_path != NULL) unlink(unix_path);
+	bind_err:
+	if (close(servfd) != 0) perror("Failed to close servfd");
+	socket_err:
+	free(out.mem);
+	return status;
+}
+
+int out_init(struct out_buf *out, int fd, enum out_format format) {
+	memset(out, 0, sizeof(*out));
+	out->fd = fd;
+	out->format = format;
+	if (format == OUT_NONE) return 0;
+
+	out->mem = malloc(OUT_CHUNKS * OUT_CHUNK_SIZE);
+	if (out->mem == NULL) return 1;
+	for (size_t i = 0; i < OUT_CHUNKS; ++i) {
+		out->iov[i].iov_base = out->mem + i * OUT_CHUNK_SIZE;
+	}
+	if (format == OUT_BINARY) {
+		memcpy(out->mem, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+		out->iov[0].iov_len = sizeof(CAPTURE_MAGIC) - 1;
+	}
+
+	return 0;
+}
+
+int out_flush(struct out_buf *out, uint64_t now) {
+	struct iovec *iov = out->iov;
+	int iovcnt = out->chunk < OUT_CHUNKS ? out->chunk + 1 : OUT_CHUNKS;
+	ssize_t written = 0;
+
+	out->last_flush = now;
+	if (out->mem == NULL || (out->chunk == 0 && iov->iov_len == 0))
+		return 0;
+
+	while (iovcnt > 0) {
+		written = writev(out->fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			perror("Failed to write output");
+			return 1;
+		}
+		out->bytes += written;
+		/* Skip what was written, partial writes continue mid chunk. */
+		for (; iovcnt > 0 && (size_t)written >= iov->iov_len; ++iov, --iovcnt)
+			written -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	++out->writes;
+
+	for (size_t i = 0; i < OUT_CHUNKS; ++i) {
+		out->iov[i].iov_base = out->mem + i * OUT_CHUNK_SIZE;
+		out->iov[i].iov_len = 0;
+	}
+	out->chunk = 0;
+
+	return 0;
+}
+
+int out_record(struct out_buf *out, const struct sockaddr_storage *addr,
+               const char *payload, size_t len, uint64_t rx_ns,
+               const struct msg_hdr *hdr) {
+	struct iovec *iov = &out->iov[out->chunk];
+	char *dst = NULL, *start = NULL;
+
+	/* Records never span chunks, a full buffer is flushed at once. */
+	if (iov->iov_len + OUT_RECORD_MAX > OUT_CHUNK_SIZE) {
+		if (++out->chunk == OUT_CHUNKS
+		    && out_flush(out, clock_ns(CLOCK_MONOTONIC)) != 0) {
+			return 1;
+		}
+		iov = &out->iov[out->chunk];
+	}
+	start = dst = (char *)iov->iov_base + iov->iov_len;
+
+	if (out->format == OUT_BINARY) {
+		struct capture_rec rec = {0};
+
+		capture_rec_set(&rec, (const struct sockaddr *)addr, len, rx_ns);
+		memcpy(dst, &rec, sizeof(rec));
+		memcpy(dst + sizeof(rec), payload, len);
+		iov->iov_len += sizeof(rec) + len;
+		return 0;
+	}
+
+	/* Text, formatted by hand, printf costs more than the receive. */
+	dst = fmt_str(dst, "Received (");
+	dst = fmt_ip(dst, addr);
+	*dst++ = ' ';
+	dst = fmt_u64(dst, len);
+	dst = fmt_str(dst, "): ");
+	if (hdr != NULL) {
+		dst = fmt_str(dst, "stream ");
+		dst = fmt_hex32(dst, ntohl(hdr->stream));
+		dst = fmt_str(dst, " seq ");
+		dst = fmt_u64(dst, be64toh(hdr->seq));
+	} else {
+		while (len > 0 && payload[len - 1] == '\n') --len;
+		*dst++ = '"';
+		memcpy(dst, payload, len);
+		dst += len;
+		*dst++ = '"';
+	}
+	*dst++ = '\n';
+	iov->iov_len += dst - start;
+
+	return 0;
+}
+
+char *fmt_str(char *dst, const char *str) {
+	const size_t len = strlen(str);
+
+	memcpy(dst, str, len);
+	return dst + len;
+}
+
+char *fmt_u64(char *dst, uint64_t value) {
+	char digits[20];
+	size_t n = 0;
+
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+	while (n > 0) *dst++ = digits[--n];
+
+	return dst;
+}
+
+char *fmt_hex32(char *dst, uint32_t value) {
+	for (int shift = 28; shift >= 0; shift -= 4) {
+		*dst++ = "0123456789abcdef"[(value >> shift) & 0xf];
+	}
+
+	return dst;
+}
+
+char *fmt_ip(char *dst, const struct sockaddr_storage *addr) {
+	if (addr->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+
+		if (inet_ntop(AF_INET6, &addr6->sin6_addr, dst,
+		              INET6_ADDRSTRLEN) == NULL) {
+			return fmt_str(dst, "?");
+		}
+		return dst + strlen(dst);
+	} else if (addr->ss_family == AF_UNIX) {
+		const struct sockaddr_un *addr_un = (const struct sockaddr_un *)addr;
+		/* sun_path is zero after the name. */
+		const size_t max = sizeof(addr_un->sun_path) - 1;
+
+		if (addr_un->sun_path[0] != '\0') {
+			const size_t len = strnlen(addr_un->sun_path, max);
+
+			memcpy(dst, addr_un->sun_path, len);
+			return dst + len;
+		} else if (addr_un->sun_path[1] != '\0') {
+			const size_t len = strnlen(&addr_un->sun_path[1], max);
+
+			*dst++ = '@';
+			memcpy(dst, &addr_un->sun_path[1], len);
+			return dst + len;
+		}
+		return fmt_str(dst, "unnamed");
+	} else {
+		const struct sockaddr_in *addr4 = (const struct sockaddr_in *)addr;
+		const uint8_t *bytes = (const uint8_t *)&addr4->sin_addr;
+
+		for (size_t i = 0; i < 4; ++i) {
+			if (i > 0) *dst++ = '.';
+			dst = fmt_u64(dst, bytes[i]);
+		}
+		return dst;
+	}
+}
+
+void stream_reset(struct stream_stats *st, uint32_t stream, uint64_t seq) {
+	memset(st, 0, sizeof(*st));
+	st->stream = stream;
+	st->first = seq;
+	st->next = seq;
+	st->latency_min = UINT64_MAX;
+}
+
+struct stream_stats *stream_find(struct stream_stats *streams, size_t *len,
+                                 uint32_t stream, uint64_t seq) {
+	struct stream_stats *oldest = NULL;
+
+	for (size_t s = 0; s < *len; ++s) {
+		if (streams[s].stream == stream) return &streams[s];
+		if (oldest == NULL || streams[s].last_rx < oldest->last_rx)
+			oldest = &streams[s];
+	}
+	if (*len < STREAMS_MAX) {
+		oldest = &streams[(*len)++];
+	} else {
+		stream_report(oldest, 0);
+	}
+	stream_reset(oldest, stream, seq);
+
+	return oldest;
+}
+
+void stream_update(struct stream_stats *st, uint64_t seq, size_t len,
+                   uint64_t latency) {
+	const uint64_t bit = 1ULL << (seq % 64);
+	uint64_t *word = &st->seen[seq % SEQ_WINDOW / 64];
+
+	++st->recv;
+	st->bytes += len;
+	hist_add(&st->latency, latency);
+	if (latency < st->latency_min) st->latency_min = latency;
+
+	if (seq >= st->next) {
+		/* Forget the seqs that slide out of the window. */
+		if (seq - st->next >= SEQ_WINDOW) {
+			memset(st->seen, 0, sizeof(st->seen));
+		} else {
+			for (uint64_t s = st->next; s < seq; ++s) {
+				st->seen[s % SEQ_WINDOW / 64] &= ~(1ULL << (s % 64));
+			}
+		}
+		*word |= bit;
+		st->next = seq + 1;
+	} else if (st->next - seq > SEQ_WINDOW || seq < st->first) {
+		++st->late;
+	} else if (*word & bit) {
+		++st->dup;
+	} else {
+		*word |= bit;
+		++st->reorder;
+	}
+}
+
+void stream_report(const struct stream_stats *st, double interval) {
+	const uint64_t expected = st->next - st->first;
+	const uint64_t unique = st->recv - st->dup;
+	const uint64_t lost = expected > unique ? expected - unique : 0;
 
+	fprintf(stderr, "INFO: stream %08" PRIx32 ": recv %" PRIu64,
+	        st->stream, st->recv);
+	if (interval > 0)
+		fprintf(stderr, " (%.0f/s)", (st->recv - st->last_recv) / interval);
+	fprintf(stderr, " lost %" PRIu64 " (%.3f%%) reorder %" PRIu64
+	        " dup %" PRIu64 " late %" PRIu64, lost,
+	        expected > 0 ? 100.0 * lost / expected : 0.0, st->reorder,
+	        st->dup, st->late);
+	/* Nothing came back (-e), there is no latency to show. */
+	if (st->recv == 0) {
+		fprintf(stderr, "\n");
+		return;
 	}
+	fprintf(stderr, " latency min %.1fus p50 %.1fus p99 %.1fus"
+	        " p999 %.1fus max %.1fus\n", st->latency_min / 1e3,
+	        hist_quantile(&st->latency, 500) / 1e3,
+	        hist_quantile(&st->latency, 990) / 1e3,
+	        hist_quantile(&st->latency, 999) / 1e3, st->latency.max / 1e3);
 }